@@ -0,0 +1,220 @@
+/*
+Description:
+	AES-128 block encryption and AES-CMAC (RFC 4493).
+	On x86 the whole CMAC chain runs in AES-NI registers, the instructions are
+	enabled per function so the file builds without -maes and the CPU is
+	probed at run time. The portable implementation is a plain byte-oriented
+	AES, constant memory footprint and no tables besides the S-box.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <string.h>		/* memcpy, memset */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define CMAC_AESNI
+	#include <wmmintrin.h>	/* AES-NI intrinsics */
+	#include <emmintrin.h>	/* SSE2 intrinsics */
+#endif
+
+#include "aes_cmac.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static bool aes_hw = false; /* set by cmac_init, before any cmac_compute */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static inline uint8_t aes_xtime(uint8_t x) {
+	return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
+
+static void aes_expand(uint8_t rk[176], const uint8_t key[16]) {
+	uint8_t rcon = 0x01;
+	uint8_t tmp[4];
+	int i;
+
+	memcpy(rk, key, 16);
+	for (i = 16; i < 176; i += 4) {
+		memcpy(tmp, &rk[i - 4], 4);
+		if ((i % 16) == 0) {
+			/* RotWord, SubWord, Rcon */
+			uint8_t t0 = tmp[0];
+			tmp[0] = aes_sbox[tmp[1]] ^ rcon;
+			tmp[1] = aes_sbox[tmp[2]];
+			tmp[2] = aes_sbox[tmp[3]];
+			tmp[3] = aes_sbox[t0];
+			rcon = aes_xtime(rcon);
+		}
+		rk[i + 0] = rk[i - 16] ^ tmp[0];
+		rk[i + 1] = rk[i - 15] ^ tmp[1];
+		rk[i + 2] = rk[i - 14] ^ tmp[2];
+		rk[i + 3] = rk[i - 13] ^ tmp[3];
+	}
+}
+
+static void aes_encrypt_sw(const uint8_t rk[176], uint8_t s[16]) {
+	uint8_t t[16];
+	uint8_t a, b, c, d, e;
+	int r, i;
+
+	for (i = 0; i < 16; ++i) s[i] ^= rk[i];
+	for (r = 1; r <= 10; ++r) {
+		/* SubBytes and ShiftRows, state is column-major */
+		for (i = 0; i < 16; ++i) {
+			t[i] = aes_sbox[s[(i + 4 * (i % 4)) % 16]];
+		}
+		/* MixColumns, skipped in the last round */
+		if (r < 10) {
+			for (i = 0; i < 16; i += 4) {
+				a = t[i]; b = t[i + 1]; c = t[i + 2]; d = t[i + 3];
+				e = a ^ b ^ c ^ d;
+				t[i + 0] ^= e ^ aes_xtime(a ^ b);
+				t[i + 1] ^= e ^ aes_xtime(b ^ c);
+				t[i + 2] ^= e ^ aes_xtime(c ^ d);
+				t[i + 3] ^= e ^ aes_xtime(d ^ a);
+			}
+		}
+		for (i = 0; i < 16; ++i) s[i] = t[i] ^ rk[16 * r + i];
+	}
+}
+
+/* left shift of a 128-bit string, with the RFC 4493 Rb constant folded in */
+static void cmac_dbl(uint8_t out[16], const uint8_t in[16]) {
+	uint8_t carry = in[0] >> 7;
+	int i;
+
+	for (i = 0; i < 15; ++i) {
+		out[i] = (uint8_t)((in[i] << 1) | (in[i + 1] >> 7));
+	}
+	out[15] = (uint8_t)((in[15] << 1) ^ (carry ? 0x87 : 0x00));
+}
+
+/* copy the last block of the message, padded and masked with the right subkey */
+static void cmac_last(const struct cmac_key * k, const uint8_t * msg, unsigned len, uint8_t last[16]) {
+	unsigned rem;
+	int i;
+
+	rem = (len == 0) ? 0 : len - 16 * ((len - 1) / 16);
+	memset(last, 0, 16);
+	if (rem > 0) memcpy(last, msg + len - rem, rem);
+	if (rem == 16) {
+		for (i = 0; i < 16; ++i) last[i] ^= k->k1[i];
+	} else {
+		last[rem] = 0x80;
+		for (i = 0; i < 16; ++i) last[i] ^= k->k2[i];
+	}
+}
+
+static void cmac_compute_sw(const struct cmac_key * k, const uint8_t * msg, unsigned len, uint8_t mac[16]) {
+	uint8_t last[16];
+	unsigned n, j;
+	int i;
+
+	n = (len == 0) ? 1 : (len + 15) / 16;
+	memset(mac, 0, 16);
+	for (j = 0; j + 1 < n; ++j) {
+		for (i = 0; i < 16; ++i) mac[i] ^= msg[16 * j + i];
+		aes_encrypt_sw(k->rk, mac);
+	}
+	cmac_last(k, msg, len, last);
+	for (i = 0; i < 16; ++i) mac[i] ^= last[i];
+	aes_encrypt_sw(k->rk, mac);
+}
+
+#ifdef CMAC_AESNI
+__attribute__((target("aes,sse2")))
+static inline __m128i aes_encrypt_ni(const __m128i * rk, __m128i s) {
+	s = _mm_xor_si128(s, _mm_load_si128(&rk[0]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[1]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[2]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[3]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[4]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[5]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[6]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[7]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[8]));
+	s = _mm_aesenc_si128(s, _mm_load_si128(&rk[9]));
+	return _mm_aesenclast_si128(s, _mm_load_si128(&rk[10]));
+}
+
+__attribute__((target("aes,sse2")))
+static void cmac_compute_ni(const struct cmac_key * k, const uint8_t * msg, unsigned len, uint8_t mac[16]) {
+	const __m128i * rk = (const __m128i *)k->rk;
+	uint8_t last[16];
+	__m128i s = _mm_setzero_si128();
+	unsigned n, j;
+
+	n = (len == 0) ? 1 : (len + 15) / 16;
+	for (j = 0; j + 1 < n; ++j) {
+		s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *)(msg + 16 * j)));
+		s = aes_encrypt_ni(rk, s);
+	}
+	cmac_last(k, msg, len, last);
+	s = _mm_xor_si128(s, _mm_loadu_si128((const __m128i *)last));
+	s = aes_encrypt_ni(rk, s);
+	_mm_storeu_si128((__m128i *)mac, s);
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+void cmac_init(struct cmac_key * k, const uint8_t key[16]) {
+	uint8_t l[16];
+
+#ifdef CMAC_AESNI
+	__builtin_cpu_init();
+	aes_hw = __builtin_cpu_supports("aes");
+#endif
+	aes_expand(k->rk, key);
+
+	/* L = AES(K, 0), K1 = dbl(L), K2 = dbl(K1) */
+	memset(l, 0, sizeof l);
+	aes_encrypt_sw(k->rk, l);
+	cmac_dbl(k->k1, l);
+	cmac_dbl(k->k2, k->k1);
+}
+
+void cmac_compute(const struct cmac_key * k, const uint8_t * msg, unsigned len, uint8_t mac[16]) {
+#ifdef CMAC_AESNI
+	if (aes_hw) {
+		cmac_compute_ni(k, msg, len, mac);
+		return;
+	}
+#endif
+	cmac_compute_sw(k, msg, len, mac);
+}
+
+bool cmac_hw_accelerated(void) {
+	return aes_hw;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,56 @@
+/*
+Description:
+	AES-128 block encryption and AES-CMAC (RFC 4493), as needed to verify the
+	MIC of LoRaWAN frames. Uses the AES-NI instructions when the CPU has them,
+	a portable implementation otherwise.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _AES_CMAC_H
+#define _AES_CMAC_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct cmac_key {
+	uint8_t rk[176] __attribute__((aligned(16)));	/* AES-128 round keys */
+	uint8_t k1[16] __attribute__((aligned(16)));	/* subkey for a complete last block */
+	uint8_t k2[16] __attribute__((aligned(16)));	/* subkey for a padded last block */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Expand an AES-128 key and derive the CMAC subkeys
+@param k pointer to the key context to fill
+@param key 16-byte secret key
+*/
+void cmac_init(struct cmac_key * k, const uint8_t key[16]);
+
+/**
+@brief Compute the AES-CMAC of a message
+@param k pointer to a key context initialized by cmac_init
+@param msg pointer to the message
+@param len length of the message in bytes
+@param mac 16-byte buffer receiving the tag
+*/
+void cmac_compute(const struct cmac_key * k, const uint8_t * msg, unsigned len, uint8_t mac[16]);
+
+/**
+@brief Tell which AES implementation is in use
+@return true if AES-NI instructions are used
+*/
+bool cmac_hw_accelerated(void);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,363 @@
+/*
+Description:
+	Time-on-air of downlinks and duty-cycle budget enforcement.
+	The LoRa payload symbol count only depends on SF, coding rate, CRC, low
+	data rate optimization and size, it is tabulated for every combination
+	with an explicit header so that the airtime of a frame costs one table
+	read and a multiply; the symbol duration is an exact number of us for
+	every SF and bandwidth. Implicit header frames use the same formula
+	without the table.
+	Each sub-band and RF chain has a ledger splitting the window in
+	DUTY_SLOTS slots, the airtime spent in a slot is forgotten once the slot
+	leaves the window. A frame is checked when it is queued and again just
+	before it is sent, and only charged once the concentrator took it, so
+	rejected or failed frames cost no budget.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stdio.h>		/* printf */
+#include <string.h>		/* memset */
+#include <pthread.h>
+
+#include "parson.h"
+#include "loragw_hal.h"
+#include "airtime.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define AT_NB_SF		6	/* SF7 to SF12 */
+#define AT_NB_CR		4	/* 4/5 to 4/8 */
+#define AT_MAX_SIZE		256
+
+#define DUTY_SLOTS		60	/* resolution of the sliding window */
+#define DUTY_WINDOW		3600	/* default window, in seconds */
+
+/* ETSI EN 300 220 sub-bands used by EU868, frequencies in Hz */
+static const struct {
+	uint32_t min;
+	uint32_t max;
+	double duty;
+} duty_eu868[] = {
+	{863000000, 865000000, 0.001},
+	{865000000, 868000000, 0.01},
+	{868000000, 868600000, 0.01},
+	{868700000, 869200000, 0.001},
+	{869400000, 869650000, 0.1},
+	{869700000, 870000000, 0.01}
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct duty_ledger {
+	bool limited;		/* false if the budget is not enforced */
+	uint64_t budget_us;	/* airtime allowed over the window */
+	uint64_t used_us;	/* airtime spent over the window, sum of the slots */
+	uint32_t slot;		/* index of the current slot, time / slot_ms */
+	uint64_t slots[DUTY_SLOTS];	/* airtime spent per slot, circular */
+};
+
+struct duty_band {
+	uint32_t min;		/* lowest frequency, inclusive */
+	uint32_t max;		/* highest frequency, exclusive */
+	struct duty_ledger ledger;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+/* payload symbols, explicit header, indexed by [SF-7][CR-1][CRC][LDRO][size] */
+static uint16_t at_symbols[AT_NB_SF][AT_NB_CR][2][2][AT_MAX_SIZE];
+
+static pthread_mutex_t mx_duty = PTHREAD_MUTEX_INITIALIZER; /* control access to the ledgers */
+static bool duty_on = false;
+static uint32_t duty_slot_ms = DUTY_WINDOW * 1000 / DUTY_SLOTS;
+static int duty_nb_bands = 0;
+static struct duty_band duty_bands[DUTY_MAX_BANDS];
+static struct duty_ledger duty_chains[LGW_RF_CHAIN_NB];
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+/* Semtech AN1200.13, with the 4.25 symbols of the preamble counted apart */
+static uint16_t at_payload_symbols(int sf, int cr, bool crc, bool ih, bool de, int size) {
+	int num, den, n;
+
+	num = 8 * size - 4 * sf + 28 + (crc ? 16 : 0) - (ih ? 20 : 0);
+	den = 4 * (sf - (de ? 2 : 0));
+	n = (num > 0) ? (num + den - 1) / den : 0;
+	return (uint16_t)(8 + n * (cr + 4));
+}
+
+static int at_sf(uint32_t datarate) {
+	switch (datarate) {
+		case DR_LORA_SF7:  return 7;
+		case DR_LORA_SF8:  return 8;
+		case DR_LORA_SF9:  return 9;
+		case DR_LORA_SF10: return 10;
+		case DR_LORA_SF11: return 11;
+		case DR_LORA_SF12: return 12;
+		default:           return 0;
+	}
+}
+
+/* symbol duration is 2^SF / BW, exact in us for 125, 250 and 500 kHz */
+static uint32_t at_bw_mul(uint8_t bandwidth) {
+	switch (bandwidth) {
+		case BW_125KHZ: return 8;
+		case BW_250KHZ: return 4;
+		case BW_500KHZ: return 2;
+		default:        return 0;
+	}
+}
+
+static void duty_reset(struct duty_ledger * l, bool limited, double duty, uint32_t window_s) {
+	memset(l, 0, sizeof *l);
+	l->limited = limited;
+	l->budget_us = (uint64_t)(duty * window_s * 1e6);
+}
+
+/* forget the slots that left the window */
+static void duty_advance(struct duty_ledger * l, uint32_t slot) {
+	if ((uint32_t)(slot - l->slot) >= DUTY_SLOTS) {
+		memset(l->slots, 0, sizeof l->slots);
+		l->used_us = 0;
+	} else {
+		while (l->slot != slot) {
+			l->slot += 1;
+			l->used_us -= l->slots[l->slot % DUTY_SLOTS];
+			l->slots[l->slot % DUTY_SLOTS] = 0;
+		}
+	}
+	l->slot = slot;
+}
+
+static bool duty_fits(struct duty_ledger * l, uint32_t slot, uint32_t toa) {
+	if (!l->limited) return true;
+	duty_advance(l, slot);
+	return (l->used_us + toa <= l->budget_us);
+}
+
+static void duty_add(struct duty_ledger * l, uint32_t slot, uint32_t toa) {
+	if (!l->limited) return;
+	duty_advance(l, slot);
+	l->used_us += toa;
+	l->slots[l->slot % DUTY_SLOTS] += toa;
+}
+
+/* get the ledgers a packet is charged to, NULL if none, mx_duty must be held */
+static void duty_ledgers(const struct lgw_pkt_tx_s * p, struct duty_ledger ** band, struct duty_ledger ** chain) {
+	int i;
+
+	*band = NULL;
+	*chain = NULL;
+	for (i = 0; i < duty_nb_bands; ++i) {
+		if ((p->freq_hz >= duty_bands[i].min) && (p->freq_hz < duty_bands[i].max)) {
+			*band = &duty_bands[i].ledger;
+			break;
+		}
+	}
+	if (p->rf_chain < LGW_RF_CHAIN_NB) *chain = &duty_chains[p->rf_chain];
+}
+
+static int duty_parse_fraction(const JSON_Value * val, double * duty) {
+	if (json_value_get_type(val) != JSONNumber) return -1;
+	*duty = json_value_get_number(val);
+	if ((*duty <= 0.0) || (*duty > 1.0)) return -1;
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+void airtime_init(void) {
+	int sf, cr, crc, de, size;
+
+	for (sf = 0; sf < AT_NB_SF; ++sf) {
+		for (cr = 0; cr < AT_NB_CR; ++cr) {
+			for (crc = 0; crc < 2; ++crc) {
+				for (de = 0; de < 2; ++de) {
+					for (size = 0; size < AT_MAX_SIZE; ++size) {
+						at_symbols[sf][cr][crc][de][size] = at_payload_symbols(sf + 7, cr + 1, crc, false, de, size);
+					}
+				}
+			}
+		}
+	}
+}
+
+uint32_t airtime_us(const struct lgw_pkt_tx_s * p) {
+	uint32_t tsym, nsym;
+	uint64_t bits, us;
+	int sf;
+	bool de;
+
+	if (p->modulation == MOD_LORA) {
+		sf = at_sf(p->datarate);
+		tsym = at_bw_mul(p->bandwidth) << sf;
+		if ((sf == 0) || (tsym == 0) || (p->coderate < CR_LORA_4_5) || (p->coderate > CR_LORA_4_8) || (p->size >= AT_MAX_SIZE)) {
+			return 0;
+		}
+		/* low data rate optimization, as set by the HAL */
+		de = (p->bandwidth == BW_125KHZ) && (sf >= 11);
+		if (p->no_header) {
+			nsym = at_payload_symbols(sf, p->coderate, !p->no_crc, true, de, p->size);
+		} else {
+			nsym = at_symbols[sf - 7][p->coderate - 1][!p->no_crc][de][p->size];
+		}
+		/* in quarter symbols: preamble, 4.25 sync symbols, payload */
+		us = ((4 * (uint64_t)p->preamble + 17 + 4 * nsym) * tsym + 3) / 4;
+		return (us < UINT32_MAX) ? (uint32_t)us : UINT32_MAX;
+	} else if (p->modulation == MOD_FSK) {
+		if (p->datarate == 0) return 0;
+		/* preamble, 3 bytes of sync word, length byte, payload, CRC */
+		bits = 8 * ((uint64_t)p->preamble + 3 + 1 + p->size + (p->no_crc ? 0 : 2));
+		us = (bits * 1000000 + p->datarate - 1) / p->datarate;
+		return (us < UINT32_MAX) ? (uint32_t)us : UINT32_MAX;
+	}
+	return 0;
+}
+
+int duty_configure(const JSON_Object * conf) {
+	JSON_Array *arr;
+	const JSON_Object *obj;
+	JSON_Value *val;
+	struct duty_band bands[DUTY_MAX_BANDS];
+	double chain_duty[LGW_RF_CHAIN_NB];
+	bool chain_limited[LGW_RF_CHAIN_NB];
+	uint32_t window_s = DUTY_WINDOW;
+	double duty;
+	int nb_bands, i;
+	size_t n;
+
+	val = json_object_get_value(conf, "window");
+	if (val != NULL) {
+		if ((json_value_get_type(val) != JSONNumber) || (json_value_get_number(val) < 1.0)) {
+			MSG("ERROR: [duty] \"window\" must be a number of seconds\n");
+			return -1;
+		}
+		window_s = (uint32_t)json_value_get_number(val);
+	}
+
+	/* sub-bands, EU868 unless configured */
+	arr = json_object_get_array(conf, "bands");
+	if (arr != NULL) {
+		n = json_array_get_count(arr);
+		if (n > DUTY_MAX_BANDS) {
+			MSG("ERROR: [duty] too many sub-bands, %i max\n", DUTY_MAX_BANDS);
+			return -1;
+		}
+		for (i = 0; i < (int)n; ++i) {
+			obj = json_array_get_object(arr, i);
+			if ((obj == NULL) || (json_object_get_value(obj, "min") == NULL) || (json_object_get_value(obj, "max") == NULL)
+				|| (duty_parse_fraction(json_object_get_value(obj, "duty"), &duty) != 0)) {
+				MSG("ERROR: [duty] sub-band %i must have \"min\", \"max\" and a \"duty\" in ]0,1]\n", i);
+				return -1;
+			}
+			bands[i].min = (uint32_t)(1.0e6 * json_object_get_number(obj, "min"));
+			bands[i].max = (uint32_t)(1.0e6 * json_object_get_number(obj, "max"));
+			if (bands[i].min >= bands[i].max) {
+				MSG("ERROR: [duty] sub-band %i is empty\n", i);
+				return -1;
+			}
+			duty_reset(&bands[i].ledger, true, duty, window_s);
+		}
+		nb_bands = (int)n;
+	} else {
+		nb_bands = (int)(sizeof duty_eu868 / sizeof duty_eu868[0]);
+		for (i = 0; i < nb_bands; ++i) {
+			bands[i].min = duty_eu868[i].min;
+			bands[i].max = duty_eu868[i].max;
+			duty_reset(&bands[i].ledger, true, duty_eu868[i].duty, window_s);
+		}
+	}
+
+	/* RF chains, not limited unless configured */
+	arr = json_object_get_array(conf, "rf_chain");
+	n = (arr != NULL) ? json_array_get_count(arr) : 0;
+	if (n > LGW_RF_CHAIN_NB) {
+		MSG("ERROR: [duty] too many RF chains, %i max\n", LGW_RF_CHAIN_NB);
+		return -1;
+	}
+	for (i = 0; i < LGW_RF_CHAIN_NB; ++i) {
+		chain_limited[i] = (i < (int)n);
+		chain_duty[i] = 1.0;
+		if (chain_limited[i] && (duty_parse_fraction(json_array_get_value(arr, i), &chain_duty[i]) != 0)) {
+			MSG("ERROR: [duty] duty-cycle of RF chain %i must be in ]0,1]\n", i);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&mx_duty);
+	duty_slot_ms = (window_s * 1000 + DUTY_SLOTS - 1) / DUTY_SLOTS;
+	duty_nb_bands = nb_bands;
+	memcpy(duty_bands, bands, nb_bands * sizeof bands[0]);
+	for (i = 0; i < LGW_RF_CHAIN_NB; ++i) {
+		duty_reset(&duty_chains[i], chain_limited[i], chain_duty[i], window_s);
+	}
+	duty_on = true;
+	pthread_mutex_unlock(&mx_duty);
+
+	MSG("INFO: [duty] %i sub-bands, %u s window\n", nb_bands, window_s);
+	for (i = 0; i < nb_bands; ++i) {
+		MSG("INFO: [duty] %.3f-%.3f MHz, %llu ms of airtime\n", bands[i].min / 1e6, bands[i].max / 1e6, (unsigned long long)(bands[i].ledger.budget_us / 1000));
+	}
+	for (i = 0; i < LGW_RF_CHAIN_NB; ++i) {
+		if (chain_limited[i]) MSG("INFO: [duty] RF chain %i, %.1f%% duty-cycle\n", i, 100.0 * chain_duty[i]);
+	}
+	return 0;
+}
+
+bool duty_enabled(void) {
+	return duty_on;
+}
+
+int duty_check(const struct lgw_pkt_tx_s * p, uint32_t now_ms, uint32_t * toa_us) {
+	struct duty_ledger *band, *chain;
+	uint32_t toa, slot;
+	int verdict = DUTY_PASS;
+
+	toa = airtime_us(p);
+	if (toa_us != NULL) *toa_us = toa;
+	if (!duty_on) return DUTY_PASS;
+
+	pthread_mutex_lock(&mx_duty);
+	slot = now_ms / duty_slot_ms;
+	duty_ledgers(p, &band, &chain);
+	if ((band != NULL) && !duty_fits(band, slot, toa)) {
+		verdict = DUTY_BAND;
+	} else if ((chain != NULL) && !duty_fits(chain, slot, toa)) {
+		verdict = DUTY_RF_CHAIN;
+	}
+	pthread_mutex_unlock(&mx_duty);
+	return verdict;
+}
+
+void duty_charge(const struct lgw_pkt_tx_s * p, uint32_t now_ms, uint32_t toa_us) {
+	struct duty_ledger *band, *chain;
+	uint32_t slot;
+
+	if (!duty_on) return;
+
+	pthread_mutex_lock(&mx_duty);
+	slot = now_ms / duty_slot_ms;
+	duty_ledgers(p, &band, &chain);
+	if (band != NULL) duty_add(band, slot, toa_us);
+	if (chain != NULL) duty_add(chain, slot, toa_us);
+	pthread_mutex_unlock(&mx_duty);
+}
+
+/* --- EOF ------------------------------------------------------------------ */
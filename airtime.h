@@ -0,0 +1,94 @@
+/*
+Description:
+	Time-on-air of downlinks and duty-cycle budget enforcement.
+	The airtime of a LoRa frame is read from a table of payload symbol counts
+	indexed by SF, coding rate, CRC, low data rate optimization and size,
+	built once by airtime_init. Each sub-band and each RF chain keeps the
+	airtime it spent over a sliding window, a downlink is rejected if it
+	would take either of them over its budget.
+	Configured by the "duty_cycle" object of gateway_conf:
+	{"window": 3600, "bands": [{"min": 868.0, "max": 868.6, "duty": 0.01}],
+	"rf_chain": [0.1, 0.1]}, the EU868 sub-bands are used if "bands" is absent.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _AIRTIME_H
+#define _AIRTIME_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+
+#include "parson.h"
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+/* verdicts */
+#define DUTY_PASS		0
+#define DUTY_BAND		1	/* rejected, sub-band is over its budget */
+#define DUTY_RF_CHAIN	2	/* rejected, RF chain is over its budget */
+
+#define DUTY_MAX_BANDS	16	/* max number of sub-bands in the configuration */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Build the symbol count table, must be called before airtime_us
+*/
+void airtime_init(void);
+
+/**
+@brief Compute the time-on-air of a packet
+@param p pointer to the packet about to be sent
+@return airtime in microseconds, UINT32_MAX if longer, 0 if the modulation parameters are invalid
+*/
+uint32_t airtime_us(const struct lgw_pkt_tx_s * p);
+
+/**
+@brief Configure the duty-cycle budgets and enable their enforcement
+@param conf pointer to the "duty_cycle" JSON object
+@return 0 if the configuration is valid, -1 otherwise
+
+Resets the airtime ledgers, may be called again to replace the configuration.
+*/
+int duty_configure(const JSON_Object * conf);
+
+/**
+@brief Tell if duty-cycle budgets are enforced
+@return true once duty_configure succeeded
+*/
+bool duty_enabled(void);
+
+/**
+@brief Tell if a downlink fits in the duty-cycle budgets of its sub-band and RF chain
+@param p pointer to the packet about to be sent
+@param now_ms monotonic time in ms
+@param toa_us set to the airtime of the packet, may be NULL
+@return DUTY_PASS if the airtime fits, DUTY_BAND or DUTY_RF_CHAIN otherwise
+
+Thread-safe. Nothing is charged, see duty_charge. Frames on a frequency
+outside every sub-band are only checked against their RF chain.
+*/
+int duty_check(const struct lgw_pkt_tx_s * p, uint32_t now_ms, uint32_t * toa_us);
+
+/**
+@brief Charge the airtime of a downlink to its sub-band and RF chain
+@param p pointer to the packet handed to the concentrator
+@param now_ms monotonic time in ms
+@param toa_us airtime of the packet, as returned by duty_check
+
+Thread-safe. Call it once the packet was actually sent, a budget may then
+go over its limit if the packet was not checked just before.
+*/
+void duty_charge(const struct lgw_pkt_tx_s * p, uint32_t now_ms, uint32_t toa_us);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,205 @@
+/*
+Description:
+	b64-bench: measure the base64 throughput of each implementation.
+	base64_simd.c is built in so every path b64_simd_init can select on this
+	CPU is run, the scalar one included. For each path the output of
+	bin_to_b64_simd and b64_to_bin_simd is first checked against bin_to_b64
+	and b64_to_bin on random payloads of 1 to 255 bytes, then encoding and
+	decoding are timed in MB/s of binary data, per payload size and over
+	all the sizes from 1 to 255 bytes in turn.
+
+	Usage: b64-bench [MB per measure]
+	Build with base64_simd.c left out of the sources, this file includes it.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+/* fix an issue between POSIX and C99 */
+#if __STDC_VERSION__ >= 199901L
+	#define _XOPEN_SOURCE 600
+#else
+	#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdbool.h>	/* bool type */
+#include <stdio.h>		/* printf */
+#include <stdlib.h>		/* atoi */
+#include <string.h>		/* memcmp */
+#include <time.h>		/* clock_gettime */
+
+/* the vectorized base64, static functions included */
+#include "base64_simd.c"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define BENCH_MB		8		/* binary data per measure */
+#define BENCH_MAX_SIZE	255		/* largest LoRa payload */
+#define BENCH_CHECKS	1000	/* random payloads checked per size */
+#define BENCH_B64_SIZE	(4 * ((BENCH_MAX_SIZE + 2) / 3) + 1)
+
+static const int bench_sizes[] = {1, 4, 8, 12, 16, 23, 32, 48, 51, 64, 96, 128, 192, 222, 255};
+
+#define BENCH_NB_SIZES	(int)(sizeof bench_sizes / sizeof bench_sizes[0])
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct bench_path {
+	const char * name;
+	int (*enc)(const uint8_t * in, int size, char * out);
+	int (*dec)(const char * in, int size, uint8_t * out, int room);
+	bool ok; /* usable on this CPU */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static struct bench_path bench_paths[] = {
+	{"scalar", NULL, NULL, true},
+#if defined(B64_X86)
+	{"ssse3", b64_enc_ssse3, b64_dec_ssse3, false},
+	{"avx2", b64_enc_avx2, b64_dec_avx2, false},
+#elif defined(B64_NEON)
+	{"neon", b64_enc_neon, b64_dec_neon, false},
+#endif
+};
+
+#define BENCH_NB_PATHS	(int)(sizeof bench_paths / sizeof bench_paths[0])
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+static volatile uint32_t bench_sink; /* keeps the conversions from being optimized out */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static uint64_t bench_ns(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* xorshift64* */
+static uint32_t bench_rand(void) {
+	bench_seed ^= bench_seed >> 12;
+	bench_seed ^= bench_seed << 25;
+	bench_seed ^= bench_seed >> 27;
+	return (uint32_t)((bench_seed * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* select a path the way b64_simd_init would */
+static void bench_select(const struct bench_path * p) {
+	b64_enc_bulk = p->enc;
+	b64_dec_bulk = p->dec;
+}
+
+/* same output and return values as base64.h on random payloads of every size */
+static bool bench_check(const struct bench_path * p) {
+	uint8_t bin[BENCH_MAX_SIZE], bin_ref[BENCH_MAX_SIZE], bin_simd[BENCH_MAX_SIZE];
+	char b64[BENCH_B64_SIZE], b64_ref[BENCH_B64_SIZE];
+	int size, n, i, len_ref, len;
+
+	bench_select(p);
+	for (size = 1; size <= BENCH_MAX_SIZE; ++size) {
+		for (n = 0; n < BENCH_CHECKS; ++n) {
+			for (i = 0; i < size; ++i) bin[i] = (uint8_t)bench_rand();
+			len_ref = bin_to_b64(bin, size, b64_ref, sizeof b64_ref);
+			len = bin_to_b64_simd(bin, size, b64, sizeof b64);
+			if ((len != len_ref) || (memcmp(b64, b64_ref, len + 1) != 0)) {
+				MSG("ERROR: %s encoding differs from bin_to_b64 on %i bytes\n", p->name, size);
+				return false;
+			}
+			len_ref = b64_to_bin(b64, len, bin_ref, sizeof bin_ref);
+			len = b64_to_bin_simd(b64, len, bin_simd, sizeof bin_simd);
+			if ((len != len_ref) || ((len > 0) && (memcmp(bin_simd, bin_ref, len) != 0))) {
+				MSG("ERROR: %s decoding differs from b64_to_bin on %i bytes\n", p->name, size);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* MB/s of binary data, size 0 for all the sizes in turn */
+static double bench_rate(bool encode, int size, int mb) {
+	static uint8_t bin[BENCH_MAX_SIZE];
+	static char b64[BENCH_MAX_SIZE + 1][BENCH_B64_SIZE];
+	static int b64_len[BENCH_MAX_SIZE + 1];
+	uint64_t total = (uint64_t)mb << 20;
+	uint64_t done = 0, start;
+	uint32_t sum = 0;
+	int s, i;
+
+	for (i = 0; i < BENCH_MAX_SIZE; ++i) bin[i] = (uint8_t)bench_rand();
+	for (s = 1; s <= BENCH_MAX_SIZE; ++s) b64_len[s] = bin_to_b64(bin, s, b64[s], BENCH_B64_SIZE);
+
+	s = (size > 0) ? size : 1;
+	start = bench_ns();
+	while (done < total) {
+		if (encode) {
+			sum += bin_to_b64_simd(bin, s, b64[0], BENCH_B64_SIZE);
+		} else {
+			sum += b64_to_bin_simd(b64[s], b64_len[s], bin, sizeof bin);
+		}
+		done += s;
+		if (size == 0) s = (s < BENCH_MAX_SIZE) ? s + 1 : 1;
+	}
+	bench_sink += sum;
+	return (double)done / (1 << 20) / ((bench_ns() - start) / 1e9);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	const char * selected;
+	int mb = BENCH_MB;
+	int k, i;
+
+	if ((argc > 2) || ((argc > 1) && ((mb = atoi(argv[1])) <= 0))) {
+		MSG("Usage: b64-bench [MB per measure]\n");
+		return EXIT_FAILURE;
+	}
+
+	/* the paths b64_simd_init may select on this CPU */
+	selected = b64_simd_init();
+#if defined(B64_X86)
+	bench_paths[1].ok = __builtin_cpu_supports("ssse3");
+	bench_paths[2].ok = __builtin_cpu_supports("avx2");
+#elif defined(B64_NEON)
+	bench_paths[1].ok = (strcmp(selected, "neon") == 0);
+#endif
+	for (k = 0; k < BENCH_NB_PATHS; ++k) {
+		if (bench_paths[k].ok && !bench_check(&bench_paths[k])) return EXIT_FAILURE;
+	}
+
+	MSG("##### b64-bench: %i MB per measure, %s selected, outputs identical to base64.h #####\n", mb, selected);
+	MSG("# %-6s", "bytes");
+	for (k = 0; k < BENCH_NB_PATHS; ++k) {
+		if (bench_paths[k].ok) MSG(" | %-6s enc MB/s  dec MB/s", bench_paths[k].name);
+	}
+	MSG("\n");
+	for (i = 0; i <= BENCH_NB_SIZES; ++i) {
+		if (i < BENCH_NB_SIZES) MSG("# %-6i", bench_sizes[i]);
+		else MSG("# %-6s", "1..255");
+		for (k = 0; k < BENCH_NB_PATHS; ++k) {
+			if (!bench_paths[k].ok) continue;
+			bench_select(&bench_paths[k]);
+			MSG(" | %15.0f %9.0f", bench_rate(true, (i < BENCH_NB_SIZES) ? bench_sizes[i] : 0, mb), bench_rate(false, (i < BENCH_NB_SIZES) ? bench_sizes[i] : 0, mb));
+		}
+		MSG("\n");
+	}
+	return EXIT_SUCCESS;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,327 @@
+/*
+Description:
+	Vectorized drop-in replacements for bin_to_b64 and b64_to_bin (base64.h).
+	The vector loops only handle whole blocks in the middle of the data:
+	12 or 24 bytes per iteration with SSSE3 or AVX2 (W. Mula and D. Lemire
+	pshufb lookups), 48 bytes with NEON (vld3/vst4 deinterleaving and
+	compare-based lookups). The last block, padding and all the size checks
+	are left to the scalar functions of base64.h, and a string holding an
+	invalid char is decoded again by b64_to_bin, so results and errors are
+	those of base64.h whatever the instruction set.
+	The x86 instructions are enabled per function, the file builds without
+	-mavx2 and the CPU is probed at run time; NEON is used when the compiler
+	targets it, after checking the HWCAP on 32-bit ARM.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stddef.h>		/* NULL */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define B64_X86
+	#include <immintrin.h>	/* SSSE3 and AVX2 intrinsics */
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define B64_NEON
+	#include <arm_neon.h>	/* NEON intrinsics */
+	#if defined(__arm__) && defined(__linux__)
+		#include <sys/auxv.h>	/* getauxval */
+		#include <asm/hwcap.h>	/* HWCAP_NEON */
+	#endif
+#endif
+
+#include "base64.h"
+#include "base64_simd.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+/* bulk loops, return the number of input bytes or chars they consumed */
+static int (*b64_enc_bulk)(const uint8_t * in, int size, char * out) = NULL;
+static int (*b64_dec_bulk)(const char * in, int size, uint8_t * out, int room) = NULL; /* -1 on an invalid char */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+#ifdef B64_X86
+/* 6-bit values to ASCII: the range of each value selects an offset from a 16-entry table */
+__attribute__((target("ssse3")))
+static inline __m128i b64_ascii_sse(__m128i idx) {
+	const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i r;
+
+	r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+	return _mm_add_epi8(idx, _mm_shuffle_epi8(offsets, r));
+}
+
+/* 12 bytes at the start of v to 16 6-bit values, one per byte */
+__attribute__((target("ssse3")))
+static inline __m128i b64_split_sse(__m128i v) {
+	__m128i t0, t1;
+
+	v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+	t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t0, t1);
+}
+
+/* 16 chars to 6-bit values, invalid chars set bits in *bad */
+__attribute__((target("ssse3")))
+static inline __m128i b64_value_sse(__m128i v, __m128i * bad) {
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i hi, lo;
+
+	hi = _mm_and_si128(_mm_srli_epi32(v, 4), nibble);
+	lo = _mm_and_si128(v, nibble);
+	*bad = _mm_or_si128(*bad, _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi)));
+	hi = _mm_add_epi8(hi, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+	return _mm_add_epi8(v, _mm_shuffle_epi8(lut_roll, hi));
+}
+
+/* 16 6-bit values to 12 bytes at the start of the result */
+__attribute__((target("ssse3")))
+static inline __m128i b64_pack_sse(__m128i v) {
+	v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+	v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static int b64_enc_ssse3(const uint8_t * in, int size, char * out) {
+	__m128i v;
+	int i, k;
+
+	/* 16 bytes are loaded to encode 12 */
+	for (i = 0, k = 0; size - i >= 16; i += 12, k += 16) {
+		v = b64_split_sse(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm_storeu_si128((__m128i *)(out + k), b64_ascii_sse(v));
+	}
+	return i;
+}
+
+__attribute__((target("ssse3")))
+static int b64_dec_ssse3(const char * in, int size, uint8_t * out, int room) {
+	__m128i v, bad;
+	int i, k;
+
+	/* 16 bytes are stored for 12 decoded */
+	for (i = 0, k = 0; (size - i >= 16) && (room - k >= 16); i += 16, k += 12) {
+		bad = _mm_setzero_si128();
+		v = b64_value_sse(_mm_loadu_si128((const __m128i *)(in + i)), &bad);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xFFFF) return -1;
+		_mm_storeu_si128((__m128i *)(out + k), b64_pack_sse(v));
+	}
+	return i;
+}
+
+/* same algorithms on two 128-bit lanes */
+__attribute__((target("avx2")))
+static int b64_enc_avx2(const uint8_t * in, int size, char * out) {
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m256i v, t0, t1, r;
+	int i, k;
+
+	/* 28 bytes are loaded to encode 24, 12 per lane */
+	for (i = 0, k = 0; size - i >= 28; i += 24, k += 32) {
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + i))), _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+		t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+		v = _mm256_or_si256(t0, t1);
+		r = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+		r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), v), _mm256_set1_epi8(13)));
+		_mm256_storeu_si256((__m256i *)(out + k), _mm256_add_epi8(v, _mm256_shuffle_epi8(offsets, r)));
+	}
+	_mm256_zeroupper(); /* the SSSE3 tail is not VEX-encoded, dirty upper halves would stall it */
+	return i + b64_enc_ssse3(in + i, size - i, out + k);
+}
+
+__attribute__((target("avx2")))
+static int b64_dec_avx2(const char * in, int size, uint8_t * out, int room) {
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i v, hi, lo;
+	int i, k;
+
+	/* 32 bytes are stored for 24 decoded */
+	for (i = 0, k = 0; (size - i >= 32) && (room - k >= 32); i += 32, k += 24) {
+		v = _mm256_loadu_si256((const __m256i *)(in + i));
+		hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), nibble);
+		lo = _mm256_and_si256(v, nibble);
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi))) return -1;
+		hi = _mm256_add_epi8(hi, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+		v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut_roll, hi));
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, pack);
+		v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm256_storeu_si256((__m256i *)(out + k), v);
+	}
+	_mm256_zeroupper(); /* as in b64_enc_avx2 */
+	k = b64_dec_ssse3(in + i, size - i, out + k, room - k);
+	return (k < 0) ? -1 : i + k;
+}
+#endif
+
+#ifdef B64_NEON
+/* 6-bit values to ASCII, the offset of each range is added under a mask */
+static inline uint8x16_t b64_ascii_neon(uint8x16_t x) {
+	uint8x16_t c;
+
+	c = vaddq_u8(x, vdupq_n_u8('A'));
+	c = vaddq_u8(c, vandq_u8(vcgeq_u8(x, vdupq_n_u8(26)), vdupq_n_u8('a' - 'A' - 26)));
+	c = vsubq_u8(c, vandq_u8(vcgeq_u8(x, vdupq_n_u8(52)), vdupq_n_u8('a' - 26 - '0' + 52)));
+	c = vsubq_u8(c, vandq_u8(vceqq_u8(x, vdupq_n_u8(62)), vdupq_n_u8('0' + 10 - '+')));
+	c = vsubq_u8(c, vandq_u8(vceqq_u8(x, vdupq_n_u8(63)), vdupq_n_u8('0' + 11 - '/')));
+	return c;
+}
+
+/* ASCII to 6-bit values, chars outside the alphabet set bits in *bad */
+static inline uint8x16_t b64_value_neon(uint8x16_t c, uint8x16_t * bad) {
+	uint8x16_t up, lo, dg, m_up, m_lo, m_dg, m_pl, m_sl, v;
+
+	up = vsubq_u8(c, vdupq_n_u8('A'));
+	lo = vsubq_u8(c, vdupq_n_u8('a'));
+	dg = vsubq_u8(c, vdupq_n_u8('0'));
+	m_up = vcltq_u8(up, vdupq_n_u8(26));
+	m_lo = vcltq_u8(lo, vdupq_n_u8(26));
+	m_dg = vcltq_u8(dg, vdupq_n_u8(10));
+	m_pl = vceqq_u8(c, vdupq_n_u8('+'));
+	m_sl = vceqq_u8(c, vdupq_n_u8('/'));
+	v = vandq_u8(m_up, up);
+	v = vorrq_u8(v, vandq_u8(m_lo, vaddq_u8(lo, vdupq_n_u8(26))));
+	v = vorrq_u8(v, vandq_u8(m_dg, vaddq_u8(dg, vdupq_n_u8(52))));
+	v = vorrq_u8(v, vandq_u8(m_pl, vdupq_n_u8(62)));
+	v = vorrq_u8(v, vandq_u8(m_sl, vdupq_n_u8(63)));
+	*bad = vorrq_u8(*bad, vmvnq_u8(vorrq_u8(vorrq_u8(m_up, m_lo), vorrq_u8(m_dg, vorrq_u8(m_pl, m_sl)))));
+	return v;
+}
+
+static int b64_enc_neon(const uint8_t * in, int size, char * out) {
+	const uint8x16_t mask = vdupq_n_u8(0x3F);
+	uint8x16x3_t s;
+	uint8x16x4_t d;
+	int i, k;
+
+	for (i = 0, k = 0; size - i >= 48; i += 48, k += 64) {
+		s = vld3q_u8(in + i);
+		d.val[0] = vshrq_n_u8(s.val[0], 2);
+		d.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(s.val[0], 4), vshrq_n_u8(s.val[1], 4)), mask);
+		d.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(s.val[1], 2), vshrq_n_u8(s.val[2], 6)), mask);
+		d.val[3] = vandq_u8(s.val[2], mask);
+		d.val[0] = b64_ascii_neon(d.val[0]);
+		d.val[1] = b64_ascii_neon(d.val[1]);
+		d.val[2] = b64_ascii_neon(d.val[2]);
+		d.val[3] = b64_ascii_neon(d.val[3]);
+		vst4q_u8((uint8_t *)(out + k), d);
+	}
+	return i;
+}
+
+static int b64_dec_neon(const char * in, int size, uint8_t * out, int room) {
+	uint8x16x4_t s;
+	uint8x16x3_t d;
+	uint8x16_t bad;
+	uint8x8_t b;
+	int i, k;
+
+	for (i = 0, k = 0; (size - i >= 64) && (room - k >= 48); i += 64, k += 48) {
+		s = vld4q_u8((const uint8_t *)(in + i));
+		bad = vdupq_n_u8(0);
+		s.val[0] = b64_value_neon(s.val[0], &bad);
+		s.val[1] = b64_value_neon(s.val[1], &bad);
+		s.val[2] = b64_value_neon(s.val[2], &bad);
+		s.val[3] = b64_value_neon(s.val[3], &bad);
+		b = vorr_u8(vget_low_u8(bad), vget_high_u8(bad));
+		if (vget_lane_u64(vreinterpret_u64_u8(b), 0) != 0) return -1;
+		d.val[0] = vorrq_u8(vshlq_n_u8(s.val[0], 2), vshrq_n_u8(s.val[1], 4));
+		d.val[1] = vorrq_u8(vshlq_n_u8(s.val[1], 4), vshrq_n_u8(s.val[2], 2));
+		d.val[2] = vorrq_u8(vshlq_n_u8(s.val[2], 6), s.val[3]);
+		vst3q_u8(out + k, d);
+	}
+	return i;
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+const char * b64_simd_init(void) {
+#if defined(B64_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		b64_enc_bulk = b64_enc_avx2;
+		b64_dec_bulk = b64_dec_avx2;
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		b64_enc_bulk = b64_enc_ssse3;
+		b64_dec_bulk = b64_dec_ssse3;
+		return "ssse3";
+	}
+#elif defined(B64_NEON)
+	#if defined(__arm__) && defined(__linux__)
+	if ((getauxval(AT_HWCAP) & HWCAP_NEON) == 0) return "scalar";
+	#endif
+	b64_enc_bulk = b64_enc_neon;
+	b64_dec_bulk = b64_dec_neon;
+	return "neon";
+#endif
+	return "scalar";
+}
+
+int bin_to_b64_simd(const uint8_t * in, int size, char * out, int max_len) {
+	int i, j;
+
+	/* let bin_to_b64 report invalid arguments */
+	if ((b64_enc_bulk == NULL) || (in == NULL) || (out == NULL) || (size < 0) || (max_len < 4 * ((size + 2) / 3) + 1)) {
+		return bin_to_b64(in, size, out, max_len);
+	}
+	i = b64_enc_bulk(in, size, out);
+	j = bin_to_b64(in + i, size - i, out + 4 * (i / 3), max_len - 4 * (i / 3));
+	return (j < 0) ? -1 : 4 * (i / 3) + j;
+}
+
+int b64_to_bin_simd(const char * in, int size, uint8_t * out, int max_len) {
+	int n, len, i, j;
+
+	if ((b64_dec_bulk == NULL) || (in == NULL) || (out == NULL) || (size < 8)) {
+		return b64_to_bin(in, size, out, max_len);
+	}
+	/* decoded length, padding is only looked for in a multiple of 4 chars */
+	n = size;
+	if ((size % 4) == 0) {
+		if (in[size - 2] == '=') n -= 2;
+		else if (in[size - 1] == '=') n -= 1;
+	}
+	len = 3 * (n / 4) + (((n % 4) > 1) ? (n % 4) - 1 : 0);
+	if (((n % 4) == 1) || (max_len < len)) {
+		return b64_to_bin(in, size, out, max_len);
+	}
+	/* the last 4 chars may hold the padding, they are left to b64_to_bin */
+	i = b64_dec_bulk(in, size - 4, out, len);
+	if (i < 0) {
+		return b64_to_bin(in, size, out, max_len);
+	}
+	j = b64_to_bin(in + i, size - i, out + 3 * (i / 4), max_len - 3 * (i / 4));
+	return (j < 0) ? -1 : 3 * (i / 4) + j;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
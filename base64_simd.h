@@ -0,0 +1,51 @@
+/*
+Description:
+	Vectorized drop-in replacements for bin_to_b64 and b64_to_bin (base64.h).
+	AVX2 or SSSE3 on x86 and NEON on ARM are selected at run time, the
+	scalar functions of base64.h are used otherwise. Output, return values
+	and error handling are those of base64.h.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _BASE64_SIMD_H
+#define _BASE64_SIMD_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Probe the CPU and select the fastest implementation
+@return name of the instruction set in use, "avx2", "ssse3", "neon" or "scalar"
+*/
+const char * b64_simd_init(void);
+
+/**
+@brief Base64 encoding with padding, same contract as bin_to_b64
+@param in pointer to the binary data
+@param size number of bytes to encode
+@param out pointer to the output buffer, null-terminated on success
+@param max_len size of the output buffer
+@return length of the encoded string, -1 on error
+*/
+int bin_to_b64_simd(const uint8_t * in, int size, char * out, int max_len);
+
+/**
+@brief Base64 decoding, padded or not, same contract as b64_to_bin
+@param in pointer to the base64 string
+@param size number of chars to decode
+@param out pointer to the output buffer
+@param max_len size of the output buffer
+@return number of bytes decoded, -1 on error
+*/
+int b64_to_bin_simd(const char * in, int size, uint8_t * out, int max_len);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
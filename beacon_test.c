@@ -0,0 +1,202 @@
+/*
+Description:
+	beacon-test: check the timing of the beacon thread against a simulated PPS.
+	The forwarder is built in with the HAL calls of the beacon path replaced:
+	a fake GPS loop signals cv_beacon when the RMC sentence of the previous
+	second would, the concentrator counter follows the monotonic clock and
+	lgw_send only records when it was called. Every other beacon finds the
+	TX still busy with a downlink that ends inside the guard time.
+	For each beacon, the test checks the time from the signal to the wake-up
+	of the beacon thread, and that lgw_send is called inside the guard time
+	before the PPS, as soon as the TX is free.
+
+	Usage: beacon-test [nb_beacons]
+	Build with the sources and libraries of the packet forwarder, this file
+	replacing poly_pkt_fwd.c.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+/* the forwarder, its entry point renamed and the HAL calls of the beacon redirected to the fakes below */
+#define main		pkt_fwd_main
+#define lgw_send	fake_lgw_send
+#define lgw_status	fake_lgw_status
+#define lgw_utc2cnt	fake_lgw_utc2cnt
+#include "poly_pkt_fwd.c"
+#undef main
+#undef lgw_send
+#undef lgw_status
+#undef lgw_utc2cnt
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define TEST_NB_BEACONS		10
+#define TEST_SIGNAL_MS		700		/* cv_beacon is signalled that long before the PPS */
+#define TEST_BUSY_US		(BEACON_GUARD_US / 2)	/* a busy TX gets free that long before the PPS */
+#define TEST_WAKE_MAX_US	2000	/* max time from the signal to the wake-up of the beacon thread */
+#define TEST_SEND_MAX_US	3000	/* max time from the TX being usable to the call of lgw_send */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+/* simulated PPS, written by the main thread before cv_beacon is signalled */
+static uint32_t test_sec; /* UTC second of the PPS */
+static uint32_t test_pps_us; /* monotonic time of the PPS, also the concentrator counter */
+static uint32_t test_busy_us; /* TX busy until then, 0 if free */
+static uint32_t test_toa_us; /* airtime of the beacon */
+static uint32_t test_signal_us; /* time cv_beacon was signalled */
+
+/* results, written by the beacon thread */
+static uint32_t test_wake_us; /* time the beacon thread converted the PPS, 0 if it did not */
+static uint32_t test_send_us; /* time lgw_send was called, 0 if it was not */
+static uint32_t test_send_sec; /* time field of the beacon sent */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+int fake_lgw_utc2cnt(struct tref ref, struct timespec utc, uint32_t * count_us) {
+	(void)ref;
+	__atomic_store_n(&test_wake_us, mono_us(), __ATOMIC_RELEASE);
+	*count_us = __atomic_load_n(&test_pps_us, __ATOMIC_ACQUIRE) + 1000000U * (uint32_t)(utc.tv_sec - test_sec);
+	return LGW_GPS_SUCCESS;
+}
+
+int fake_lgw_status(uint8_t select, uint8_t * code) {
+	uint32_t now = mono_us();
+	uint32_t busy = __atomic_load_n(&test_busy_us, __ATOMIC_ACQUIRE);
+	uint32_t sent = __atomic_load_n(&test_send_us, __ATOMIC_ACQUIRE);
+
+	if (select != TX_STATUS) return LGW_HAL_ERROR;
+	if ((busy != 0) && ((int32_t)(now - busy) < 0)) {
+		*code = TX_EMITTING; /* downlink handed over before the beacon slot was reserved */
+	} else if ((sent != 0) && ((int32_t)(now - (test_pps_us + test_toa_us)) < 0)) {
+		*code = ((int32_t)(now - test_pps_us) < 0) ? TX_SCHEDULED : TX_EMITTING;
+	} else {
+		*code = TX_FREE;
+	}
+	return LGW_HAL_SUCCESS;
+}
+
+int fake_lgw_send(struct lgw_pkt_tx_s pkt_data) {
+	__atomic_store_n(&test_send_sec, (uint32_t)pkt_data.payload[3] | (uint32_t)pkt_data.payload[4] << 8 | (uint32_t)pkt_data.payload[5] << 16 | (uint32_t)pkt_data.payload[6] << 24, __ATOMIC_RELAXED);
+	__atomic_store_n(&test_send_us, mono_us(), __ATOMIC_RELEASE);
+	return LGW_HAL_SUCCESS;
+}
+
+static void sleep_until(uint32_t t) {
+	int32_t d = (int32_t)(t - mono_us());
+
+	if (d > 0) wait_ms((unsigned long)d / 1000 + 1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	pthread_t thrid_test;
+	struct lgw_pkt_tx_s beacon_pkt;
+	int nb_beacons = TEST_NB_BEACONS;
+	int n, nb_fail = 0;
+	uint32_t now, usable, wake, lead, lat;
+	uint32_t wake_max = 0, lat_max = 0;
+	uint32_t lead_min = UINT32_MAX, lead_max = 0;
+
+	if (argc > 2) {
+		MSG("Usage: beacon-test [nb_beacons]\n");
+		return EXIT_FAILURE;
+	}
+	if ((argc > 1) && ((nb_beacons = atoi(argv[1])) <= 0)) {
+		MSG("ERROR: invalid number of beacons\n");
+		return EXIT_FAILURE;
+	}
+
+	/* a GPS-synchronized gateway, the concentrator counter follows the monotonic clock */
+	airtime_init();
+	gps_ref_valid = true;
+	xtal_correct_ok = true;
+	xtal_correct = 1.0;
+	beacon_freq_hz = 869525000;
+	reference_coord.lat = 45.0;
+	reference_coord.lon = 5.0;
+	memset(&beacon_pkt, 0, sizeof beacon_pkt); /* same modulation as thread_beacon */
+	beacon_pkt.modulation = MOD_LORA;
+	beacon_pkt.bandwidth = BW_125KHZ;
+	beacon_pkt.datarate = DR_LORA_SF9;
+	beacon_pkt.coderate = CR_LORA_4_5;
+	beacon_pkt.preamble = 6;
+	beacon_pkt.no_crc = true;
+	beacon_pkt.no_header = true;
+	beacon_pkt.size = 17;
+	test_toa_us = airtime_us(&beacon_pkt);
+	test_sec = 1000000000;
+
+	if (pthread_create(&thrid_test, NULL, (void * (*)(void *))thread_beacon, NULL) != 0) {
+		MSG("ERROR: impossible to create beacon thread\n");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; n < nb_beacons; ++n) {
+		/* fake RMC sentence, the next PPS is TEST_SIGNAL_MS away */
+		now = mono_us();
+		__atomic_store_n(&concent_ref, ((uint64_t)now << 32) | now, __ATOMIC_RELAXED);
+		__atomic_store_n(&test_wake_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&test_send_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&test_pps_us, now + 1000 * TEST_SIGNAL_MS, __ATOMIC_RELEASE);
+		__atomic_store_n(&test_busy_us, (n % 2) ? now + 1000 * TEST_SIGNAL_MS - TEST_BUSY_US : 0, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&mx_beacon);
+		beacon_time = test_sec;
+		test_signal_us = mono_us();
+		pthread_cond_signal(&cv_beacon);
+		pthread_mutex_unlock(&mx_beacon);
+
+		/* let the beacon go out, and the thread go back to sleep */
+		sleep_until(test_pps_us + test_toa_us + 2 * 1000 * BEACON_POLL_MS);
+
+		wake = __atomic_load_n(&test_wake_us, __ATOMIC_ACQUIRE);
+		now = __atomic_load_n(&test_send_us, __ATOMIC_ACQUIRE);
+		if ((wake == 0) || (now == 0)) {
+			MSG("FAIL: beacon %i, %s\n", n, (wake == 0) ? "beacon thread not woken" : "lgw_send not called");
+			++nb_fail;
+		} else {
+			wake -= test_signal_us;
+			lead = test_pps_us - now;
+			usable = test_pps_us - BEACON_GUARD_US;
+			if ((test_busy_us != 0) && ((int32_t)(test_busy_us - usable) > 0)) usable = test_busy_us;
+			lat = now - usable;
+			if (wake > wake_max) wake_max = wake;
+			if ((int32_t)lat > (int32_t)lat_max) lat_max = lat;
+			if (lead < lead_min) lead_min = lead;
+			if (lead > lead_max) lead_max = lead;
+			if (wake > TEST_WAKE_MAX_US) {
+				MSG("FAIL: beacon %i, woken %u us after the signal\n", n, wake);
+				++nb_fail;
+			}
+			if (((int32_t)lat < 0) || (lat > TEST_SEND_MAX_US) || (lead < BEACON_LATE_US)) {
+				MSG("FAIL: beacon %i, lgw_send called %i us after the TX was usable, %i us before the PPS\n", n, (int32_t)lat, (int32_t)lead);
+				++nb_fail;
+			}
+			if (test_send_sec != test_sec) {
+				MSG("FAIL: beacon %i, time field %u instead of %u\n", n, test_send_sec, test_sec);
+				++nb_fail;
+			}
+		}
+		test_sec += beacon_period;
+	}
+
+	quit_sig = true;
+	pthread_join(thrid_test, NULL);
+
+	MSG("\n##### beacon-test: %i beacons #####\n", nb_beacons);
+	MSG("# wake-up latency: max %u us (limit %u us)\n", wake_max, TEST_WAKE_MAX_US);
+	MSG("# lgw_send latency: max %u us (limit %u us)\n", lat_max, TEST_SEND_MAX_US);
+	MSG("# lgw_send before the PPS: %u to %u us (window %u to %u us)\n", lead_min, lead_max, BEACON_LATE_US, BEACON_GUARD_US);
+	MSG("# %s, %i failures\n", (nb_fail == 0) ? "PASS" : "FAIL", nb_fail);
+	return (nb_fail == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
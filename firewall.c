@@ -0,0 +1,2034 @@
+/*
+Description:
+	Firewall rule engine for the LoRaWAN packet forwarder.
+	The nodes of firewall_conf.json are parsed once and compiled into an
+	open-addressing hash table keyed on the 32-bit DevAddr, so that a lookup
+	on the upstream path costs a couple of memory accesses and no allocation.
+	When DevAddr prefixes (NetID or address blocks) are listed, all rules are
+	also compiled into a poptrie: a multibit trie with 6-bit strides whose
+	nodes are compressed with bitmaps, looked up with longest-prefix-match
+	semantics in at most 6 node accesses whatever the number of rules.
+	Join-requests are matched on DevEUI/JoinEUI in a second hash table,
+	behind a Bloom filter so that unlisted EUIs never probe the table.
+	Nodes can be rate limited with a token bucket per DevAddr, the bucket
+	state lives in a set-associative table of cache lines with LRU eviction.
+	Replayed uplinks are caught with a direct-mapped array holding, in 4 bytes
+	per device, the last FCnt, its number of retransmissions and a bitmap of
+	the frames just before it; a counter restart is only believed if the MIC
+	was verified or after a few increasing low FCnt;
+	multi-path copies of a frame are caught by a short-lived hash of
+	(DevAddr, FCnt, CRC).
+	Devices whose NwkSKey is provisioned in a key file get their MIC checked,
+	the keys are expanded at load time and indexed by DevAddr.
+	Every rule has a pass and a drop counter per reader thread, each thread
+	writes its own cache lines so counting needs neither locks nor atomic
+	read-modify-write; the stat loop sums them up.
+	Filters on frame size, FPort or RSSI cannot be hashed and are matched in
+	order, first match wins. The stat loop periodically moves the most hit
+	filters first within runs of filters having the same action, which keeps
+	the verdict of every frame unchanged, and publishes the new order with
+	the same grace period as a table swap.
+	The compiled tables can be saved as a flat image (see firewall_compile.c)
+	that is mapped read-only instead of parsed, so loading it costs a
+	checksum pass and no per-rule work, and forwarders share its pages.
+	Downlinks requested by the servers go through the DevAddr rules and
+	token buckets per device, per server and per frequency before they can
+	reach the concentrator; those buckets are shared by the downstream
+	threads behind their own mutex.
+	Rule changes are applied RCU-style: readers bracket their use of the
+	active table with a per-thread sequence counter, the reload thread swaps
+	the table pointer and frees the old table once every reader went through
+	a quiescent state.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stdio.h>		/* printf */
+#include <stdlib.h>		/* calloc, free, strtoul */
+#include <string.h>		/* strlen, strcmp */
+#include <signal.h>		/* sig_atomic_t */
+#include <errno.h>		/* error messages */
+#include <libgen.h>		/* dirname, basename */
+#include <pthread.h>
+#include <fcntl.h>		/* open */
+#include <unistd.h>		/* read, close, unlink */
+#include <sys/mman.h>	/* mmap, munmap */
+#include <sys/stat.h>	/* fstat */
+#ifdef __linux__
+	#include <poll.h>			/* poll */
+	#include <sys/inotify.h>	/* inotify_init1, inotify_add_watch */
+#endif
+
+#include "parson.h"
+#include "loragw_aux.h"
+#include "aes_cmac.h"
+#include "firewall.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define FW_MIN_BITS		4	/* smallest hash table has 16 slots */
+#define FW_HASH_MUL		0x9E3779B1 /* 2^32 / golden ratio, Fibonacci hashing */
+#define FW_WATCH_MS		1000	/* max delay to notice a reload request or a stop */
+#define FW_SETTLE_MS	100		/* delay to let a writer finish before reading the file */
+#define FW_GRACE_MS		1		/* polling interval while waiting for readers */
+#define FW_TOKEN		1000000	/* one frame, in micro-frames */
+#define FW_LIMIT_WAYS	4		/* buckets per set, 4 x 16 bytes = 1 cache line */
+#define FW_REPLAY_WINDOW	8	/* frames older than the last FCnt accepted once, out of order */
+#define FW_REPLAY_RESET	16		/* FCnt below this value after a stale frame means the device restarted */
+#define FW_REPLAY_RESYNC	3	/* increasing low FCnt needed to believe a restart, unless the MIC was verified */
+#define FW_REPLAY_NBTRANS	3	/* max transmissions of a frame (LoRaWAN NbTrans), further copies are replays */
+#define FW_RESTART_BITS	6		/* 64 devices being resynchronized at the same time */
+#define FW_DUP_BITS		10		/* 1024 recent frames remembered */
+#define FW_HITS_LINE	8		/* counters per cache line */
+#define FW_IMAGE_MAGIC	"PFWI"
+#define FW_IMAGE_VERSION	2
+#define FW_IMAGE_ALIGN	64		/* sections start on a cache line */
+#define FW_DOWN_SERVERS	64		/* buckets of the per server downlink limiter */
+#define FW_DOWN_FREQS	256		/* buckets of the per frequency downlink limiter */
+#define FW_MATCH_SIZE	0x01	/* filter conditions */
+#define FW_MATCH_FPORT	0x02
+#define FW_MATCH_RSSI	0x04
+#define FW_MIC_MAX_MSG	(256 + 16)	/* B0 block + largest LoRa payload */
+#define FW_DUP_TTL_MS	500		/* copies of a frame arrive within a few ms, retransmissions after 1s or more */
+#define FW_STRIDE		6		/* bits consumed per trie level, 64 slots per node */
+#define FW_KEY_BITS		36		/* DevAddr padded to a multiple of the stride */
+#define FW_BLOOM_BITS	16		/* Bloom filter bits per EUI rule, ~0.2% false positives */
+#define FW_BLOOM_HASHES	4		/* bits set per EUI */
+
+/* kind of identifier a rule applies to */
+#define FW_KEY_DEVADDR	0
+#define FW_KEY_DEVEUI	1
+#define FW_KEY_JOINEUI	2
+
+/* LoRaWAN MHDR message types */
+#define MTYPE_JOIN_REQUEST		0
+#define MTYPE_JOIN_ACCEPT		1
+#define MTYPE_UNCONF_DATA_UP	2
+#define MTYPE_UNCONF_DATA_DOWN	3
+#define MTYPE_CONF_DATA_UP		4
+#define MTYPE_CONF_DATA_DOWN	5
+#define MTYPE_REJOIN_REQUEST	6
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct fw_slot {
+	uint32_t addr;	/* DevAddr, host order */
+	uint32_t rule;	/* (rule index << 8) | rule type, 0 if the slot is empty */
+};
+
+struct fw_rule {
+	uint8_t type;	/* FW_RULE_xxx */
+	uint8_t kind;	/* FW_KEY_xxx */
+	uint8_t plen;	/* prefix length, 32 for a single device */
+	uint32_t addr;	/* DevAddr or first address of the prefix */
+	uint64_t eui;	/* DevEUI or JoinEUI */
+	uint32_t rate;	/* refill rate in micro-frames per ms, 0 to use the default */
+	uint32_t burst;	/* bucket depth in micro-frames */
+};
+
+/* image sections, in file order */
+enum fw_section {
+	FW_SEC_RULES = 0,
+	FW_SEC_SLOTS,
+	FW_SEC_NODES,
+	FW_SEC_LEAVES,
+	FW_SEC_EUI_SLOTS,
+	FW_SEC_BLOOM,
+	FW_SEC_FILTERS,
+	FW_SEC_KEY_PATH,
+	FW_SEC_COUNT
+};
+
+struct fw_image_hdr {
+	char magic[4];			/* FW_IMAGE_MAGIC */
+	uint16_t version;		/* FW_IMAGE_VERSION */
+	uint16_t endian;		/* 0x0102 as written by the host */
+	uint32_t layout;		/* fingerprint of the structure sizes of the host */
+	uint32_t size;			/* file size in bytes */
+	uint32_t crc;			/* CRC-32 of the file after the header */
+	uint32_t policy;
+	uint32_t rate;
+	uint32_t burst;
+	uint32_t down_rate[3];
+	uint32_t down_burst[3];
+	uint32_t bits;
+	uint32_t nb_rules;
+	uint32_t nb_entries;
+	uint32_t nb_prefixes;
+	uint32_t nb_nodes;
+	uint32_t nb_leaves;
+	uint32_t nb_euis;
+	uint32_t eui_mask;
+	uint32_t bloom_mask;
+	uint32_t nb_filters;
+	uint32_t nb_filter_ids;
+	struct {
+		uint32_t offset;	/* from the start of the file, FW_IMAGE_ALIGN aligned */
+		uint32_t length;	/* in bytes */
+	} sec[FW_SEC_COUNT];
+};
+
+struct fw_table {
+	uint32_t nb_rules;		/* number of entries in firewall_conf.nodes */
+	uint32_t nb_entries;	/* size of the rules array, the default policy counts at that index */
+	uint8_t policy;			/* verdict for addresses without any rule */
+	uint32_t rate;			/* default rate limit, 0 if unlimited */
+	uint32_t burst;			/* default bucket depth */
+	uint32_t down_rate[3];	/* downlink rate limits per device, server and frequency, 0 if unlimited */
+	uint32_t down_burst[3];
+	unsigned bits;			/* log2 of the number of slots */
+	uint32_t mask;			/* number of slots - 1 */
+	struct fw_slot * slots;	/* open-addressing table, load factor <= 0.5 */
+	struct fw_rule * rules;	/* indexed by position in firewall_conf.nodes */
+	uint32_t nb_prefixes;	/* rules covering more than one address */
+	struct fw_pnode * nodes; /* poptrie, NULL if there is no prefix rule */
+	uint32_t * leaves;		/* poptrie leaves, rule index + 1, 0 if no match */
+	uint32_t nb_nodes;
+	uint32_t nb_leaves;
+	uint32_t nb_euis;		/* DevEUI and JoinEUI rules */
+	uint32_t eui_mask;		/* number of EUI slots - 1 */
+	struct fw_eui_slot * eui_slots;
+	uint32_t bloom_mask;	/* number of Bloom filter bits - 1 */
+	uint64_t * bloom;		/* NULL if there is no EUI rule */
+	uint32_t nb_keys;		/* devices with a NwkSKey */
+	uint32_t key_mask;		/* number of key slots - 1 */
+	uint32_t * key_slots;	/* key index + 1, 0 if the slot is empty */
+	struct fw_mic * keys;
+	uint16_t * fcnt_hi;		/* 16 MSB of FCnt per key, updated by the reader */
+	uint32_t hits_stride;	/* counters per reader, multiple of a cache line */
+	struct fw_hits * hits;	/* FW_MAX_READERS blocks of counters, each written by one thread */
+	uint32_t nb_filters;
+	struct fw_state * state; /* written while the table is published, the table itself is not */
+	uint32_t nb_filter_ids;	/* size of firewall_conf.filters, invalid filters included */
+	char * key_path;		/* file holding the device keys, NULL if none */
+	void * image;			/* mapped image holding the read-only tables, NULL if parsed */
+	size_t image_size;
+};
+
+/* part of a table changed after it is published, by the thread of fw_stats and fw_reorder */
+struct fw_state {
+	struct fw_filter * filters; /* current evaluation order, swapped by fw_reorder, read by all */
+	uint32_t * score;		/* decaying hit count per filter */
+	struct fw_hits * filter_reported; /* totals at the previous fw_reorder call */
+	struct fw_hits * reported; /* totals at the previous fw_stats call */
+};
+
+struct fw_hits {
+	uint32_t pass;		/* frames forwarded */
+	uint32_t drop;		/* frames dropped, rate limited included */
+};
+
+struct fw_filter {
+	uint16_t id;			/* position in firewall_conf.filters */
+	uint8_t type;			/* FW_RULE_DENY or FW_RULE_ALLOW */
+	uint8_t match;			/* FW_MATCH_xxx conditions, all must hold */
+	uint16_t size_min;		/* payload size range, bytes */
+	uint16_t size_max;
+	float rssi_min;			/* RSSI window, dBm */
+	float rssi_max;
+	uint32_t fport[8];		/* bitmap of FPort values */
+	int priority;			/* higher priorities are matched first */
+};
+
+struct fw_mic {
+	uint32_t addr;			/* DevAddr */
+	struct cmac_key key;	/* expanded NwkSKey */
+};
+
+struct fw_eui_slot {
+	uint64_t eui;	/* DevEUI or JoinEUI */
+	uint32_t kind;	/* FW_KEY_DEVEUI or FW_KEY_JOINEUI */
+	uint32_t rule;	/* (rule index << 8) | rule type, 0 if the slot is empty */
+};
+
+struct fw_pnode {
+	uint64_t vector;	/* slots pointing to a child node */
+	uint64_t leafvec;	/* slots starting a new run of identical leaves */
+	uint32_t base0;		/* index of the first leaf of the node */
+	uint32_t base1;		/* index of the first child of the node */
+};
+
+struct fw_prefix {
+	uint32_t addr;		/* masked address */
+	uint8_t plen;		/* prefix length */
+	uint8_t type;		/* rule type, to settle duplicates */
+	uint32_t leaf;		/* rule index + 1 */
+};
+
+struct fw_bucket {
+	uint32_t key;		/* DevAddr */
+	uint32_t tokens;	/* micro-frames available */
+	uint32_t stamp;		/* time of the last frame, in ms, drives the LRU */
+	uint32_t valid;		/* 1 if the bucket is in use */
+};
+
+struct fw_limiter {
+	unsigned bits;				/* log2 of the number of sets */
+	struct fw_bucket * sets;	/* FW_LIMIT_WAYS buckets per set, cache aligned */
+};
+
+struct fw_dup {
+	uint32_t hash;		/* hash of (DevAddr, FCnt, CRC), 0 if the entry is empty */
+	uint32_t stamp;		/* time of reception, in ms */
+};
+
+struct fw_restart {
+	uint32_t devaddr;
+	uint16_t fcnt;		/* highest low FCnt of the sequence */
+	uint16_t count;		/* increasing low FCnt received, 0 if the entry is empty */
+};
+
+struct fw_replay {
+	unsigned bits;			/* log2 of the number of devices */
+	uint32_t * devices;		/* tag << 26 | retransmissions << 24 | window << 16 | last FCnt, 0 if unused */
+	struct fw_dup dups[1 << FW_DUP_BITS];
+	struct fw_restart restarts[1 << FW_RESTART_BITS];
+};
+
+struct fw_reader {
+	uint32_t seq;	/* odd while the reader uses the active table */
+	uint8_t pad[60]; /* one cache line per reader */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static struct fw_table * fw_active = NULL; /* published rule set, swapped atomically */
+static struct fw_reader fw_readers[FW_MAX_READERS] __attribute__((aligned(64)));
+static unsigned fw_nb_readers = 0;
+static __thread int fw_self = -1; /* reader identifier of the calling thread */
+
+/* downlink token buckets, shared by the downstream threads */
+static const char * const fw_down_names[3] = {"device", "server", "frequency"};
+static pthread_mutex_t mx_fw_down = PTHREAD_MUTEX_INITIALIZER;
+static struct fw_limiter * fw_down[3] = {NULL, NULL, NULL};
+
+static char fw_path[256]; /* rules file being watched */
+static pthread_t thrid_fw;
+static volatile bool fw_watch_run = false;
+static volatile sig_atomic_t fw_reload_pending = 0;
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static inline uint32_t fw_hash(const struct fw_table * t, uint32_t devaddr) {
+	return (devaddr * FW_HASH_MUL) >> (32 - t->bits);
+}
+
+static int fw_parse_rule(const char * str) {
+	if (str == NULL) return FW_RULE_NONE;
+	if (strcmp(str, "black") == 0) return FW_RULE_BLACK;
+	if (strcmp(str, "white") == 0) return FW_RULE_WHITE;
+	if (strcmp(str, "deny") == 0)  return FW_RULE_DENY;
+	if (strcmp(str, "allow") == 0) return FW_RULE_ALLOW;
+	return FW_RULE_NONE;
+}
+
+static int fw_parse_eui(const char * str, uint64_t * eui) {
+	char * end;
+	size_t len;
+
+	if (str == NULL) return -1;
+	len = strlen(str);
+	if ((len == 0) || (len > 16)) return -1;
+	*eui = (uint64_t)strtoull(str, &end, 16);
+	return (*end == 0) ? 0 : -1;
+}
+
+/* 64-bit finalizer of splitmix64, the two halves seed the Bloom double hashing */
+static inline uint64_t fw_mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static inline uint64_t fw_eui_hash(uint64_t eui, int kind) {
+	return fw_mix64(eui + (uint64_t)kind * 0x9E3779B97F4A7C15ULL);
+}
+
+static void fw_bloom_add(struct fw_table * t, uint64_t h) {
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	uint32_t b;
+	int i;
+
+	for (i = 0; i < FW_BLOOM_HASHES; ++i) {
+		b = (h1 + (uint32_t)i * h2) & t->bloom_mask;
+		t->bloom[b >> 6] |= 1ULL << (b & 63);
+	}
+}
+
+static inline bool fw_bloom_test(const struct fw_table * t, uint64_t h) {
+	uint32_t h1 = (uint32_t)h;
+	uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	uint32_t b;
+	int i;
+
+	for (i = 0; i < FW_BLOOM_HASHES; ++i) {
+		b = (h1 + (uint32_t)i * h2) & t->bloom_mask;
+		if ((t->bloom[b >> 6] & (1ULL << (b & 63))) == 0) return false;
+	}
+	return true;
+}
+
+static void fw_eui_insert(struct fw_table * t, uint64_t eui, int kind, uint32_t index, int type) {
+	struct fw_eui_slot * s;
+	uint64_t h = fw_eui_hash(eui, kind);
+	uint32_t i;
+
+	fw_bloom_add(t, h);
+	for (i = (uint32_t)(h >> 40) & t->eui_mask; ; i = (i + 1) & t->eui_mask) {
+		s = &t->eui_slots[i];
+		if (s->rule == 0) {
+			s->eui = eui;
+			s->kind = (uint32_t)kind;
+			s->rule = (index << 8) | (uint32_t)type;
+			return;
+		}
+		if ((s->eui == eui) && (s->kind == (uint32_t)kind)) {
+			if (type < (int)(s->rule & 0xFF)) {
+				s->rule = (index << 8) | (uint32_t)type;
+			}
+			return;
+		}
+	}
+}
+
+static const struct fw_rule * fw_eui_find(const struct fw_table * t, uint64_t eui, int kind) {
+	const struct fw_eui_slot * s;
+	uint64_t h;
+	uint32_t i;
+
+	if (t->bloom == NULL) return NULL;
+	h = fw_eui_hash(eui, kind);
+	if (!fw_bloom_test(t, h)) return NULL; /* definitely not listed */
+	for (i = (uint32_t)(h >> 40) & t->eui_mask; ; i = (i + 1) & t->eui_mask) {
+		s = &t->eui_slots[i];
+		if (s->rule == 0) return NULL;
+		if ((s->eui == eui) && (s->kind == (uint32_t)kind)) return &t->rules[s->rule >> 8];
+	}
+}
+
+static inline uint64_t fw_get_eui(const uint8_t * buf) {
+	uint64_t eui = 0;
+	int i;
+
+	for (i = 7; i >= 0; --i) {
+		eui = (eui << 8) | buf[i]; /* little endian on air */
+	}
+	return eui;
+}
+
+/* "26031C2C" for a device, "26031C00/24" for a block of addresses */
+static int fw_parse_addr(const char * str, uint32_t * devaddr, uint8_t * plen) {
+	char * end;
+	const char * slash;
+	unsigned long len;
+
+	if (str == NULL) return -1;
+	slash = strchr(str, '/');
+	len = (slash != NULL) ? (unsigned long)(slash - str) : strlen(str);
+	if ((len == 0) || (len > 8)) return -1;
+	*devaddr = (uint32_t)strtoul(str, &end, 16);
+	if (end != str + len) return -1;
+	*plen = 32;
+	if (slash != NULL) {
+		len = strtoul(slash + 1, &end, 10);
+		if ((end == slash + 1) || (*end != 0) || (len > 32)) return -1;
+		*plen = (uint8_t)len;
+		if (len < 32) {
+			*devaddr &= ~(0xFFFFFFFFU >> len);
+		}
+	}
+	return 0;
+}
+
+static const struct fw_mic * fw_key_find(const struct fw_table * t, uint32_t devaddr, uint32_t * index) {
+	uint32_t i, k;
+
+	if (t->key_slots == NULL) return NULL;
+	for (i = (uint32_t)fw_mix64(devaddr) & t->key_mask; ; i = (i + 1) & t->key_mask) {
+		k = t->key_slots[i];
+		if (k == 0) return NULL;
+		if (t->keys[k - 1].addr == devaddr) {
+			*index = k - 1;
+			return &t->keys[k - 1];
+		}
+	}
+}
+
+/* {"keys": [{"addr": "26031C2C", "nwkskey": "2B7E151628AED2A6ABF7158809CF4F3C"}, ...]} */
+static int fw_load_keys(struct fw_table * t, const char * key_file) {
+	JSON_Value *root_val = NULL;
+	JSON_Object *node = NULL;
+	JSON_Array *keys = NULL;
+	const char *str;
+	uint8_t key[16];
+	uint32_t devaddr, idx;
+	uint32_t i, j, n;
+	uint8_t plen;
+	unsigned x;
+
+	root_val = json_parse_file_with_comments(key_file);
+	if (root_val == NULL) {
+		MSG("ERROR: [fw] %s is not a valid JSON file\n", key_file);
+		return -1;
+	}
+	keys = json_object_get_array(json_value_get_object(root_val), "keys");
+	n = (keys != NULL) ? (uint32_t)json_array_get_count(keys) : 0;
+	for (t->key_mask = 1U << FW_MIN_BITS; t->key_mask < 2 * n; t->key_mask <<= 1);
+	t->key_slots = calloc(t->key_mask, sizeof *t->key_slots);
+	t->keys = calloc(n + 1, sizeof *t->keys);
+	t->fcnt_hi = calloc(n + 1, sizeof *t->fcnt_hi);
+	t->key_mask -= 1;
+	if ((t->key_slots == NULL) || (t->keys == NULL) || (t->fcnt_hi == NULL)) {
+		json_value_free(root_val);
+		return -1;
+	}
+	for (i = 0; i < n; ++i) {
+		node = json_array_get_object(keys, i);
+		if ((fw_parse_addr(json_object_get_string(node, "addr"), &devaddr, &plen) != 0) || (plen != 32)) {
+			MSG("WARNING: [fw] key %u has an invalid address, ignored\n", i);
+			continue;
+		}
+		str = json_object_get_string(node, "nwkskey");
+		if ((str == NULL) || (strlen(str) != 32)) {
+			MSG("WARNING: [fw] key %u (%08X) is not 16 hex bytes, ignored\n", i, devaddr);
+			continue;
+		}
+		for (j = 0; j < 16; ++j) {
+			if (sscanf(str + 2 * j, "%2x", &x) != 1) break;
+			key[j] = (uint8_t)x;
+		}
+		if (j < 16) {
+			MSG("WARNING: [fw] key %u (%08X) is not 16 hex bytes, ignored\n", i, devaddr);
+			continue;
+		}
+		if (fw_key_find(t, devaddr, &idx) != NULL) {
+			MSG("WARNING: [fw] device %08X has several keys, keeping the first one\n", devaddr);
+			continue;
+		}
+		t->keys[t->nb_keys].addr = devaddr;
+		cmac_init(&t->keys[t->nb_keys].key, key);
+		for (j = (uint32_t)fw_mix64(devaddr) & t->key_mask; t->key_slots[j] != 0; j = (j + 1) & t->key_mask);
+		t->key_slots[j] = ++t->nb_keys;
+	}
+	memset(key, 0, sizeof key);
+	json_value_free(root_val);
+	MSG("INFO: [fw] %u device keys loaded from %s, MIC computed %s\n", t->nb_keys, key_file, cmac_hw_accelerated() ? "with AES-NI" : "in software");
+	return 0;
+}
+
+/* sort by address then length, the strongest duplicate last so it overwrites the others */
+static int fw_prefix_cmp(const void * a, const void * b) {
+	const struct fw_prefix * x = a;
+	const struct fw_prefix * y = b;
+
+	if (x->addr != y->addr) return (x->addr < y->addr) ? -1 : 1;
+	if (x->plen != y->plen) return (x->plen < y->plen) ? -1 : 1;
+	return (int)y->type - (int)x->type;
+}
+
+static int fw_trie_grow(struct fw_table * t, uint32_t nb_nodes, uint32_t nb_leaves, uint32_t * cap_nodes, uint32_t * cap_leaves) {
+	void * p;
+
+	if (t->nb_nodes + nb_nodes > *cap_nodes) {
+		while (t->nb_nodes + nb_nodes > *cap_nodes) *cap_nodes *= 2;
+		p = realloc(t->nodes, *cap_nodes * sizeof *t->nodes);
+		if (p == NULL) return -1;
+		t->nodes = p;
+	}
+	if (t->nb_leaves + nb_leaves > *cap_leaves) {
+		while (t->nb_leaves + nb_leaves > *cap_leaves) *cap_leaves *= 2;
+		p = realloc(t->leaves, *cap_leaves * sizeof *t->leaves);
+		if (p == NULL) return -1;
+		t->leaves = p;
+	}
+	return 0;
+}
+
+/* fill node n of the given level from the prefixes falling inside it (sorted, all longer than the level) */
+static int fw_trie_build(struct fw_table * t, uint32_t n, int level, const struct fw_prefix * pref, uint32_t nb_pref, uint32_t def_leaf, uint32_t * cap_nodes, uint32_t * cap_leaves) {
+	uint32_t slot_leaf[64];
+	uint32_t first[64], count[64]; /* prefixes of each slot that need a deeper node */
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0, base1, nb_run, prev, i, j, k;
+	int shift = FW_KEY_BITS - FW_STRIDE * (level + 1); /* position of the slot bits in the padded key */
+	int last_bit = FW_STRIDE * (level + 1); /* prefix length fully resolved by this level */
+	int plen;
+
+	/* expand the prefixes ending at this level, shortest first so that longer ones win */
+	for (j = 0; j < 64; ++j) slot_leaf[j] = def_leaf;
+	for (plen = FW_STRIDE * level + 1; (plen <= last_bit) && (plen <= 32); ++plen) {
+		for (i = 0; i < nb_pref; ++i) {
+			if (pref[i].plen != plen) continue;
+			j = (uint32_t)(((uint64_t)pref[i].addr << (FW_KEY_BITS - 32)) >> shift) & 63;
+			for (k = 0; k < (1U << (last_bit - plen)); ++k) {
+				slot_leaf[j + k] = pref[i].leaf;
+			}
+		}
+	}
+
+	/* group the longer prefixes by slot, they are sorted by address */
+	memset(count, 0, sizeof count);
+	for (i = 0; i < nb_pref; ++i) {
+		if (pref[i].plen <= last_bit) continue;
+		j = (uint32_t)(((uint64_t)pref[i].addr << (FW_KEY_BITS - 32)) >> shift) & 63;
+		if (count[j] == 0) first[j] = i;
+		count[j] = i - first[j] + 1;
+		vector |= 1ULL << j;
+	}
+
+	/* compress the leaves into runs, child slots do not break a run */
+	nb_run = 0;
+	for (j = 0; j < 64; ++j) {
+		if (vector & (1ULL << j)) continue;
+		if ((nb_run == 0) || (slot_leaf[j] != prev)) {
+			leafvec |= 1ULL << j;
+			prev = slot_leaf[j];
+			++nb_run;
+		}
+	}
+	if (fw_trie_grow(t, (uint32_t)__builtin_popcountll(vector), nb_run, cap_nodes, cap_leaves) != 0) {
+		return -1;
+	}
+	base0 = t->nb_leaves;
+	for (j = 0; j < 64; ++j) {
+		if (leafvec & (1ULL << j)) t->leaves[t->nb_leaves++] = slot_leaf[j];
+	}
+	base1 = t->nb_nodes; /* children of a node are contiguous */
+	t->nb_nodes += (uint32_t)__builtin_popcountll(vector);
+	t->nodes[n].vector = vector;
+	t->nodes[n].leafvec = leafvec;
+	t->nodes[n].base0 = base0;
+	t->nodes[n].base1 = base1;
+
+	/* build the children, depth first */
+	for (j = 0, k = 0; j < 64; ++j) {
+		if ((vector & (1ULL << j)) == 0) continue;
+		if (fw_trie_build(t, base1 + k, level + 1, &pref[first[j]], count[j], slot_leaf[j], cap_nodes, cap_leaves) != 0) {
+			return -1;
+		}
+		++k;
+	}
+	return 0;
+}
+
+static int fw_trie_compile(struct fw_table * t, struct fw_prefix * pref, uint32_t nb_pref) {
+	uint32_t cap_nodes = 64, cap_leaves = 256;
+	uint32_t def_leaf = 0;
+	uint32_t i;
+
+	qsort(pref, nb_pref, sizeof *pref, fw_prefix_cmp);
+
+	/* a /0 prefix matches everything, it becomes the default leaf */
+	for (i = 0; (i < nb_pref) && (pref[i].plen == 0); ++i) {
+		def_leaf = pref[i].leaf;
+	}
+	pref += i;
+	nb_pref -= i;
+
+	t->nodes = malloc(cap_nodes * sizeof *t->nodes);
+	t->leaves = malloc(cap_leaves * sizeof *t->leaves);
+	if ((t->nodes == NULL) || (t->leaves == NULL)) {
+		return -1;
+	}
+	t->nb_nodes = 1; /* root */
+	return fw_trie_build(t, 0, 0, pref, nb_pref, def_leaf, &cap_nodes, &cap_leaves);
+}
+
+/* longest-prefix match, returns rule index + 1, 0 if no prefix matches */
+static inline uint32_t fw_trie_lookup(const struct fw_table * t, uint32_t devaddr) {
+	const struct fw_pnode * n = &t->nodes[0];
+	uint64_t key = (uint64_t)devaddr << (FW_KEY_BITS - 32);
+	uint64_t mask;
+	int shift = FW_KEY_BITS - FW_STRIDE;
+	unsigned j;
+
+	for (;;) {
+		j = (unsigned)(key >> shift) & 63;
+		mask = (2ULL << j) - 1; /* slots 0 to j, wraps to all ones for j = 63 */
+		if ((n->vector & (1ULL << j)) == 0) {
+			return t->leaves[n->base0 + __builtin_popcountll(n->leafvec & mask) - 1];
+		}
+		n = &t->nodes[n->base1 + __builtin_popcountll(n->vector & mask) - 1];
+		shift -= FW_STRIDE;
+	}
+}
+
+/* "rate" is in frames per second, "burst" in frames */
+static void fw_parse_rate(const JSON_Object * obj, uint32_t * rate, uint32_t * burst) {
+	JSON_Value *val;
+	double x;
+
+	val = json_object_get_value(obj, "rate");
+	if (json_value_get_type(val) != JSONNumber) return;
+	x = json_value_get_number(val);
+	if (x > 1000000.0) x = 1000000.0; /* no limit in practice, and the cast stays defined */
+	*rate = (x > 0.0) ? (uint32_t)(x * (FW_TOKEN / 1000)) : 0;
+	if (*rate == 0) return;
+	val = json_object_get_value(obj, "burst");
+	x = (json_value_get_type(val) == JSONNumber) ? json_value_get_number(val) : 1.0;
+	if (x < 1.0) x = 1.0;
+	if (x > 4000.0) x = 4000.0;
+	*burst = (uint32_t)(x * FW_TOKEN);
+}
+
+/* {"size": [min, max], "fport": [p, ...], "rssi": [min, max], "rule": "deny", "priority": 1} */
+static int fw_parse_filter(const JSON_Object * obj, struct fw_filter * f) {
+	JSON_Array *arr;
+	double x;
+	size_t i, n;
+
+	memset(f, 0, sizeof *f);
+	f->type = (uint8_t)fw_parse_rule(json_object_get_string(obj, "rule"));
+	if ((f->type != FW_RULE_DENY) && (f->type != FW_RULE_ALLOW)) return -1;
+	f->priority = (int)json_object_get_number(obj, "priority"); /* 0 if absent */
+
+	arr = json_object_get_array(obj, "size");
+	if (arr != NULL) {
+		if (json_array_get_count(arr) != 2) return -1;
+		f->size_min = (uint16_t)json_array_get_number(arr, 0);
+		f->size_max = (uint16_t)json_array_get_number(arr, 1);
+		f->match |= FW_MATCH_SIZE;
+	}
+	arr = json_object_get_array(obj, "fport");
+	if (arr != NULL) {
+		n = json_array_get_count(arr);
+		for (i = 0; i < n; ++i) {
+			x = json_array_get_number(arr, i);
+			if ((x < 0.0) || (x > 255.0)) return -1;
+			f->fport[(unsigned)x >> 5] |= 1U << ((unsigned)x & 31);
+		}
+		f->match |= FW_MATCH_FPORT;
+	}
+	arr = json_object_get_array(obj, "rssi");
+	if (arr != NULL) {
+		if (json_array_get_count(arr) != 2) return -1;
+		f->rssi_min = (float)json_array_get_number(arr, 0);
+		f->rssi_max = (float)json_array_get_number(arr, 1);
+		f->match |= FW_MATCH_RSSI;
+	}
+	return (f->match != 0) ? 0 : -1;
+}
+
+static void fw_insert(struct fw_table * t, uint32_t devaddr, uint32_t index, int type) {
+	struct fw_slot * s;
+	uint32_t i;
+
+	for (i = fw_hash(t, devaddr); ; i = (i + 1) & t->mask) {
+		s = &t->slots[i];
+		if (s->rule == 0) {
+			s->addr = devaddr;
+			s->rule = (index << 8) | (uint32_t)type;
+			return;
+		}
+		if (s->addr == devaddr) {
+			/* listed twice, keep the rule with the highest precedence */
+			if (type < (int)(s->rule & 0xFF)) {
+				s->rule = (index << 8) | (uint32_t)type;
+			}
+			return;
+		}
+	}
+}
+
+static const struct fw_rule * fw_find(const struct fw_table * t, uint32_t devaddr) {
+	const struct fw_slot * s;
+	uint32_t i;
+
+	/* with prefixes, the trie holds every rule and gives the longest match */
+	if (t->nodes != NULL) {
+		i = fw_trie_lookup(t, devaddr);
+		return (i != 0) ? &t->rules[i - 1] : NULL;
+	}
+
+	for (i = fw_hash(t, devaddr); ; i = (i + 1) & t->mask) {
+		s = &t->slots[i];
+		if (s->rule == 0) return NULL;
+		if (s->addr == devaddr) return &t->rules[s->rule >> 8];
+	}
+}
+
+/* wait until every reader that was inside a critical section has left it */
+static void fw_synchronize(void) {
+	uint32_t snap[FW_MAX_READERS];
+	unsigned i, n;
+
+	n = __atomic_load_n(&fw_nb_readers, __ATOMIC_ACQUIRE);
+	if (n > FW_MAX_READERS) n = FW_MAX_READERS; /* failed registrations */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); /* order the pointer swap before the snapshot */
+	for (i = 0; i < n; ++i) {
+		snap[i] = __atomic_load_n(&fw_readers[i].seq, __ATOMIC_ACQUIRE);
+	}
+	for (i = 0; i < n; ++i) {
+		if ((snap[i] & 1) == 0) continue; /* was quiescent, cannot hold the old table */
+		while (__atomic_load_n(&fw_readers[i].seq, __ATOMIC_ACQUIRE) == snap[i]) {
+			wait_ms(FW_GRACE_MS);
+		}
+	}
+}
+
+/* swap the active table, then free the previous one after a grace period */
+static void fw_publish(struct fw_table * t) {
+	struct fw_table * old;
+
+	old = __atomic_exchange_n(&fw_active, t, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		fw_synchronize();
+		fw_free(old);
+	}
+}
+
+static int fw_reload(void) {
+	struct fw_table * t;
+
+	const struct fw_table * old;
+	uint32_t i, j;
+
+	t = fw_load(fw_path);
+	if (t == NULL) {
+		MSG("WARNING: [fw] reload of %s failed, keeping the previous rules\n", fw_path);
+		return -1;
+	}
+
+	/* carry the FCnt MSB over, the old table is not freed before fw_publish */
+	old = __atomic_load_n(&fw_active, __ATOMIC_ACQUIRE);
+	if (old != NULL) {
+		for (i = 0; i < t->nb_keys; ++i) {
+			if (fw_key_find(old, t->keys[i].addr, &j) != NULL) {
+				t->fcnt_hi[i] = __atomic_load_n(&old->fcnt_hi[j], __ATOMIC_RELAXED);
+			}
+		}
+	}
+	fw_publish(t);
+	return 0;
+}
+
+static void fw_watch(void) {
+#ifdef __linux__
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char dir_buf[sizeof fw_path];
+	char base_buf[sizeof fw_path];
+	const char * base;
+	const struct inotify_event * ev;
+	struct pollfd pfd;
+	ssize_t len;
+	char * ptr;
+	bool changed;
+	int fd;
+
+	/* watch the directory, editors usually replace the file instead of rewriting it */
+	strncpy(dir_buf, fw_path, sizeof dir_buf);
+	strncpy(base_buf, fw_path, sizeof base_buf);
+	base = basename(base_buf);
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ((fd == -1) || (inotify_add_watch(fd, dirname(dir_buf), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1)) {
+		MSG("WARNING: [fw] cannot watch %s (%s), rules will only be reloaded on SIGHUP\n", fw_path, strerror(errno));
+		if (fd != -1) close(fd);
+		fd = -1;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+#endif
+
+	MSG("INFO: [fw] Reload thread activated.\n");
+
+	while (fw_watch_run) {
+#ifdef __linux__
+		changed = false;
+		if (fd == -1) {
+			wait_ms(FW_WATCH_MS);
+		} else if (poll(&pfd, 1, FW_WATCH_MS) > 0) {
+			while ((len = read(fd, buff, sizeof buff)) > 0) {
+				for (ptr = buff; ptr < buff + len; ptr += sizeof(struct inotify_event) + ev->len) {
+					ev = (const struct inotify_event *)ptr;
+					if ((ev->len > 0) && (strcmp(ev->name, base) == 0)) {
+						changed = true;
+					}
+				}
+			}
+		}
+		if (changed) {
+			wait_ms(FW_SETTLE_MS);
+			fw_reload_pending = 1;
+		}
+#else
+		wait_ms(FW_WATCH_MS);
+#endif
+		if (fw_reload_pending) {
+			fw_reload_pending = 0;
+			MSG("INFO: [fw] reloading rules from %s\n", fw_path);
+			fw_reload();
+		}
+	}
+
+#ifdef __linux__
+	if (fd != -1) close(fd);
+#endif
+	MSG("\nINFO: End of firewall reload thread\n");
+}
+
+/* counters and filter order, the writable part of a table */
+static int fw_alloc_state(struct fw_table * t) {
+	size_t n = t->nb_entries + 1 + t->nb_filter_ids;
+	struct fw_state * s;
+
+	t->hits_stride = ((uint32_t)n + FW_HITS_LINE - 1) & ~(uint32_t)(FW_HITS_LINE - 1);
+	if (posix_memalign((void **)&t->hits, 64, (size_t)FW_MAX_READERS * t->hits_stride * sizeof *t->hits) != 0) {
+		t->hits = NULL;
+		return -1;
+	}
+	memset(t->hits, 0, (size_t)FW_MAX_READERS * t->hits_stride * sizeof *t->hits);
+	s = calloc(1, sizeof *s);
+	if (s == NULL) return -1;
+	t->state = s;
+	s->reported = calloc(n, sizeof *s->reported);
+	if (s->reported == NULL) return -1;
+	if (t->nb_filter_ids > 0) {
+		s->filters = calloc(t->nb_filter_ids, sizeof *s->filters);
+		s->score = calloc(t->nb_filter_ids, sizeof *s->score);
+		s->filter_reported = calloc(t->nb_filter_ids, sizeof *s->filter_reported);
+		if ((s->filters == NULL) || (s->score == NULL) || (s->filter_reported == NULL)) return -1;
+	}
+	return 0;
+}
+
+/* CRC-32 (IEEE 802.3, reflected), table built on first use */
+static uint32_t fw_crc32(const uint8_t * buf, size_t len) {
+	static uint32_t table[256];
+	static bool ready = false;
+	uint32_t crc, c;
+	size_t i;
+	int k;
+
+	if (!ready) {
+		for (i = 0; i < 256; ++i) {
+			c = (uint32_t)i;
+			for (k = 0; k < 8; ++k) {
+				c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+			}
+			table[i] = c;
+		}
+		ready = true; /* same content if two threads race */
+	}
+	crc = 0xFFFFFFFF;
+	for (i = 0; i < len; ++i) {
+		crc = table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+/* images are only valid on hosts with the same structure layout */
+static uint32_t fw_image_layout(void) {
+	uint32_t h = sizeof(struct fw_image_hdr);
+
+	h = h * 31 + sizeof(struct fw_rule);
+	h = h * 31 + sizeof(struct fw_slot);
+	h = h * 31 + sizeof(struct fw_pnode);
+	h = h * 31 + sizeof(struct fw_eui_slot);
+	h = h * 31 + sizeof(struct fw_filter);
+	return h;
+}
+
+static struct fw_table * fw_load_image(const char * image_file) {
+	struct fw_image_hdr hdr;
+	struct fw_table * t;
+	struct stat st;
+	uint8_t * img;
+	int fd;
+	int i;
+
+	fd = open(image_file, O_RDONLY);
+	if (fd < 0) {
+		MSG("ERROR: [fw] failed to open %s: %s\n", image_file, strerror(errno));
+		return NULL;
+	}
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof hdr)) {
+		MSG("ERROR: [fw] %s is too short to be a rule image\n", image_file);
+		close(fd);
+		return NULL;
+	}
+	img = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); /* the mapping keeps the file */
+	if (img == MAP_FAILED) {
+		MSG("ERROR: [fw] failed to map %s: %s\n", image_file, strerror(errno));
+		return NULL;
+	}
+
+	/* check the image before trusting any offset */
+	memcpy(&hdr, img, sizeof hdr);
+	if ((hdr.version != FW_IMAGE_VERSION) || (hdr.endian != 0x0102) || (hdr.layout != fw_image_layout())) {
+		MSG("ERROR: [fw] %s was compiled for another version or architecture, recompile it\n", image_file);
+		munmap(img, (size_t)st.st_size);
+		return NULL;
+	}
+	if ((hdr.size != (uint64_t)st.st_size) || (fw_crc32(img + sizeof hdr, hdr.size - sizeof hdr) != hdr.crc)) {
+		MSG("ERROR: [fw] %s is truncated or corrupted\n", image_file);
+		munmap(img, (size_t)st.st_size);
+		return NULL;
+	}
+	for (i = 0; i < FW_SEC_COUNT; ++i) {
+		if (((uint64_t)hdr.sec[i].offset + hdr.sec[i].length > hdr.size) || (hdr.sec[i].offset % FW_IMAGE_ALIGN != 0)) {
+			MSG("ERROR: [fw] %s has an invalid section table\n", image_file);
+			munmap(img, (size_t)st.st_size);
+			return NULL;
+		}
+	}
+	if ((hdr.bits > 31) /* first, it is the shift count of the next tests */
+		|| (hdr.sec[FW_SEC_RULES].length != (hdr.nb_entries + 1) * sizeof(struct fw_rule))
+		|| (hdr.sec[FW_SEC_SLOTS].length != (sizeof(struct fw_slot) << hdr.bits))
+		|| (hdr.sec[FW_SEC_NODES].length != hdr.nb_nodes * sizeof(struct fw_pnode))
+		|| (hdr.sec[FW_SEC_LEAVES].length != hdr.nb_leaves * sizeof(uint32_t))
+		|| (hdr.sec[FW_SEC_FILTERS].length != hdr.nb_filters * sizeof(struct fw_filter))
+		|| ((hdr.nb_euis > 0) && ((hdr.sec[FW_SEC_EUI_SLOTS].length != (hdr.eui_mask + 1) * sizeof(struct fw_eui_slot))
+			|| (hdr.sec[FW_SEC_BLOOM].length != (hdr.bloom_mask + 1) / 8)))
+		|| (hdr.nb_filters > hdr.nb_filter_ids)) {
+		MSG("ERROR: [fw] %s has inconsistent section sizes\n", image_file);
+		munmap(img, (size_t)st.st_size);
+		return NULL;
+	}
+
+	t = calloc(1, sizeof *t);
+	if (t == NULL) {
+		munmap(img, (size_t)st.st_size);
+		return NULL;
+	}
+	t->image = img;
+	t->image_size = (size_t)st.st_size;
+	t->policy = (uint8_t)hdr.policy;
+	t->rate = hdr.rate;
+	t->burst = hdr.burst;
+	memcpy(t->down_rate, hdr.down_rate, sizeof t->down_rate);
+	memcpy(t->down_burst, hdr.down_burst, sizeof t->down_burst);
+	t->bits = hdr.bits;
+	t->mask = (1U << hdr.bits) - 1;
+	t->nb_rules = hdr.nb_rules;
+	t->nb_entries = hdr.nb_entries;
+	t->nb_prefixes = hdr.nb_prefixes;
+	t->nb_nodes = hdr.nb_nodes;
+	t->nb_leaves = hdr.nb_leaves;
+	t->nb_euis = hdr.nb_euis;
+	t->eui_mask = hdr.eui_mask;
+	t->bloom_mask = hdr.bloom_mask;
+	t->nb_filter_ids = hdr.nb_filter_ids;
+	t->rules = (struct fw_rule *)(img + hdr.sec[FW_SEC_RULES].offset);
+	t->slots = (struct fw_slot *)(img + hdr.sec[FW_SEC_SLOTS].offset);
+	if (hdr.nb_nodes > 0) {
+		t->nodes = (struct fw_pnode *)(img + hdr.sec[FW_SEC_NODES].offset);
+		t->leaves = (uint32_t *)(img + hdr.sec[FW_SEC_LEAVES].offset);
+	}
+	if (hdr.nb_euis > 0) {
+		t->eui_slots = (struct fw_eui_slot *)(img + hdr.sec[FW_SEC_EUI_SLOTS].offset);
+		t->bloom = (uint64_t *)(img + hdr.sec[FW_SEC_BLOOM].offset);
+	}
+
+	/* writable state, the filter order changes at run time */
+	if (fw_alloc_state(t) != 0) {
+		fw_free(t);
+		return NULL;
+	}
+	t->nb_filters = hdr.nb_filters;
+	if (t->nb_filters > 0) {
+		memcpy(t->state->filters, img + hdr.sec[FW_SEC_FILTERS].offset, hdr.sec[FW_SEC_FILTERS].length);
+	}
+	if (hdr.sec[FW_SEC_KEY_PATH].length > 1) {
+		t->key_path = strndup((const char *)img + hdr.sec[FW_SEC_KEY_PATH].offset, hdr.sec[FW_SEC_KEY_PATH].length - 1);
+		if ((t->key_path == NULL) || (fw_load_keys(t, t->key_path) != 0)) {
+			MSG("ERROR: [fw] failed to load device keys from %s\n", (t->key_path != NULL) ? t->key_path : "image");
+			fw_free(t);
+			return NULL;
+		}
+	}
+	MSG("INFO: [fw] %u rules mapped from image %s, unlisted devices are %s\n", t->nb_rules, image_file, (t->policy == FW_PASS) ? "allowed" : "denied");
+	return t;
+}
+
+/* sum of the counters of all readers */
+static struct fw_hits fw_hits_sum(const struct fw_table * t, uint32_t c) {
+	struct fw_hits sum = {0, 0};
+	uint32_t k;
+
+	for (k = 0; k < FW_MAX_READERS; ++k) {
+		sum.pass += __atomic_load_n(&t->hits[k * t->hits_stride + c].pass, __ATOMIC_RELAXED);
+		sum.drop += __atomic_load_n(&t->hits[k * t->hits_stride + c].drop, __ATOMIC_RELAXED);
+	}
+	return sum;
+}
+
+static void fw_rule_name(const struct fw_table * t, uint32_t i, char * name, size_t size) {
+	const struct fw_rule * r = &t->rules[i];
+
+	if (i > t->nb_entries) {
+		snprintf(name, size, "filter%u", i - t->nb_entries - 1);
+	} else if (i == t->nb_entries) {
+		snprintf(name, size, "default");
+	} else if (r->kind != FW_KEY_DEVADDR) {
+		snprintf(name, size, "%016llX", (unsigned long long)r->eui);
+	} else if (r->plen == 32) {
+		snprintf(name, size, "%08X", r->addr);
+	} else {
+		snprintf(name, size, "%08X/%u", r->addr, r->plen);
+	}
+}
+
+/* first matching filter in the current order, FW_RULE_NONE if none matches */
+static int fw_match_filters(const struct fw_table * t, const struct lgw_pkt_rx_s * p) {
+	const struct fw_filter * filters;
+	const struct fw_filter * f;
+	struct fw_hits * h;
+	int fport = -1; /* no FPort */
+	unsigned fopts;
+	uint32_t i;
+
+	/* FPort follows MHDR, DevAddr, FCtrl, FCnt and FOpts */
+	if ((((p->payload[0] >> 5) == MTYPE_UNCONF_DATA_UP) || ((p->payload[0] >> 5) == MTYPE_CONF_DATA_UP)) && (p->size >= 12)) {
+		fopts = p->payload[5] & 0x0F;
+		if (p->size > 12 + fopts) fport = p->payload[8 + fopts];
+	}
+
+	filters = __atomic_load_n(&t->state->filters, __ATOMIC_ACQUIRE);
+	for (i = 0; i < t->nb_filters; ++i) {
+		f = &filters[i];
+		if ((f->match & FW_MATCH_SIZE) && ((p->size < f->size_min) || (p->size > f->size_max))) continue;
+		if ((f->match & FW_MATCH_FPORT) && ((fport < 0) || !(f->fport[fport >> 5] & (1U << (fport & 31))))) continue;
+		if ((f->match & FW_MATCH_RSSI) && ((p->rssi < f->rssi_min) || (p->rssi > f->rssi_max))) continue;
+		if (fw_self >= 0) {
+			h = &t->hits[(uint32_t)fw_self * t->hits_stride + t->nb_entries + 1 + f->id];
+			if (f->type == FW_RULE_ALLOW) {
+				__atomic_store_n(&h->pass, h->pass + 1, __ATOMIC_RELAXED);
+			} else {
+				__atomic_store_n(&h->drop, h->drop + 1, __ATOMIC_RELAXED);
+			}
+		}
+		return f->type;
+	}
+	return FW_RULE_NONE;
+}
+
+/* frame that cannot be attributed to a device, only filters apply */
+static int fw_unattributed(const struct fw_table * t, const struct lgw_pkt_rx_s * p) {
+	if ((t->nb_filters > 0) && (fw_match_filters(t, p) == FW_RULE_DENY)) {
+		return FW_DROP;
+	}
+	return t->policy;
+}
+
+static int fw_verdict(const struct fw_table * t, struct fw_limiter * l, const struct lgw_pkt_rx_s * p, uint32_t now_ms, const struct fw_rule ** rule) {
+	const struct fw_rule * r = NULL;
+	uint32_t key; /* DevAddr, or folded DevEUI for the rate limiter */
+	uint64_t deveui;
+	uint32_t rate, burst;
+
+	if (p->size < 1) return fw_unattributed(t, p);
+
+	/* route the frame on its MHDR */
+	switch (p->payload[0] >> 5) {
+		case MTYPE_UNCONF_DATA_UP:
+		case MTYPE_CONF_DATA_UP:
+			/* MHDR + FHDR + MIC, DevAddr is transmitted little endian */
+			if (p->size < 12) return fw_unattributed(t, p);
+			key  = (uint32_t)p->payload[1];
+			key |= (uint32_t)p->payload[2] << 8;
+			key |= (uint32_t)p->payload[3] << 16;
+			key |= (uint32_t)p->payload[4] << 24;
+			r = fw_find(t, key);
+			break;
+		case MTYPE_JOIN_REQUEST:
+			/* MHDR + JoinEUI + DevEUI + DevNonce + MIC, a DevEUI rule is more specific than a JoinEUI rule */
+			if (p->size != 23) return fw_unattributed(t, p);
+			deveui = fw_get_eui(&p->payload[9]);
+			r = fw_eui_find(t, deveui, FW_KEY_DEVEUI);
+			if (r == NULL) {
+				r = fw_eui_find(t, fw_get_eui(&p->payload[1]), FW_KEY_JOINEUI);
+			}
+			key = (uint32_t)(deveui ^ (deveui >> 32));
+			break;
+		case MTYPE_REJOIN_REQUEST:
+			/* type 0 and 2: NetID + DevEUI, type 1: JoinEUI + DevEUI */
+			if (p->size < 19) return fw_unattributed(t, p);
+			if (p->payload[1] == 1) {
+				if (p->size != 24) return fw_unattributed(t, p);
+				deveui = fw_get_eui(&p->payload[10]);
+				r = fw_eui_find(t, deveui, FW_KEY_DEVEUI);
+				if (r == NULL) {
+					r = fw_eui_find(t, fw_get_eui(&p->payload[2]), FW_KEY_JOINEUI);
+				}
+			} else {
+				deveui = fw_get_eui(&p->payload[5]);
+				r = fw_eui_find(t, deveui, FW_KEY_DEVEUI);
+			}
+			key = (uint32_t)(deveui ^ (deveui >> 32));
+			break;
+		default:
+			/* downlinks heard over the air, join-accepts, proprietary frames */
+			return fw_unattributed(t, p);
+	}
+
+	*rule = r;
+	switch ((r != NULL) ? r->type : FW_RULE_NONE) {
+		case FW_RULE_BLACK:
+			return FW_DROP;
+		case FW_RULE_WHITE:
+			return FW_PASS; /* trusted, neither filtered nor rate limited */
+		default:
+			break;
+	}
+	if ((t->nb_filters > 0) && (fw_match_filters(t, p) == FW_RULE_DENY)) {
+		return FW_DROP;
+	}
+	switch ((r != NULL) ? r->type : FW_RULE_NONE) {
+		case FW_RULE_DENY:
+			return FW_DROP;
+		case FW_RULE_ALLOW:
+			break;
+		default:
+			if (t->policy == FW_DROP) return FW_DROP;
+	}
+
+	/* per-device token bucket, node settings override the default */
+	if ((r != NULL) && (r->rate > 0)) {
+		rate = r->rate;
+		burst = r->burst;
+	} else {
+		rate = t->rate;
+		burst = t->burst;
+	}
+	if ((l == NULL) || (rate == 0)) {
+		return FW_PASS;
+	}
+	return fw_limit(l, key, now_ms, rate, burst);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+static struct fw_table * fw_load_json(const char * conf_file) {
+	const char conf_obj_name[] = "firewall_conf";
+	JSON_Value *root_val = NULL;
+	JSON_Object *conf_obj = NULL;
+	JSON_Object *obj = NULL;
+	JSON_Object *node = NULL;
+	JSON_Array *nodes = NULL;
+	const char *str; /* pointer to sub-strings in the JSON data */
+	struct fw_table * t;
+	struct fw_prefix * pref = NULL;
+	uint32_t devaddr;
+	uint64_t eui;
+	JSON_Array *filters = NULL;
+	struct fw_filter f;
+	uint32_t i, j, nb_nodes, nb_euis, nb_filters;
+	uint8_t plen;
+	int kind;
+	int type;
+
+	/* try to parse JSON */
+	root_val = json_parse_file_with_comments(conf_file);
+	if (root_val == NULL) {
+		MSG("ERROR: [fw] %s is not a valid JSON file\n", conf_file);
+		return NULL;
+	}
+
+	/* point to the firewall configuration object */
+	conf_obj = json_object_get_object(json_value_get_object(root_val), conf_obj_name);
+	if (conf_obj == NULL) {
+		MSG("ERROR: [fw] %s does not contain a JSON object named %s\n", conf_file, conf_obj_name);
+		json_value_free(root_val);
+		return NULL;
+	}
+
+	t = calloc(1, sizeof *t);
+	if (t == NULL) {
+		json_value_free(root_val);
+		return NULL;
+	}
+
+	/* policy for unlisted addresses (optional, default is to forward) */
+	t->policy = FW_PASS;
+	str = json_object_get_string(conf_obj, "default");
+	if (str != NULL) {
+		if (strcmp(str, "deny") == 0) {
+			t->policy = FW_DROP;
+		} else if (strcmp(str, "allow") != 0) {
+			MSG("WARNING: [fw] invalid default policy \"%s\", using allow\n", str);
+		}
+	}
+
+	/* default rate limit (optional) */
+	obj = json_object_get_object(conf_obj, "rate_limit");
+	if (obj != NULL) {
+		fw_parse_rate(obj, &t->rate, &t->burst);
+	}
+
+	/* downlink rate limits (optional) */
+	obj = json_object_get_object(conf_obj, "downlink");
+	if (obj != NULL) {
+		for (i = 0; i < 3; ++i) {
+			node = json_object_get_object(obj, fw_down_names[i]);
+			if (node != NULL) {
+				fw_parse_rate(node, &t->down_rate[i], &t->down_burst[i]);
+			}
+			if (t->down_rate[i] > 0) {
+				MSG("INFO: [fw] downlinks limited to %.3f frames/s per %s, burst %u\n", (double)t->down_rate[i] / (FW_TOKEN / 1000), fw_down_names[i], t->down_burst[i] / FW_TOKEN);
+			}
+		}
+	}
+
+	/* size the tables for a load factor of at most one half */
+	nodes = json_object_get_array(conf_obj, "nodes");
+	nb_nodes = (nodes != NULL) ? (uint32_t)json_array_get_count(nodes) : 0;
+	nb_euis = 0;
+	for (i = 0; i < nb_nodes; ++i) {
+		node = json_array_get_object(nodes, i);
+		if ((json_object_get_string(node, "deveui") != NULL) || (json_object_get_string(node, "joineui") != NULL)) {
+			++nb_euis;
+		}
+	}
+	for (t->bits = FW_MIN_BITS; (1UL << t->bits) < 2 * (unsigned long)nb_nodes; ++t->bits);
+	t->mask = (1U << t->bits) - 1;
+	t->slots = calloc((size_t)t->mask + 1, sizeof *t->slots);
+	t->rules = calloc(nb_nodes + 1, sizeof *t->rules);
+	pref = calloc(nb_nodes + 1, sizeof *pref);
+	filters = json_object_get_array(conf_obj, "filters");
+	nb_filters = (filters != NULL) ? (uint32_t)json_array_get_count(filters) : 0;
+	if (nb_filters > 0xFFFF) nb_filters = 0xFFFF;
+	t->nb_entries = nb_nodes;
+	t->nb_filter_ids = nb_filters;
+	if (fw_alloc_state(t) != 0) {
+		free(t->hits); /* reported as an allocation failure below */
+		t->hits = NULL;
+	}
+	if (nb_euis > 0) {
+		for (t->eui_mask = 1U << FW_MIN_BITS; t->eui_mask < 2 * nb_euis; t->eui_mask <<= 1);
+		for (t->bloom_mask = 64; t->bloom_mask < FW_BLOOM_BITS * nb_euis; t->bloom_mask <<= 1);
+		t->eui_slots = calloc(t->eui_mask, sizeof *t->eui_slots);
+		t->bloom = calloc(t->bloom_mask / 64, sizeof *t->bloom);
+		t->eui_mask -= 1;
+		t->bloom_mask -= 1;
+	}
+	if ((t->slots == NULL) || (t->rules == NULL) || (pref == NULL) || (t->hits == NULL) || (t->state == NULL) || ((nb_euis > 0) && ((t->eui_slots == NULL) || (t->bloom == NULL)))) {
+		MSG("ERROR: [fw] failed to allocate %u rule slots\n", t->mask + 1);
+		free(pref);
+		fw_free(t);
+		json_value_free(root_val);
+		return NULL;
+	}
+
+	/* compile the rules */
+	for (i = 0; i < nb_nodes; ++i) {
+		node = json_array_get_object(nodes, i);
+		type = fw_parse_rule(json_object_get_string(node, "rule"));
+		if (type == FW_RULE_NONE) {
+			MSG("WARNING: [fw] node %u has an invalid rule, rule ignored\n", i);
+			continue;
+		}
+
+		/* join-request rules, on DevEUI or JoinEUI */
+		kind = FW_KEY_DEVADDR;
+		if ((str = json_object_get_string(node, "deveui")) != NULL) {
+			kind = FW_KEY_DEVEUI;
+		} else if ((str = json_object_get_string(node, "joineui")) != NULL) {
+			kind = FW_KEY_JOINEUI;
+		}
+		if (kind != FW_KEY_DEVADDR) {
+			if (fw_parse_eui(str, &eui) != 0) {
+				MSG("WARNING: [fw] node %u has an invalid EUI, rule ignored\n", i);
+				continue;
+			}
+			t->rules[i].type = (uint8_t)type;
+			t->rules[i].kind = (uint8_t)kind;
+			t->rules[i].eui = eui;
+			fw_parse_rate(node, &t->rules[i].rate, &t->rules[i].burst);
+			fw_eui_insert(t, eui, kind, i, type);
+			++t->nb_euis;
+			continue;
+		}
+
+		/* data frame rules, on DevAddr or DevAddr prefix */
+		str = json_object_get_string(node, "addr");
+		if (fw_parse_addr(str, &devaddr, &plen) != 0) {
+			MSG("WARNING: [fw] node %u has an invalid address, rule ignored\n", i);
+			continue;
+		}
+		t->rules[i].type = (uint8_t)type;
+		t->rules[i].kind = FW_KEY_DEVADDR;
+		t->rules[i].addr = devaddr;
+		t->rules[i].plen = plen;
+		fw_parse_rate(node, &t->rules[i].rate, &t->rules[i].burst);
+		if (plen == 32) {
+			fw_insert(t, devaddr, i, type);
+		} else {
+			++t->nb_prefixes;
+		}
+		pref[t->nb_rules].addr = devaddr;
+		pref[t->nb_rules].plen = plen;
+		pref[t->nb_rules].type = (uint8_t)type;
+		pref[t->nb_rules].leaf = i + 1;
+		++t->nb_rules;
+	}
+	t->nb_rules += t->nb_euis;
+
+	/* prefixes need the trie, exact addresses are added to it for a single lookup */
+	if (t->nb_prefixes > 0) {
+		if (fw_trie_compile(t, pref, t->nb_rules - t->nb_euis) != 0) {
+			MSG("ERROR: [fw] failed to allocate the prefix trie\n");
+			free(pref);
+			fw_free(t);
+			json_value_free(root_val);
+			return NULL;
+		}
+		MSG("INFO: [fw] %u prefix rules, trie of %u nodes and %u leaves\n", t->nb_prefixes, t->nb_nodes, t->nb_leaves);
+	}
+	free(pref);
+
+	/* linear filters, sorted by decreasing priority, configuration order among equals */
+	for (i = 0; i < nb_filters; ++i) {
+		if (fw_parse_filter(json_array_get_object(filters, i), &f) != 0) {
+			MSG("WARNING: [fw] filter %u is invalid, ignored\n", i);
+			continue;
+		}
+		f.id = (uint16_t)i;
+		for (j = t->nb_filters; (j > 0) && (t->state->filters[j - 1].priority < f.priority); --j) {
+			t->state->filters[j] = t->state->filters[j - 1];
+		}
+		t->state->filters[j] = f;
+		++t->nb_filters;
+	}
+	if (t->nb_filters > 0) {
+		MSG("INFO: [fw] %u filters on size, FPort or RSSI\n", t->nb_filters);
+	}
+
+	/* NwkSKey of the devices whose MIC is verified (optional) */
+	str = json_object_get_string(conf_obj, "mic_keys");
+	if ((str != NULL) && (((t->key_path = strdup(str)) == NULL) || (fw_load_keys(t, str) != 0))) {
+		MSG("ERROR: [fw] failed to load device keys from %s\n", str);
+		fw_free(t);
+		json_value_free(root_val);
+		return NULL;
+	}
+	MSG("INFO: [fw] %u rules loaded from %s, unlisted devices are %s\n", t->nb_rules, conf_file, (t->policy == FW_PASS) ? "allowed" : "denied");
+	if (t->rate > 0) {
+		MSG("INFO: [fw] devices are limited to %.3f frames/s, burst %u\n", (double)t->rate / (FW_TOKEN / 1000), t->burst / FW_TOKEN);
+	}
+
+	json_value_free(root_val);
+	return t;
+}
+
+void fw_free(struct fw_table * t) {
+	if (t == NULL) return;
+	if (t->image != NULL) {
+		munmap(t->image, t->image_size); /* rules, slots, trie and Bloom filter */
+	} else {
+		free(t->slots);
+		free(t->rules);
+		free(t->nodes);
+		free(t->leaves);
+		free(t->eui_slots);
+		free(t->bloom);
+	}
+	free(t->key_path);
+	free(t->key_slots);
+	if (t->keys != NULL) memset(t->keys, 0, t->nb_keys * sizeof *t->keys); /* do not leave keys in the heap */
+	free(t->keys);
+	free(t->fcnt_hi);
+	free(t->hits);
+	if (t->state != NULL) {
+		free(t->state->reported);
+		free(t->state->filters);
+		free(t->state->score);
+		free(t->state->filter_reported);
+		free(t->state);
+	}
+	free(t);
+}
+
+int fw_start(const char * conf_file) {
+	int i;
+
+	strncpy(fw_path, conf_file, sizeof fw_path - 1);
+	if (fw_reload() != 0) {
+		return -1;
+	}
+	fw_down[0] = fw_limiter_new(FW_LIMIT_DEVICES);
+	fw_down[1] = fw_limiter_new(FW_DOWN_SERVERS);
+	fw_down[2] = fw_limiter_new(FW_DOWN_FREQS);
+	if ((fw_down[0] == NULL) || (fw_down[1] == NULL) || (fw_down[2] == NULL)) {
+		MSG("ERROR: [fw] failed to allocate downlink rate limiters\n");
+		return -1;
+	}
+
+	fw_watch_run = true;
+	i = pthread_create(&thrid_fw, NULL, (void * (*)(void *))fw_watch, NULL);
+	if (i != 0) {
+		MSG("WARNING: [fw] impossible to create reload thread, rules will not be reloaded\n");
+		fw_watch_run = false;
+	}
+	return 0;
+}
+
+void fw_stop(void) {
+	int i;
+
+	if (fw_watch_run) {
+		fw_watch_run = false;
+		pthread_join(thrid_fw, NULL);
+	}
+	fw_publish(NULL);
+	for (i = 0; i < 3; ++i) {
+		fw_limiter_free(fw_down[i]);
+		fw_down[i] = NULL;
+	}
+}
+
+void fw_reload_request(void) {
+	fw_reload_pending = 1;
+}
+
+int fw_reader_register(void) {
+	unsigned r;
+
+	r = __atomic_fetch_add(&fw_nb_readers, 1, __ATOMIC_ACQ_REL);
+	if (r >= FW_MAX_READERS) {
+		MSG("ERROR: [fw] too many readers of the rule table\n");
+		return -1;
+	}
+	fw_self = (int)r;
+	return (int)r;
+}
+
+const struct fw_table * fw_acquire(int reader) {
+	struct fw_reader * r = &fw_readers[reader];
+
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED); /* odd: in use */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); /* pairs with fw_synchronize */
+	return __atomic_load_n(&fw_active, __ATOMIC_ACQUIRE);
+}
+
+void fw_release(int reader) {
+	struct fw_reader * r = &fw_readers[reader];
+
+	__atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE); /* even: quiescent */
+}
+
+int fw_lookup(const struct fw_table * t, uint32_t devaddr) {
+	const struct fw_rule * r;
+
+	r = fw_find(t, devaddr);
+	return (r != NULL) ? r->type : FW_RULE_NONE;
+}
+
+struct fw_limiter * fw_limiter_new(uint32_t nb_devices) {
+	struct fw_limiter * l;
+	size_t size;
+
+	l = calloc(1, sizeof *l);
+	if (l == NULL) return NULL;
+	for (l->bits = 0; ((uint32_t)FW_LIMIT_WAYS << l->bits) < nb_devices; ++l->bits);
+	size = ((size_t)FW_LIMIT_WAYS << l->bits) * sizeof *l->sets;
+	if (posix_memalign((void **)&l->sets, 64, size) != 0) {
+		free(l);
+		return NULL;
+	}
+	memset(l->sets, 0, size);
+	return l;
+}
+
+void fw_limiter_free(struct fw_limiter * l) {
+	if (l == NULL) return;
+	free(l->sets);
+	free(l);
+}
+
+int fw_limit(struct fw_limiter * l, uint32_t key, uint32_t now_ms, uint32_t rate, uint32_t burst) {
+	struct fw_bucket * set;
+	struct fw_bucket * b;
+	struct fw_bucket * victim;
+	uint64_t tokens;
+	int32_t elapsed;
+	int w;
+
+	set = &l->sets[(l->bits == 0) ? 0 : (((key * FW_HASH_MUL) >> (32 - l->bits)) * FW_LIMIT_WAYS)];
+	victim = &set[0];
+	for (w = 0; w < FW_LIMIT_WAYS; ++w) {
+		b = &set[w];
+		if (b->valid == 0) {
+			if (victim->valid != 0) victim = b;
+			continue;
+		}
+		if (b->key == key) {
+			/* refill the bucket for the time elapsed since the previous frame */
+			elapsed = (int32_t)(now_ms - b->stamp);
+			tokens = b->tokens;
+			if (elapsed > 0) {
+				tokens += (uint64_t)elapsed * rate;
+			}
+			if (tokens > burst) tokens = burst;
+			b->stamp = now_ms;
+			if (tokens < FW_TOKEN) {
+				b->tokens = (uint32_t)tokens;
+				return FW_LIMITED;
+			}
+			b->tokens = (uint32_t)(tokens - FW_TOKEN);
+			return FW_PASS;
+		}
+		if ((victim->valid != 0) && ((int32_t)(victim->stamp - b->stamp) > 0)) {
+			victim = b; /* least recently seen device of the set */
+		}
+	}
+
+	/* unknown device, evict the LRU bucket and start with a full one */
+	victim->key = key;
+	victim->valid = 1;
+	victim->stamp = now_ms;
+	victim->tokens = burst - FW_TOKEN;
+	return FW_PASS;
+}
+
+struct fw_replay * fw_replay_new(uint32_t nb_devices) {
+	struct fw_replay * r;
+
+	r = calloc(1, sizeof *r);
+	if (r == NULL) return NULL;
+	for (r->bits = 1; (1UL << r->bits) < nb_devices; ++r->bits);
+	r->devices = calloc((size_t)1 << r->bits, sizeof *r->devices);
+	if (r->devices == NULL) {
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void fw_replay_free(struct fw_replay * r) {
+	if (r == NULL) return;
+	free(r->devices);
+	free(r);
+}
+
+/* count the increasing low FCnt of a device, true once there are enough to believe it restarted */
+static bool fw_restart_seen(struct fw_replay * r, uint32_t devaddr, uint16_t fcnt) {
+	struct fw_restart * s;
+
+	s = &r->restarts[(devaddr * FW_HASH_MUL) >> (32 - FW_RESTART_BITS)];
+	if ((s->count > 0) && (s->devaddr == devaddr) && (fcnt > s->fcnt)) {
+		if (++s->count >= FW_REPLAY_RESYNC) {
+			s->count = 0;
+			return true;
+		}
+	} else {
+		s->devaddr = devaddr; /* new sequence, possibly evicting another device */
+		s->count = 1;
+	}
+	s->fcnt = fcnt;
+	return false;
+}
+
+int fw_check_replay(struct fw_replay * r, const struct lgw_pkt_rx_s * p, uint32_t now_ms, bool verified) {
+	struct fw_dup * d;
+	uint32_t * slot;
+	uint32_t devaddr, h, tag, retrans, window, last;
+	uint16_t fcnt, delta;
+
+	/* only data uplinks carry a frame counter */
+	if (((p->payload[0] >> 5) != MTYPE_UNCONF_DATA_UP) && ((p->payload[0] >> 5) != MTYPE_CONF_DATA_UP)) return FW_PASS;
+	if (p->size < 12) return FW_PASS;
+	devaddr  = (uint32_t)p->payload[1];
+	devaddr |= (uint32_t)p->payload[2] << 8;
+	devaddr |= (uint32_t)p->payload[3] << 16;
+	devaddr |= (uint32_t)p->payload[4] << 24;
+	fcnt = (uint16_t)(p->payload[6] | (p->payload[7] << 8));
+
+	/* same frame heard on another channel or SF, or by another antenna */
+	h = (uint32_t)fw_mix64(((uint64_t)devaddr << 32) | ((uint64_t)fcnt << 16) | p->crc) | 1;
+	d = &r->dups[h >> (32 - FW_DUP_BITS)];
+	if ((d->hash == h) && ((uint32_t)(now_ms - d->stamp) < FW_DUP_TTL_MS)) {
+		return FW_REPLAY;
+	}
+	d->hash = h;
+	d->stamp = now_ms;
+
+	/* sliding window on the 16 LSB of FCnt, the tag tells devices sharing a slot apart */
+	slot = &r->devices[(devaddr * FW_HASH_MUL) >> (32 - r->bits)];
+	tag = 1 + ((devaddr * 0x85EBCA6B) >> 26) % 63;
+	if ((*slot >> 26) != tag) {
+		*slot = (tag << 26) | fcnt; /* first frame of that device */
+		return FW_PASS;
+	}
+	retrans = (*slot >> 24) & 0x3; /* copies of the last frame accepted after the first one */
+	window = (*slot >> 16) & 0xFF; /* bit n set if FCnt last-1-n was received */
+	last = *slot & 0xFFFF;
+	delta = (uint16_t)(fcnt - last);
+	if (delta == 0) {
+		/* retransmission of the last frame, NbTrans copies at most */
+		if (retrans >= FW_REPLAY_NBTRANS - 1) return FW_REPLAY;
+		++retrans;
+	} else if (delta < 0x8000) {
+		window = (delta > FW_REPLAY_WINDOW) ? 0 : (((window << delta) | (1U << (delta - 1))) & 0xFF);
+		last = fcnt;
+		retrans = 0;
+	} else {
+		delta = (uint16_t)(last - fcnt);
+		if (delta <= FW_REPLAY_WINDOW) {
+			if (window & (1U << (delta - 1))) return FW_REPLAY;
+			window |= 1U << (delta - 1); /* late frame, accepted once */
+		} else if ((fcnt < FW_REPLAY_RESET) && (verified || fw_restart_seen(r, devaddr, fcnt))) {
+			window = 0; /* device restarted its counters */
+			last = fcnt;
+			retrans = 0;
+		} else {
+			return FW_REPLAY;
+		}
+	}
+	*slot = (tag << 26) | (retrans << 24) | (window << 16) | last;
+	return FW_PASS;
+}
+
+int fw_check_mic(const struct fw_table * t, const struct lgw_pkt_rx_s * p) {
+	const struct fw_mic * m;
+	uint8_t buf[FW_MIC_MAX_MSG];
+	uint8_t mac[16];
+	uint32_t devaddr, idx, fcnt;
+	uint16_t hi, msb;
+	unsigned len;
+	int i, n;
+
+	if (((p->payload[0] >> 5) != MTYPE_UNCONF_DATA_UP) && ((p->payload[0] >> 5) != MTYPE_CONF_DATA_UP)) return FW_PASS;
+	if ((p->size < 12) || (t->nb_keys == 0)) return FW_PASS;
+	devaddr  = (uint32_t)p->payload[1];
+	devaddr |= (uint32_t)p->payload[2] << 8;
+	devaddr |= (uint32_t)p->payload[3] << 16;
+	devaddr |= (uint32_t)p->payload[4] << 24;
+	m = fw_key_find(t, devaddr, &idx);
+	if (m == NULL) return FW_PASS; /* key not provisioned, nothing to verify */
+
+	/* B0 | MHDR | FHDR | FPort | FRMPayload, LoRaWAN 1.0 uplink */
+	len = p->size - 4;
+	memset(buf, 0, 16);
+	buf[0] = 0x49;
+	buf[5] = 0; /* uplink */
+	memcpy(&buf[6], &p->payload[1], 4);
+	buf[15] = (uint8_t)len;
+	memcpy(&buf[16], p->payload, len);
+
+	/* only the 16 LSB of FCnt are transmitted, try the current MSB then the next one */
+	/* and, for a low FCnt, MSB 0 in case the device restarted its counters (see fw_check_replay) */
+	hi = __atomic_load_n(&t->fcnt_hi[idx], __ATOMIC_RELAXED);
+	fcnt = p->payload[6] | ((uint32_t)p->payload[7] << 8);
+	n = ((hi != 0) && (fcnt < FW_REPLAY_RESET)) ? 3 : 2;
+	for (i = 0; i < n; ++i) {
+		msb = (i < 2) ? (uint16_t)(hi + i) : 0;
+		fcnt = ((uint32_t)msb << 16) | p->payload[6] | ((uint32_t)p->payload[7] << 8);
+		buf[10] = (uint8_t)fcnt;
+		buf[11] = (uint8_t)(fcnt >> 8);
+		buf[12] = (uint8_t)(fcnt >> 16);
+		buf[13] = (uint8_t)(fcnt >> 24);
+		cmac_compute(&m->key, buf, 16 + len, mac);
+		if (memcmp(mac, &p->payload[len], 4) == 0) {
+			if (msb != hi) __atomic_store_n(&t->fcnt_hi[idx], msb, __ATOMIC_RELAXED);
+			return FW_VERIFIED;
+		}
+	}
+	return FW_FORGED;
+}
+
+int fw_check_rxpkt(const struct fw_table * t, struct fw_limiter * l, const struct lgw_pkt_rx_s * p, uint32_t now_ms) {
+	const struct fw_rule * r = NULL;
+	struct fw_hits * h;
+	int verdict;
+
+	verdict = fw_verdict(t, l, p, now_ms, &r);
+	if (fw_self >= 0) {
+		/* counters of this thread, no other writer */
+		h = &t->hits[(uint32_t)fw_self * t->hits_stride + ((r != NULL) ? (uint32_t)(r - t->rules) : t->nb_entries)];
+		if (verdict == FW_PASS) {
+			__atomic_store_n(&h->pass, h->pass + 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_store_n(&h->drop, h->drop + 1, __ATOMIC_RELAXED);
+		}
+	}
+	return verdict;
+}
+
+int fw_stats(int reader, struct fw_rule_stat * top, int max, uint32_t * dead) {
+	const struct fw_table * t;
+	struct fw_state * s;
+	const struct fw_filter * filters;
+	struct fw_hits sum, delta;
+	uint32_t i, c;
+	int n = 0;
+	int j;
+
+	*dead = 0;
+	t = fw_acquire(reader);
+	if (t == NULL) {
+		fw_release(reader);
+		return 0;
+	}
+	s = t->state;
+	filters = __atomic_load_n(&s->filters, __ATOMIC_ACQUIRE);
+	for (i = 0; i <= t->nb_entries + t->nb_filters; ++i) {
+		if ((i < t->nb_entries) && (t->rules[i].type == FW_RULE_NONE)) continue; /* invalid node */
+		c = (i <= t->nb_entries) ? i : t->nb_entries + 1 + filters[i - t->nb_entries - 1].id;
+		sum = fw_hits_sum(t, c);
+		delta.pass = sum.pass - s->reported[c].pass;
+		delta.drop = sum.drop - s->reported[c].drop;
+		s->reported[c] = sum;
+		if ((sum.pass == 0) && (sum.drop == 0)) {
+			if (i != t->nb_entries) *dead += 1;
+			continue;
+		}
+		if ((delta.pass == 0) && (delta.drop == 0)) continue;
+
+		/* insertion in the top list, sorted by decreasing number of hits */
+		for (j = n; (j > 0) && ((uint64_t)top[j - 1].pass + top[j - 1].drop < (uint64_t)delta.pass + delta.drop); --j) {
+			if (j < max) top[j] = top[j - 1];
+		}
+		if (j < max) {
+			fw_rule_name(t, c, top[j].name, sizeof top[j].name);
+			if (i < t->nb_entries) {
+				top[j].type = t->rules[i].type;
+			} else if (i > t->nb_entries) {
+				top[j].type = filters[i - t->nb_entries - 1].type;
+			} else {
+				top[j].type = FW_RULE_NONE;
+			}
+			top[j].pass = delta.pass;
+			top[j].drop = delta.drop;
+			if (n < max) ++n;
+		}
+	}
+	fw_release(reader);
+	return n;
+}
+
+void fw_reorder(int reader) {
+	const struct fw_table * t;
+	struct fw_state * s;
+	struct fw_filter * cur;
+	struct fw_filter * next;
+	struct fw_filter f;
+	struct fw_hits sum;
+	uint32_t i, j, start, id;
+	bool changed = false;
+
+	t = fw_acquire(reader);
+	if ((t == NULL) || (t->nb_filters < 2)) {
+		fw_release(reader);
+		return;
+	}
+	s = t->state;
+	cur = s->filters;
+
+	/* hit rate with a half-life of about 2 reports */
+	for (i = 0; i < t->nb_filters; ++i) {
+		id = cur[i].id;
+		sum = fw_hits_sum(t, t->nb_entries + 1 + id);
+		s->score[id] -= s->score[id] >> 2;
+		s->score[id] += (sum.pass - s->filter_reported[id].pass) + (sum.drop - s->filter_reported[id].drop);
+		s->filter_reported[id] = sum;
+	}
+
+	/* sort each run of filters with the same action, first match gives the same verdict in any order */
+	next = malloc(t->nb_filters * sizeof *next);
+	if (next == NULL) {
+		fw_release(reader);
+		return;
+	}
+	memcpy(next, cur, t->nb_filters * sizeof *next);
+	for (start = 0; start < t->nb_filters; start = i) {
+		for (i = start + 1; (i < t->nb_filters) && (next[i].type == next[start].type); ++i) {
+			f = next[i];
+			for (j = i; (j > start) && (s->score[next[j - 1].id] < s->score[f.id]); --j) {
+				next[j] = next[j - 1];
+				changed = true;
+			}
+			next[j] = f;
+		}
+	}
+	if (!changed) {
+		free(next);
+		fw_release(reader);
+		return;
+	}
+	cur = __atomic_exchange_n(&s->filters, next, __ATOMIC_ACQ_REL);
+	fw_release(reader);
+
+	/* readers may still walk the previous order */
+	fw_synchronize();
+	free(cur);
+}
+
+struct fw_table * fw_load(const char * conf_file) {
+	char magic[4] = {0};
+	FILE * f;
+
+	/* a compiled image is recognized by its magic, anything else is parsed as JSON */
+	f = fopen(conf_file, "rb");
+	if (f == NULL) {
+		MSG("ERROR: [fw] failed to open %s: %s\n", conf_file, strerror(errno));
+		return NULL;
+	}
+	if (fread(magic, 1, sizeof magic, f) != sizeof magic) {
+		memset(magic, 0, sizeof magic);
+	}
+	fclose(f);
+	if (memcmp(magic, FW_IMAGE_MAGIC, sizeof magic) == 0) {
+		return fw_load_image(conf_file);
+	}
+	return fw_load_json(conf_file);
+}
+
+int fw_save(const struct fw_table * t, const char * image_file) {
+	struct fw_image_hdr hdr;
+	const void * data[FW_SEC_COUNT];
+	uint8_t * img;
+	uint32_t offset;
+	char tmp[280];
+	FILE * f;
+	int i;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, FW_IMAGE_MAGIC, sizeof hdr.magic);
+	hdr.version = FW_IMAGE_VERSION;
+	hdr.endian = 0x0102;
+	hdr.layout = fw_image_layout();
+	hdr.policy = t->policy;
+	hdr.rate = t->rate;
+	hdr.burst = t->burst;
+	memcpy(hdr.down_rate, t->down_rate, sizeof hdr.down_rate);
+	memcpy(hdr.down_burst, t->down_burst, sizeof hdr.down_burst);
+	hdr.bits = t->bits;
+	hdr.nb_rules = t->nb_rules;
+	hdr.nb_entries = t->nb_entries;
+	hdr.nb_prefixes = t->nb_prefixes;
+	hdr.nb_nodes = t->nb_nodes;
+	hdr.nb_leaves = t->nb_leaves;
+	hdr.nb_euis = t->nb_euis;
+	hdr.eui_mask = t->eui_mask;
+	hdr.bloom_mask = t->bloom_mask;
+	hdr.nb_filters = t->nb_filters;
+	hdr.nb_filter_ids = t->nb_filter_ids;
+
+	/* the filters are saved in their current order */
+	data[FW_SEC_RULES] = t->rules;
+	hdr.sec[FW_SEC_RULES].length = (t->nb_entries + 1) * sizeof *t->rules;
+	data[FW_SEC_SLOTS] = t->slots;
+	hdr.sec[FW_SEC_SLOTS].length = (t->mask + 1) * sizeof *t->slots;
+	data[FW_SEC_NODES] = t->nodes;
+	hdr.sec[FW_SEC_NODES].length = (t->nodes != NULL) ? t->nb_nodes * sizeof *t->nodes : 0;
+	data[FW_SEC_LEAVES] = t->leaves;
+	hdr.sec[FW_SEC_LEAVES].length = (t->nodes != NULL) ? t->nb_leaves * sizeof *t->leaves : 0;
+	data[FW_SEC_EUI_SLOTS] = t->eui_slots;
+	hdr.sec[FW_SEC_EUI_SLOTS].length = (t->eui_slots != NULL) ? (t->eui_mask + 1) * sizeof *t->eui_slots : 0;
+	data[FW_SEC_BLOOM] = t->bloom;
+	hdr.sec[FW_SEC_BLOOM].length = (t->bloom != NULL) ? (t->bloom_mask + 1) / 8 : 0;
+	data[FW_SEC_FILTERS] = t->state->filters;
+	hdr.sec[FW_SEC_FILTERS].length = t->nb_filters * sizeof *t->state->filters;
+	data[FW_SEC_KEY_PATH] = t->key_path;
+	hdr.sec[FW_SEC_KEY_PATH].length = (t->key_path != NULL) ? strlen(t->key_path) + 1 : 0;
+	if (t->nodes == NULL) {
+		hdr.nb_nodes = 0;
+		hdr.nb_leaves = 0;
+	}
+
+	/* lay the sections out and build the image in memory */
+	offset = sizeof hdr;
+	for (i = 0; i < FW_SEC_COUNT; ++i) {
+		offset = (offset + FW_IMAGE_ALIGN - 1) & ~(uint32_t)(FW_IMAGE_ALIGN - 1);
+		hdr.sec[i].offset = offset;
+		offset += hdr.sec[i].length;
+	}
+	hdr.size = offset;
+	img = calloc(1, hdr.size);
+	if (img == NULL) return -1;
+	for (i = 0; i < FW_SEC_COUNT; ++i) {
+		if (hdr.sec[i].length > 0) memcpy(img + hdr.sec[i].offset, data[i], hdr.sec[i].length);
+	}
+	hdr.crc = fw_crc32(img + sizeof hdr, hdr.size - sizeof hdr);
+	memcpy(img, &hdr, sizeof hdr);
+
+	/* write aside and rename, forwarders keep their mapping of the previous image */
+	snprintf(tmp, sizeof tmp, "%s.tmp", image_file);
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		MSG("ERROR: [fw] failed to create %s: %s\n", tmp, strerror(errno));
+		free(img);
+		return -1;
+	}
+	i = (fwrite(img, 1, hdr.size, f) == hdr.size) ? 0 : -1;
+	free(img);
+	if ((fclose(f) != 0) || (i != 0)) {
+		MSG("ERROR: [fw] failed to write %s\n", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, image_file) != 0) {
+		MSG("ERROR: [fw] failed to rename %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	MSG("INFO: [fw] %u rules saved to %s (%u bytes)\n", t->nb_rules, image_file, hdr.size);
+	return 0;
+}
+
+int fw_check_txpkt(const struct fw_table * t, int server, const struct lgw_pkt_tx_s * p, uint32_t now_ms) {
+	const struct fw_rule * r = NULL;
+	uint32_t devaddr = 0;
+	bool limit_device = false;
+	int verdict = FW_PASS;
+
+	/* data downlinks carry the DevAddr in clear, join-accepts are encrypted */
+	if (((p->payload[0] >> 5) == MTYPE_UNCONF_DATA_DOWN) || ((p->payload[0] >> 5) == MTYPE_CONF_DATA_DOWN)) {
+		if (p->size < 12) return FW_DROP; /* not a valid LoRaWAN frame */
+		devaddr  = (uint32_t)p->payload[1];
+		devaddr |= (uint32_t)p->payload[2] << 8;
+		devaddr |= (uint32_t)p->payload[3] << 16;
+		devaddr |= (uint32_t)p->payload[4] << 24;
+		r = fw_find(t, devaddr);
+		switch ((r != NULL) ? r->type : FW_RULE_NONE) {
+			case FW_RULE_BLACK:
+			case FW_RULE_DENY:
+				return FW_DROP;
+			case FW_RULE_WHITE:
+				break; /* trusted, only the shared limits apply */
+			case FW_RULE_ALLOW:
+				limit_device = true;
+				break;
+			default:
+				if (t->policy == FW_DROP) return FW_DROP;
+				limit_device = true;
+		}
+	}
+
+	/* a frame is sent only if every applicable bucket has a token */
+	pthread_mutex_lock(&mx_fw_down);
+	if (limit_device && (t->down_rate[0] > 0)) {
+		verdict = fw_limit(fw_down[0], devaddr, now_ms, t->down_rate[0], t->down_burst[0]);
+	}
+	if ((verdict == FW_PASS) && (t->down_rate[1] > 0)) {
+		verdict = fw_limit(fw_down[1], (uint32_t)server, now_ms, t->down_rate[1], t->down_burst[1]);
+	}
+	if ((verdict == FW_PASS) && (t->down_rate[2] > 0)) {
+		verdict = fw_limit(fw_down[2], p->freq_hz, now_ms, t->down_rate[2], t->down_burst[2]);
+	}
+	pthread_mutex_unlock(&mx_fw_down);
+	return verdict;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
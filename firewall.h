@@ -0,0 +1,265 @@
+/*
+Description:
+	Firewall rule engine for the LoRaWAN packet forwarder.
+	Compiles the firewall_conf.nodes array into a lookup table keyed on DevAddr,
+	"addr" is either a device ("26031C2C") or a block of devices ("26031C00/24").
+	Join-requests are filtered on "deveui" or "joineui" instead.
+	The active table is replaced without locks when the rules file changes.
+	Per-device token buckets limit the rate of accepted frames.
+	Replayed and duplicated uplinks are detected from their frame counter.
+	The MIC of devices listed in the "mic_keys" file is verified, that file
+	holds {"keys": [{"addr": "26031C2C", "nwkskey": "<32 hex digits>"}]}.
+	Each rule counts the frames it passed and dropped, see fw_stats.
+	firewall-compile turns the JSON file into an image mapped read-only.
+	Downlinks are checked against the DevAddr rules and the "downlink" rate
+	limits per device, server and frequency before being sent.
+	"filters" lists conditions on "size", "fport" and "rssi" that cannot be
+	hashed, they are matched in priority order and reordered by fw_reorder.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _FIREWALL_H
+#define _FIREWALL_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+/* rule types, in decreasing order of precedence when an address is listed twice */
+#define FW_RULE_NONE	0	/* no rule matches, the default policy applies */
+#define FW_RULE_BLACK	1	/* packets are always dropped */
+#define FW_RULE_WHITE	2	/* packets are always forwarded */
+#define FW_RULE_DENY	3	/* packets are dropped (hosts.deny) */
+#define FW_RULE_ALLOW	4	/* packets are forwarded (hosts.allow) */
+
+/* verdicts */
+#define FW_PASS			0
+#define FW_DROP			1
+#define FW_LIMITED		2	/* dropped, device is over its rate limit */
+#define FW_REPLAY		3	/* dropped, frame counter already seen */
+#define FW_FORGED		4	/* dropped, MIC does not match the device key */
+#define FW_VERIFIED		5	/* forwarded, MIC verified with the device key */
+
+#define FW_MAX_READERS	8	/* max number of threads reading the active table */
+#define FW_LIMIT_DEVICES	65536	/* devices tracked by a rate limiter, 1 MB of state */
+#define FW_REPLAY_DEVICES	524288	/* devices tracked by the replay filter, 2 MB of state */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct fw_table; /* compiled rule set, opaque */
+struct fw_limiter; /* token bucket state, owned by a single thread */
+struct fw_replay; /* frame counter state, owned by a single thread */
+
+struct fw_rule_stat {
+	char name[24];		/* "26031C2C", "26031C00/24", DevEUI/JoinEUI, "filterN" or "default" */
+	int type;			/* FW_RULE_xxx, FW_RULE_NONE for the default policy */
+	uint32_t pass;		/* frames forwarded since the previous call */
+	uint32_t drop;		/* frames dropped since the previous call */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Parse a firewall configuration file and compile its rules
+@param conf_file path of the JSON file containing the firewall_conf object, or of an image written by fw_save
+@return pointer to the compiled rule set, NULL if the file is invalid
+*/
+struct fw_table * fw_load(const char * conf_file);
+
+/**
+@brief Save a rule set as a flat image that fw_load maps instead of parsing
+@param t pointer to the rule set, typ. just returned by fw_load
+@param image_file path of the image, replaced atomically
+@return 0 if the image was written, -1 otherwise
+
+The image holds the compiled hash tables, trie, Bloom filter and filters,
+with a version, a structure layout fingerprint and a CRC-32. Device keys
+are not copied, the image only refers to the key file.
+*/
+int fw_save(const struct fw_table * t, const char * image_file);
+
+/**
+@brief Release a rule set returned by fw_load
+@param t pointer to the rule set, may be NULL
+*/
+void fw_free(struct fw_table * t);
+
+/**
+@brief Load the rules and start watching the file for changes
+@param conf_file path of the JSON file containing the firewall_conf object, or of a rule image
+@return 0 if the initial rule set is active, -1 if it could not be loaded
+
+The file is reloaded on SIGHUP (see fw_reload_request) and, on Linux, as soon
+as it is rewritten. A new table is compiled in the background and published
+with an atomic pointer swap, the previous one is freed after a grace period.
+*/
+int fw_start(const char * conf_file);
+
+/**
+@brief Stop the reload thread and release the active rule set
+*/
+void fw_stop(void);
+
+/**
+@brief Ask the reload thread to reload the rules file, async-signal-safe
+*/
+void fw_reload_request(void);
+
+/**
+@brief Register the calling thread as a reader of the active table
+@return reader identifier to pass to fw_acquire and fw_release, -1 if too many readers
+*/
+int fw_reader_register(void);
+
+/**
+@brief Enter a read-side critical section and get the active table, lock-free
+@param reader identifier returned by fw_reader_register
+@return pointer to the active rule set, NULL if no rules are loaded
+
+The table stays valid until fw_release is called by the same reader.
+*/
+const struct fw_table * fw_acquire(int reader);
+
+/**
+@brief Leave a read-side critical section, the table must no longer be used
+@param reader identifier returned by fw_reader_register
+*/
+void fw_release(int reader);
+
+/**
+@brief Find the rule attached to a DevAddr, bounded cost and without allocation
+@param t pointer to the rule set
+@param devaddr 32-bit device address, host order
+@return rule type (FW_RULE_xxx) of the longest matching prefix, FW_RULE_NONE if the address is not listed
+*/
+int fw_lookup(const struct fw_table * t, uint32_t devaddr);
+
+/**
+@brief Allocate a token bucket table
+@param nb_devices number of devices tracked before the least recently seen are evicted
+@return pointer to the limiter, NULL if allocation failed
+*/
+struct fw_limiter * fw_limiter_new(uint32_t nb_devices);
+
+/**
+@brief Release a token bucket table
+@param l pointer to the limiter, may be NULL
+*/
+void fw_limiter_free(struct fw_limiter * l);
+
+/**
+@brief Take one token from the bucket of a device
+@param l pointer to the limiter
+@param key device identifier (typ. DevAddr)
+@param now_ms monotonic time in ms
+@param rate refill rate in micro-frames per ms
+@param burst bucket depth in micro-frames
+@return FW_PASS if a token was available, FW_LIMITED otherwise
+*/
+int fw_limit(struct fw_limiter * l, uint32_t key, uint32_t now_ms, uint32_t rate, uint32_t burst);
+
+/**
+@brief Decide if a received packet must be forwarded
+@param t pointer to the rule set
+@param l pointer to the rate limiter of the calling thread, NULL to skip rate limiting
+@param p pointer to the received packet
+@param now_ms monotonic time in ms, used to refill the token buckets
+@return FW_PASS, FW_DROP or FW_LIMITED
+
+The verdict is counted against the matching rule if the calling thread is a
+registered reader.
+*/
+int fw_check_rxpkt(const struct fw_table * t, struct fw_limiter * l, const struct lgw_pkt_rx_s * p, uint32_t now_ms);
+
+/**
+@brief Decide if a downlink requested by a server may be sent
+@param t pointer to the rule set
+@param server index of the server that requested the downlink
+@param p pointer to the packet about to be sent
+@param now_ms monotonic time in ms, used to refill the token buckets
+@return FW_PASS, FW_DROP or FW_LIMITED
+
+Thread-safe, the token buckets are shared by all the callers. A token is
+taken from a bucket only if the previous ones had one.
+*/
+int fw_check_txpkt(const struct fw_table * t, int server, const struct lgw_pkt_tx_s * p, uint32_t now_ms);
+
+/**
+@brief Sum the rule counters of all readers and get the most hit rules
+@param reader identifier returned by fw_reader_register, only one thread may call this function
+@param top array receiving the rules hit since the previous call, most hit first
+@param max size of the top array
+@param dead set to the number of rules never hit since the rules were loaded
+@return number of entries written to top
+
+Counters restart from zero when the rules are reloaded.
+*/
+int fw_stats(int reader, struct fw_rule_stat * top, int max, uint32_t * dead);
+
+/**
+@brief Move the most hit filters first, without changing any verdict
+@param reader identifier returned by fw_reader_register, same thread as fw_stats
+
+Only filters with the same action are swapped, filters are never moved
+across one with the other action, so first-match semantics and priorities
+are preserved. The new order is published atomically, the call blocks
+until no reader uses the previous one.
+*/
+void fw_reorder(int reader);
+
+/**
+@brief Verify the MIC of a data uplink if the key of the device is known
+@param t pointer to the rule set
+@param p pointer to the received packet, with a valid CRC
+@return FW_VERIFIED if the MIC is valid, FW_PASS if the device has no key, FW_FORGED otherwise
+
+The 16 MSB of FCnt are tracked per device. A low FCnt (< 16) is also tried
+with MSB 0, so a device that restarted its counters after a rollover is
+still verified, as fw_check_replay expects.
+*/
+int fw_check_mic(const struct fw_table * t, const struct lgw_pkt_rx_s * p);
+
+/**
+@brief Allocate a replay filter
+@param nb_devices number of device slots, rounded up to a power of 2
+@return pointer to the replay filter, NULL if allocation failed
+*/
+struct fw_replay * fw_replay_new(uint32_t nb_devices);
+
+/**
+@brief Release a replay filter
+@param r pointer to the replay filter, may be NULL
+*/
+void fw_replay_free(struct fw_replay * r);
+
+/**
+@brief Detect a replayed or duplicated data uplink
+@param r pointer to the replay filter of the calling thread
+@param p pointer to the received packet, with a valid CRC
+@param now_ms monotonic time in ms
+@param verified true if the MIC of the frame was verified with the device key
+@return FW_PASS, or FW_REPLAY if the frame was already received
+
+A frame is a duplicate if the same DevAddr, FCnt and CRC were seen less than
+half a second ago. Otherwise a FCnt equal to the last one is a retransmission
+and passes up to NbTrans (3) copies in all, an older FCnt passes once if it is
+within the last 8 frames. A low FCnt (< 16) older than that means the device
+restarted its counters: it is accepted at once if the MIC was verified, else
+only the third increasing low FCnt in a row is, the previous ones are dropped.
+*/
+int fw_check_replay(struct fw_replay * r, const struct lgw_pkt_rx_s * p, uint32_t now_ms, bool verified);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,70 @@
+/*
+Description:
+	firewall-compile: compile firewall_conf.json into a flat rule image.
+	The forwarder maps the image read-only instead of parsing the JSON file,
+	set "firewall_path" to the image in gateway_conf to use it. Run the tool
+	on the gateway itself, images are tied to the structure layout of the
+	host that wrote them and are rejected elsewhere.
+
+	Usage: firewall-compile [firewall_conf.json] [firewall_conf.img]
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdio.h>		/* printf */
+#include <stdlib.h>		/* EXIT_* */
+#include <string.h>		/* strcmp */
+
+#include "firewall.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static void usage(void) {
+	MSG("Usage: firewall-compile [firewall_conf.json] [firewall_conf.img]\n");
+	MSG("Compile the firewall rules into an image the packet forwarder maps at startup\n");
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	const char * conf_file = "firewall_conf.json";
+	const char * image_file = "firewall_conf.img";
+	struct fw_table * t;
+
+	if ((argc > 1) && ((strcmp(argv[1], "-h") == 0) || (strcmp(argv[1], "--help") == 0))) {
+		usage();
+		return EXIT_SUCCESS;
+	}
+	if (argc > 3) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if (argc > 1) conf_file = argv[1];
+	if (argc > 2) image_file = argv[2];
+
+	t = fw_load(conf_file);
+	if (t == NULL) {
+		MSG("ERROR: failed to compile %s\n", conf_file);
+		return EXIT_FAILURE;
+	}
+	if (fw_save(t, image_file) != 0) {
+		fw_free(t);
+		return EXIT_FAILURE;
+	}
+	fw_free(t);
+	return EXIT_SUCCESS;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,95 @@
+/*
+Description:
+	Log-linear latency histogram, values in microseconds.
+	Values below 32 have a bucket each. Above, a value with its highest bit
+	at position b is shifted right by b - 4 so that its 5 leading bits, 16
+	to 31, select one of 16 buckets of that power of 2: the bucket index is
+	computed with a count-leading-zeros and a shift, no search, no division.
+	Counters are incremented with relaxed atomic adds and moved out with
+	atomic exchanges, writers never wait.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <string.h>		/* memset */
+
+#include "histogram.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_HALF		(HIST_SUB / 2)
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static inline int hist_index(uint32_t v) {
+	int shift;
+
+	if (v < HIST_SUB) return (int)v;
+	shift = 31 - __builtin_clz(v) - HIST_SUB_BITS + 1;
+	return shift * HIST_HALF + (int)(v >> shift);
+}
+
+/* highest value falling in a bucket */
+static uint32_t hist_value(int idx) {
+	int shift;
+
+	if (idx < HIST_SUB) return (uint32_t)idx;
+	shift = idx / HIST_HALF - 1;
+	return ((uint32_t)(idx - shift * HIST_HALF) << shift) + ((1u << shift) - 1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+void hist_record(struct histogram * h, uint32_t us) {
+	uint32_t max;
+
+	__atomic_fetch_add(&h->count[hist_index(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while ((us > max) && !__atomic_compare_exchange_n(&h->max, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void hist_collect(struct histogram * h, struct histogram * snap) {
+	int i;
+
+	memset(snap, 0, sizeof *snap);
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		if (__atomic_load_n(&h->count[i], __ATOMIC_RELAXED) != 0) {
+			snap->count[i] = __atomic_exchange_n(&h->count[i], 0, __ATOMIC_RELAXED);
+			snap->total += snap->count[i];
+		}
+	}
+	/* total is recomputed from the buckets, the counter only tells if there is anything */
+	__atomic_store_n(&h->total, 0, __ATOMIC_RELAXED);
+	snap->max = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+uint32_t hist_percentile(const struct histogram * h, double pct) {
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (h->total == 0) return 0;
+	rank = (uint64_t)((pct / 100.0) * h->total + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > h->total) rank = h->total;
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->count[i];
+		if (seen >= rank) {
+			/* never report more than the largest value actually seen */
+			return (hist_value(i) < h->max) ? hist_value(i) : h->max;
+		}
+	}
+	return h->max;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,65 @@
+/*
+Description:
+	Log-linear latency histogram, values in microseconds.
+	Each power of 2 is split in 16 buckets, so a recorded value is known
+	within 6%, whatever its magnitude, with a fixed 1.8 kB of counters.
+	Any thread may record, the statistics thread periodically moves the
+	counts out with hist_collect and reads percentiles from the copy.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define HIST_SUB_BITS	5	/* 2^5 linear buckets below 32 us, then 16 per power of 2 */
+#define HIST_BUCKETS	((32 - HIST_SUB_BITS) * (1 << (HIST_SUB_BITS - 1)) + (1 << HIST_SUB_BITS))
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct histogram {
+	uint32_t count[HIST_BUCKETS];
+	uint32_t total;		/* number of recorded values */
+	uint32_t max;		/* largest recorded value */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Record a value, thread-safe and lock-free
+@param h pointer to the histogram
+@param us value in microseconds
+*/
+void hist_record(struct histogram * h, uint32_t us);
+
+/**
+@brief Move all the counts of a histogram to another one
+@param h pointer to the histogram being recorded, reset by the call
+@param snap pointer to the histogram receiving the counts, overwritten
+
+Values recorded during the call end up either in snap or in h, never lost.
+*/
+void hist_collect(struct histogram * h, struct histogram * snap);
+
+/**
+@brief Get a percentile from a histogram that is not being recorded
+@param h pointer to the histogram, typ. filled by hist_collect
+@param pct percentile, from 0.0 to 100.0
+@return highest value of the bucket holding the percentile, 0 if the histogram is empty
+*/
+uint32_t hist_percentile(const struct histogram * h, double pct);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
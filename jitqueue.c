@@ -0,0 +1,107 @@
+/*
+Description:
+	Just-in-time queue of downlinks waiting for their slot.
+	Frames stay in a fixed pool, a binary min-heap of one-byte pool indexes
+	orders them: the used indexes are the heap, the free ones follow it in
+	the same array, so no free list is needed. Timestamps wrap every 71
+	minutes and are compared by their signed difference. The collision check
+	is a linear scan, the queue is small.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stddef.h>		/* NULL */
+
+#include "loragw_hal.h"
+#include "jitqueue.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+/* true if the frame in slot a must be sent before the frame in slot b */
+static bool jit_before(const struct jit_queue * q, int a, int b) {
+	const struct jit_entry * ea = &q->slot[a];
+	const struct jit_entry * eb = &q->slot[b];
+	bool ia = (ea->pkt.tx_mode == IMMEDIATE);
+	bool ib = (eb->pkt.tx_mode == IMMEDIATE);
+
+	if (ia != ib) return ia;
+	if (ia) return (int32_t)(ea->seq - eb->seq) < 0;
+	return (int32_t)(ea->pkt.count_us - eb->pkt.count_us) < 0;
+}
+
+static void jit_swap(struct jit_queue * q, int i, int j) {
+	uint8_t t = q->heap[i];
+
+	q->heap[i] = q->heap[j];
+	q->heap[j] = t;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+void jit_init(struct jit_queue * q) {
+	int i;
+
+	q->nb = 0;
+	q->seq = 0;
+	for (i = 0; i < JIT_QUEUE_MAX; ++i) {
+		q->heap[i] = (uint8_t)i;
+	}
+}
+
+int jit_enqueue(struct jit_queue * q, const struct lgw_pkt_tx_s * pkt, uint32_t toa_us) {
+	const struct jit_entry * e;
+	struct jit_entry * n;
+	int i, parent;
+
+	if (q->nb == JIT_QUEUE_MAX) return JIT_FULL;
+
+	/* the frames, margins included, must not overlap */
+	if (pkt->tx_mode != IMMEDIATE) {
+		for (i = 0; i < q->nb; ++i) {
+			e = &q->slot[q->heap[i]];
+			if (e->pkt.tx_mode == IMMEDIATE) continue;
+			if (((int32_t)(pkt->count_us - (e->pkt.count_us + e->toa_us + JIT_MARGIN_US)) < 0) &&
+			    ((int32_t)(e->pkt.count_us - (pkt->count_us + toa_us + JIT_MARGIN_US)) < 0)) {
+				return JIT_COLLISION;
+			}
+		}
+	}
+
+	/* take the first free slot, then sift it up */
+	n = &q->slot[q->heap[q->nb]];
+	n->pkt = *pkt;
+	n->toa_us = toa_us;
+	n->seq = q->seq++;
+	for (i = q->nb++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!jit_before(q, q->heap[i], q->heap[parent])) break;
+		jit_swap(q, i, parent);
+	}
+	return JIT_OK;
+}
+
+struct jit_entry * jit_peek(struct jit_queue * q) {
+	return (q->nb > 0) ? &q->slot[q->heap[0]] : NULL;
+}
+
+void jit_pop(struct jit_queue * q) {
+	int i, child;
+
+	/* the root slot becomes the first free one, the last frame sifts down from the root */
+	jit_swap(q, 0, --q->nb);
+	for (i = 0; (child = 2 * i + 1) < q->nb; i = child) {
+		if ((child + 1 < q->nb) && jit_before(q, q->heap[child + 1], q->heap[child])) ++child;
+		if (!jit_before(q, q->heap[child], q->heap[i])) break;
+		jit_swap(q, i, child);
+	}
+}
+
+/* --- EOF ------------------------------------------------------------------ */
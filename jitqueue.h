@@ -0,0 +1,85 @@
+/*
+Description:
+	Just-in-time queue of downlinks waiting for their slot.
+	The concentrator holds a single frame to transmit, so downlinks are kept
+	here, earliest first, and handed over one at a time shortly before their
+	timestamp. A timestamped frame whose airtime overlaps a queued one is
+	rejected on arrival. "Immediate" frames have no slot, they go first, in
+	arrival order, and are not checked for collisions.
+	A queue is not thread-safe, it belongs to the downstream thread.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _JITQUEUE_H
+#define _JITQUEUE_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+/* results of jit_enqueue */
+#define JIT_OK			0
+#define JIT_COLLISION	1	/* rejected, overlaps a queued frame */
+#define JIT_FULL		2	/* rejected, no free slot */
+
+#define JIT_QUEUE_MAX	32		/* max number of queued downlinks */
+#define JIT_MARGIN_US	3000	/* min gap between two frames, TX start delay and dispatch latency included */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct jit_entry {
+	struct lgw_pkt_tx_s pkt;
+	uint32_t toa_us;	/* time-on-air of the frame */
+	uint32_t seq;		/* arrival order, for the immediate frames */
+};
+
+struct jit_queue {
+	int nb;									/* number of queued frames */
+	uint32_t seq;
+	uint8_t heap[JIT_QUEUE_MAX];			/* min-heap of slot indexes in [0, nb), free slots after */
+	struct jit_entry slot[JIT_QUEUE_MAX];	/* frames never move once queued */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Empty a queue
+@param q pointer to the queue
+*/
+void jit_init(struct jit_queue * q);
+
+/**
+@brief Queue a downlink
+@param q pointer to the queue
+@param pkt pointer to the frame, TIMESTAMPED or IMMEDIATE, copied
+@param toa_us time-on-air of the frame in microseconds
+@return JIT_OK, JIT_COLLISION or JIT_FULL
+*/
+int jit_enqueue(struct jit_queue * q, const struct lgw_pkt_tx_s * pkt, uint32_t toa_us);
+
+/**
+@brief Get the next downlink to transmit
+@param q pointer to the queue
+@return pointer to the earliest frame, valid until jit_pop, NULL if the queue is empty
+*/
+struct jit_entry * jit_peek(struct jit_queue * q);
+
+/**
+@brief Remove the frame returned by jit_peek
+@param q pointer to the queue, not empty
+*/
+void jit_pop(struct jit_queue * q);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
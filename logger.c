@@ -0,0 +1,244 @@
+/*
+Description:
+	Asynchronous logging for the threads of the packet forwarder.
+	A thread gets its ring on its first message, the rings are never freed
+	since a thread may log until the process exits. The producers only
+	format and publish, the writer thread polls the rings every LOG_POLL_MS
+	so a message costs no system call. A mutex serializes the consumers, the
+	writer thread and the exit handler that flushes the rings when a thread
+	calls exit() after an error.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stdio.h>		/* vprintf, vsnprintf, fwrite */
+#include <stdarg.h>		/* va_list */
+#include <stdlib.h>		/* atexit */
+#include <time.h>		/* clock_gettime */
+#include <pthread.h>
+
+#include "ringbuf.h"
+#include "logger.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define LOG_THREADS		16		/* max number of threads with a ring, others print directly */
+#define LOG_RING_SIZE	256		/* messages per thread waiting to be written */
+#define LOG_LINE_SIZE	248		/* longer messages are truncated */
+#define LOG_POLL_MS		20		/* time in ms between two passes of the writer thread */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct log_record {
+	uint32_t len;
+	char text[LOG_LINE_SIZE];
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static int log_level = LOG_LVL_INFO;
+static volatile bool log_run = false;
+static pthread_t thrid_log;
+static pthread_mutex_t mx_log_drain = PTHREAD_MUTEX_INITIALIZER; /* one consumer at a time */
+
+static struct ringbuf * log_rings[LOG_THREADS]; /* NULL until the thread has allocated it */
+static uint32_t log_lost[LOG_THREADS]; /* messages lost because the ring was full */
+static uint32_t log_nb_rings = 0; /* ring indexes handed out */
+static __thread int log_ring_id = -1; /* ring of the calling thread, -2 if none is available */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+/* true if the call site is over its rate, count the message as suppressed */
+static bool log_limited(struct log_site * site) {
+	struct timespec t;
+	uint32_t now, second;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	now = (uint32_t)t.tv_sec;
+	second = __atomic_load_n(&site->second, __ATOMIC_RELAXED);
+	if ((second != now) && __atomic_compare_exchange_n(&site->second, &second, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	}
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_SITE_RATE) {
+		__atomic_fetch_add(&site->dropped, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+	return false;
+}
+
+/* get the ring of the calling thread, allocated on its first message */
+static struct ringbuf * log_ring(void) {
+	struct ringbuf * r;
+	uint32_t id;
+
+	if (log_ring_id >= 0) return log_rings[log_ring_id];
+	if (log_ring_id == -2) return NULL;
+	id = __atomic_fetch_add(&log_nb_rings, 1, __ATOMIC_RELAXED);
+	r = (id < LOG_THREADS) ? ringbuf_new(LOG_RING_SIZE, sizeof (struct log_record)) : NULL;
+	if (r == NULL) {
+		log_ring_id = -2;
+		return NULL;
+	}
+	__atomic_store_n(&log_rings[id], r, __ATOMIC_RELEASE);
+	log_ring_id = (int)id;
+	return r;
+}
+
+/* queue one formatted message, false if it could not be queued */
+static bool log_queue(struct ringbuf * r, const char * format, va_list ap) {
+	struct log_record * rec;
+	int len;
+
+	rec = ringbuf_slot_write(r);
+	if (rec == NULL) {
+		__atomic_fetch_add(&log_lost[log_ring_id], 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	len = vsnprintf(rec->text, LOG_LINE_SIZE, format, ap);
+	if (len < 0) return false;
+	rec->len = (len < LOG_LINE_SIZE) ? (uint32_t)len : LOG_LINE_SIZE - 1;
+	ringbuf_commit(r);
+	return true;
+}
+
+/* printf-like wrapper of log_queue */
+static void log_queue_f(struct ringbuf * r, const char * format, ...) {
+	va_list ap;
+
+	va_start(ap, format);
+	log_queue(r, format, ap);
+	va_end(ap);
+}
+
+/* write all the queued messages to stdout */
+static void log_drain(void) {
+	struct ringbuf * r;
+	struct log_record * rec;
+	uint32_t nb_rings, nb, lost;
+	uint32_t i, j;
+	bool written = false;
+
+	pthread_mutex_lock(&mx_log_drain);
+	nb_rings = __atomic_load_n(&log_nb_rings, __ATOMIC_RELAXED);
+	if (nb_rings > LOG_THREADS) nb_rings = LOG_THREADS;
+	for (i = 0; i < nb_rings; ++i) {
+		r = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+		if (r == NULL) continue;
+		nb = ringbuf_count(r);
+		for (j = 0; j < nb; ++j) {
+			rec = ringbuf_slot_read(r, j);
+			fwrite(rec->text, 1, rec->len, stdout);
+		}
+		ringbuf_release(r, nb);
+		lost = __atomic_exchange_n(&log_lost[i], 0, __ATOMIC_RELAXED);
+		if (lost > 0) {
+			MSG("WARNING: [log] %u messages lost, log queue full\n", lost);
+		}
+		written |= (nb > 0) || (lost > 0);
+	}
+	if (written) fflush(stdout);
+	pthread_mutex_unlock(&mx_log_drain);
+}
+
+static void log_writer(void) {
+	struct timespec t = {0, LOG_POLL_MS * 1000000L};
+
+	while (log_run) {
+		log_drain();
+		nanosleep(&t, NULL);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int log_start(int level) {
+	static bool flush_at_exit = false;
+	int i;
+
+	log_level = level;
+	if (!flush_at_exit) {
+		atexit(log_drain); /* a thread exiting on an error must not lose its last messages */
+		flush_at_exit = true;
+	}
+	log_run = true;
+	i = pthread_create(&thrid_log, NULL, (void * (*)(void *))log_writer, NULL);
+	if (i != 0) {
+		MSG("WARNING: [log] impossible to create writer thread, messages will be printed directly\n");
+		log_run = false;
+		return -1;
+	}
+	return 0;
+}
+
+void log_stop(void) {
+	if (log_run) {
+		log_run = false;
+		pthread_join(thrid_log, NULL);
+	}
+	log_drain();
+}
+
+void log_write(struct log_site * site, int level, const char * format, ...) {
+	struct ringbuf * r;
+	va_list ap;
+	uint32_t dropped = 0;
+
+	if (level > log_level) return;
+	if (site != NULL) {
+		if (log_limited(site)) return;
+		if (__atomic_load_n(&site->dropped, __ATOMIC_RELAXED) > 0) {
+			dropped = __atomic_exchange_n(&site->dropped, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	va_start(ap, format);
+	r = log_run ? log_ring() : NULL;
+	if (r == NULL) {
+		vprintf(format, ap);
+		if (dropped > 0) MSG("INFO: [log] %u similar messages suppressed\n", dropped);
+	} else if (log_queue(r, format, ap) && (dropped > 0)) {
+		log_queue_f(r, "INFO: [log] %u similar messages suppressed\n", dropped);
+	}
+	va_end(ap);
+}
+
+void log_dump(struct log_site * site, int level, const char * title, const char * text, int size) {
+	uint32_t dropped = 0;
+	int i, n;
+
+	if (level > log_level) return;
+	if (site != NULL) {
+		if (log_limited(site)) return;
+		if (__atomic_load_n(&site->dropped, __ATOMIC_RELAXED) > 0) {
+			dropped = __atomic_exchange_n(&site->dropped, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	log_write(NULL, level, "%s", title);
+	for (i = 0; i < size; i += n) {
+		n = (size - i < LOG_LINE_SIZE - 1) ? size - i : LOG_LINE_SIZE - 1;
+		log_write(NULL, level, "%.*s", n, text + i);
+	}
+	log_write(NULL, level, "\n");
+	if (dropped > 0) {
+		log_write(NULL, level, "INFO: [log] %u similar messages suppressed\n", dropped);
+	}
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,93 @@
+/*
+Description:
+	Asynchronous logging for the threads of the packet forwarder.
+	Each thread formats its messages into its own lock-free ring, a writer
+	thread drains the rings to stdout, so logging never blocks on the stdio
+	lock or on a slow terminal or pipe. Messages above the configured level
+	are discarded, and each call site is limited to LOG_SITE_RATE messages
+	per second, the number of suppressed ones is reported after the next
+	message of the site.
+	Messages from different threads may be written out of order.
+	Before log_start and after log_stop, messages are printed directly.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+/* levels, a message is kept if its level is lower or equal to the configured one */
+#define LOG_LVL_ERROR	0
+#define LOG_LVL_WARNING	1
+#define LOG_LVL_INFO	2
+#define LOG_LVL_DEBUG	3
+
+#define LOG_SITE_RATE	10	/* max number of messages per second from a call site */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC MACROS -------------------------------------------------------- */
+
+/* log a printf-like message, rate-limited per call site */
+#define LOG(level, args...)	do { static struct log_site log_site_; log_write(&log_site_, level, args); } while (0)
+
+/* log a long text in as many records as it needs, rate-limited per call site */
+#define LOG_DUMP(level, title, text, size)	do { static struct log_site log_site_; log_dump(&log_site_, level, title, text, size); } while (0)
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+/* rate limiter of a call site, zero-initialized */
+struct log_site {
+	uint32_t second;	/* monotonic second of the current window */
+	uint32_t count;		/* messages in the current window */
+	uint32_t dropped;	/* messages suppressed since the last one written */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Start the writer thread
+@param level highest level of the messages kept, LOG_LVL_xxx
+@return 0 if the thread was started, -1 otherwise (messages are then printed directly)
+*/
+int log_start(int level);
+
+/**
+@brief Write all pending messages and stop the writer thread
+*/
+void log_stop(void);
+
+/**
+@brief Log a message, typ. through the LOG macro
+@param site rate limiter of the call site, NULL for no limit
+@param level level of the message, LOG_LVL_xxx
+@param format printf format string, followed by its arguments
+*/
+void log_write(struct log_site * site, int level, const char * format, ...) __attribute__((format(printf, 3, 4)));
+
+/**
+@brief Log a text longer than a message, typ. through the LOG_DUMP macro
+@param site rate limiter of the call site, NULL for no limit
+@param level level of the message, LOG_LVL_xxx
+@param title string written before the text
+@param text text to write, split in records of at most a message each
+@param size number of characters of text
+
+The text and its title count as a single message for the rate limit, and
+are followed by a newline.
+*/
+void log_dump(struct log_site * site, int level, const char * title, const char * text, int size);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
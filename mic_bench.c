@@ -0,0 +1,201 @@
+/*
+Description:
+	mic-bench: measure the MIC verifications per second and per core.
+	aes_cmac.c is built in so both implementations can be called whatever
+	the CPU: the AES-NI path (if the CPU has it) and the portable one.
+	Messages are a LoRaWAN B0 block followed by a data frame, 16 to 56 bytes
+	in all as in fw_check_mic. The RFC 4493 test vectors are checked first,
+	then both paths must give the same tag on every message before they
+	are timed, single-threaded.
+
+	Usage: mic-bench [iterations]
+	Build with aes_cmac.c left out of the sources, this file includes it.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+/* fix an issue between POSIX and C99 */
+#if __STDC_VERSION__ >= 199901L
+	#define _XOPEN_SOURCE 600
+#else
+	#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdio.h>		/* printf */
+#include <stdlib.h>		/* atoi */
+#include <time.h>		/* clock_gettime */
+
+/* the CMAC, static functions included */
+#include "aes_cmac.c"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define BENCH_ITERATIONS	2000000
+#define BENCH_MIN_LEN		16		/* B0 block alone */
+#define BENCH_MAX_LEN		56		/* B0 block and a 40-byte frame without MIC */
+#define BENCH_STEP_LEN		8
+
+/* RFC 4493, section 4 */
+static const uint8_t rfc_key[16] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const uint8_t rfc_msg[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+static const unsigned rfc_len[4] = {0, 16, 40, 64};
+static const uint8_t rfc_mac[4][16] = {
+	{0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46},
+	{0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c},
+	{0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27},
+	{0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe}
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+typedef void (*cmac_fn)(const struct cmac_key *, const uint8_t *, unsigned, uint8_t *);
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static volatile uint32_t bench_sink; /* keeps the tag comparisons from being optimized out */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static uint64_t bench_ns(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* B0 block of an uplink, then an unconfirmed data frame of len - 16 bytes */
+static void bench_message(uint8_t * msg, unsigned len, uint32_t devaddr, uint32_t fcnt) {
+	unsigned i;
+
+	memset(msg, 0, 16);
+	msg[0] = 0x49;
+	msg[6] = (uint8_t)devaddr;
+	msg[7] = (uint8_t)(devaddr >> 8);
+	msg[8] = (uint8_t)(devaddr >> 16);
+	msg[9] = (uint8_t)(devaddr >> 24);
+	msg[10] = (uint8_t)fcnt;
+	msg[11] = (uint8_t)(fcnt >> 8);
+	msg[12] = (uint8_t)(fcnt >> 16);
+	msg[13] = (uint8_t)(fcnt >> 24);
+	msg[15] = (uint8_t)(len - 16);
+	for (i = 16; i < len; ++i) {
+		msg[i] = (uint8_t)(i * 37 + fcnt);
+	}
+	if (len > 16) msg[16] = 0x40; /* MHDR */
+}
+
+/* true if the implementation gives the RFC 4493 tags */
+static bool bench_rfc(cmac_fn f) {
+	struct cmac_key k;
+	uint8_t mac[16];
+	int i;
+
+	cmac_init(&k, rfc_key);
+	for (i = 0; i < 4; ++i) {
+		f(&k, rfc_msg, rfc_len[i], mac);
+		if (memcmp(mac, rfc_mac[i], 16) != 0) return false;
+	}
+	return true;
+}
+
+/* verifications per second, the tag compared as fw_check_mic does */
+static double bench_rate(cmac_fn f, const struct cmac_key * k, unsigned len, int iterations) {
+	uint8_t msg[BENCH_MAX_LEN];
+	uint8_t mac[16];
+	uint64_t start, ns;
+	int i;
+
+	bench_message(msg, len, 0x26031C2C, 0);
+	start = bench_ns();
+	for (i = 0; i < iterations; ++i) {
+		msg[10] = (uint8_t)i; /* new FCnt, as many frames as iterations */
+		f(k, msg, len, mac);
+		bench_sink += (memcmp(mac, msg, 4) == 0);
+	}
+	ns = bench_ns() - start;
+	return (ns > 0) ? 1e9 * iterations / ns : 0.0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	static const uint8_t key[16] = {0x2B, 0x7E, 0x15, 0x16, 0x28, 0xAE, 0xD2, 0xA6, 0xAB, 0xF7, 0x15, 0x88, 0x09, 0xCF, 0x4F, 0x3C};
+	struct cmac_key k;
+	uint8_t msg[BENCH_MAX_LEN];
+	uint8_t mac_sw[16];
+	int iterations = BENCH_ITERATIONS;
+	unsigned len;
+	uint32_t n;
+	double r_sw;
+	bool hw;
+#ifdef CMAC_AESNI
+	uint8_t mac_ni[16];
+	double r_ni;
+#endif
+
+	if ((argc > 2) || ((argc > 1) && ((iterations = atoi(argv[1])) <= 0))) {
+		MSG("Usage: mic-bench [iterations]\n");
+		return EXIT_FAILURE;
+	}
+	cmac_init(&k, key);
+	hw = cmac_hw_accelerated();
+
+	/* correctness first */
+	if (!bench_rfc(cmac_compute_sw)) {
+		MSG("ERROR: software CMAC does not match RFC 4493\n");
+		return EXIT_FAILURE;
+	}
+#ifdef CMAC_AESNI
+	if (hw && !bench_rfc(cmac_compute_ni)) {
+		MSG("ERROR: AES-NI CMAC does not match RFC 4493\n");
+		return EXIT_FAILURE;
+	}
+	for (len = 0; hw && (len <= BENCH_MAX_LEN); ++len) {
+		for (n = 0; n < 256; ++n) {
+			bench_message(msg, (len < 16) ? 16 : len, n * 0x01000193, n);
+			cmac_compute_sw(&k, msg, len, mac_sw);
+			cmac_compute_ni(&k, msg, len, mac_ni);
+			if (memcmp(mac_sw, mac_ni, 16) != 0) {
+				MSG("ERROR: AES-NI and software CMAC differ on %u bytes\n", len);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+#endif
+
+	MSG("##### mic-bench: %i verifications per size, one core #####\n", iterations);
+	MSG("# AES-NI: %s\n", hw ? "available" : "not available, software only");
+	for (len = BENCH_MIN_LEN; len <= BENCH_MAX_LEN; len += BENCH_STEP_LEN) {
+		r_sw = bench_rate(cmac_compute_sw, &k, len, iterations);
+#ifdef CMAC_AESNI
+		if (hw) {
+			r_ni = bench_rate(cmac_compute_ni, &k, len, iterations);
+			MSG("# %2u bytes: AES-NI %.2f M/s, software %.2f M/s, %.1fx\n", len, r_ni / 1e6, r_sw / 1e6, r_ni / r_sw);
+			continue;
+		}
+#endif
+		MSG("# %2u bytes: software %.2f M/s\n", len, r_sw / 1e6);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
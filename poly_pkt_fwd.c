@@ -29,6 +29,7 @@ Maintainer: Ruud Vlaming
 #else
 	#define _XOPEN_SOURCE 500
 #endif
+#define _GNU_SOURCE	/* sendmmsg, recvmmsg */
 
 #include <stdint.h>		/* C99 types */
 #include <stdbool.h>	/* bool type */
@@ -49,9 +50,13 @@ Maintainer: Ruud Vlaming
 #include <netdb.h>		/* gai_strerror */
 
 #include <pthread.h>
+#include <semaphore.h>	/* sem_post, sem_timedwait */
+#include <sys/epoll.h>	/* epoll_create1, epoll_wait */
+#include <sys/timerfd.h>	/* timerfd_create, timerfd_settime */
 
 #include "parson.h"
 #include "base64.h"
+#include "base64_simd.h"
 
 #include "loragw_hal.h"
 #include "loragw_gps.h"
@@ -59,6 +64,14 @@ Maintainer: Ruud Vlaming
 #include "poly_pkt_fwd.h"
 #include "ghost.h"
 #include "monitor.h"
+#include "firewall.h"
+#include "airtime.h"
+#include "rxpk.h"
+#include "ringbuf.h"
+#include "histogram.h"
+#include "txpk.h"
+#include "jitqueue.h"
+#include "logger.h"
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE MACROS ------------------------------------------------------- */
@@ -95,6 +108,11 @@ Maintainer: Ruud Vlaming
 #define GPS_REF_MAX_AGE		30	/* maximum admitted delay in seconds of GPS loss before considering latest GPS sync unusable */
 #define FETCH_SLEEP_MS		10	/* nb of ms waited when a fetch return no packets */
 #define BEACON_POLL_MS		50	/* time in ms between polling of beacon TX status */
+#define BEACON_GUARD_US		50000	/* the beacon is handed to the concentrator at most that long before the PPS */
+#define BEACON_LATE_US		5000	/* a beacon closer than that to the PPS is skipped, it would go out a second late */
+#define JIT_LEAD_US		30000	/* a downlink is handed to the concentrator at most that long before its slot */
+#define JIT_LATE_US		1500	/* a downlink closer than that to its slot is dropped, TX start delay of the concentrator */
+#define CONCENT_REF_MAX_AGE	60	/* maximum age in seconds of the concentrator counter reference */
 
 #define	PROTOCOL_VERSION	1
 
@@ -108,15 +126,95 @@ Maintainer: Ruud Vlaming
 #define PKT_PULL_ACK	4
 
 #define NB_PKT_MAX		8 /* max number of packets per fetch/send cycle */
+#define RX_RING_SIZE	256 /* max number of packets fetched but not yet sent upstream */
+#define UP_QUEUE_SIZE	16 /* max number of PUSH_DATA queued per server, newer ones are dropped */
+#define ACK_BATCH		16 /* max number of PUSH_ACK read per system call */
+#define INFLIGHT_SIZE	64 /* max number of PUSH_DATA awaiting an ACK, per server (power of 2) */
+#define INFLIGHT_USED	(1ULL << 63) /* flag of an in-flight table entry in use */
 
 #define MIN_LORA_PREAMB	6 /* minimum Lora preamble length for this application */
 #define STD_LORA_PREAMB	8
 #define MIN_FSK_PREAMB	3 /* minimum FSK preamble length for this application */
 #define STD_FSK_PREAMB	4
 
-#define STATUS_SIZE		328
+#define STATUS_SIZE		1024
+#define FW_STAT_TOP		8		/* most hit firewall rules in the status report */
 #define TX_BUFF_SIZE	((540 * NB_PKT_MAX) + 30 + STATUS_SIZE)
 
+/* counter blocks, by writing thread */
+#define MEAS_FETCH		0
+#define MEAS_UP			1
+#define MEAS_ACK		2
+#define MEAS_DOWN		3
+#define MEAS_PUSH		4 /* first push thread, one block per server */
+#define MEAS_BLOCKS		(MEAS_PUSH + MAX_SERVERS)
+
+/* latency histograms, by stage of the uplink path */
+#define LAT_RECEIVE		0 /* lgw_receive call */
+#define LAT_QUEUE		1 /* from the fetch to the upstream thread */
+#define LAT_FILTER		2 /* filtering of the packets of a datagram */
+#define LAT_SERIALIZE	3 /* JSON serialization of the packets of a datagram */
+#define LAT_SEND		4 /* from the server queue to the socket */
+#define LAT_ACK			5 /* PUSH_DATA to PUSH_ACK round trip */
+#define LAT_NB			6
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+/* packet queued by the fetch thread for the upstream thread */
+struct rx_record {
+	struct lgw_pkt_rx_s pkt;
+	struct timespec fetch_time; /* system UTC time of the fetch, used without GPS */
+	uint32_t fetch_us; /* monotonic time of the fetch */
+};
+
+/* datagram queued by the upstream thread for a push thread */
+struct up_dgram {
+	int size;
+	uint32_t queued_us; /* monotonic time the datagram was queued at */
+	uint8_t buff[TX_BUFF_SIZE];
+};
+
+/* statistics counters */
+enum meas_id {
+	MEAS_NB_RX_RCV,			/* count packets received */
+	MEAS_NB_RX_OK,			/* count packets received with PAYLOAD CRC OK */
+	MEAS_NB_RX_BAD,			/* count packets received with PAYLOAD CRC ERROR */
+	MEAS_NB_RX_NOCRC,		/* count packets received with NO PAYLOAD CRC */
+	MEAS_NB_RX_FW,			/* count packets dropped by the firewall */
+	MEAS_NB_RX_LIMIT,		/* count packets dropped by the firewall rate limiter */
+	MEAS_NB_RX_REPLAY,		/* count replayed or duplicated packets dropped */
+	MEAS_NB_RX_FORGED,		/* count packets dropped because of an invalid MIC */
+	MEAS_NB_RX_RING,		/* count packets lost because the upstream ring was full */
+	MEAS_UP_PKT_FWD,		/* number of radio packet forwarded to the server */
+	MEAS_UP_NETWORK_BYTE,	/* sum of UDP bytes sent for upstream traffic */
+	MEAS_UP_PAYLOAD_BYTE,	/* sum of radio payload bytes sent for upstream traffic */
+	MEAS_UP_DGRAM_SENT,		/* number of datagrams sent for upstream traffic */
+	MEAS_UP_DGRAM_DROP,		/* number of datagrams dropped because a server queue was full */
+	MEAS_UP_ACK_RCV,		/* number of datagrams acknowledged for upstream traffic */
+	MEAS_DW_PULL_SENT,		/* number of PULL requests sent for downstream traffic */
+	MEAS_DW_ACK_RCV,		/* number of PULL requests acknowledged for downstream traffic */
+	MEAS_DW_DGRAM_RCV,		/* count PULL response packets received for downstream traffic */
+	MEAS_DW_NETWORK_BYTE,	/* sum of UDP bytes received for downstream traffic */
+	MEAS_DW_PAYLOAD_BYTE,	/* sum of radio payload bytes queued for downstream traffic */
+	MEAS_NB_TX_OK,			/* count packets emitted successfully */
+	MEAS_NB_TX_FAIL,		/* count packets were TX failed for other reasons */
+	MEAS_NB_TX_FW,			/* count packets rejected by the downlink firewall */
+	MEAS_NB_TX_LIMIT,		/* count packets rejected by the downlink rate limiters */
+	MEAS_NB_TX_DUTY,		/* count packets rejected by the duty-cycle budgets */
+	MEAS_NB_TX_COLLISION,	/* count packets rejected because they overlap a queued one */
+	MEAS_NB_TX_FULL,		/* count packets rejected because the JIT queue was full */
+	MEAS_NB_TX_LATE,		/* count packets dropped because their slot was already past */
+	MEAS_TX_AIRTIME,		/* airtime of the packets sent to the concentrator, in us */
+	MEAS_NB
+};
+
+/* each thread writes its own block of counters, the counters only grow and the */
+/* statistics loop reports the difference between two readings, so no lock is needed */
+struct meas_block {
+	uint64_t cnt[MEAS_NB];
+} __attribute__((aligned(64))); /* own cache lines, writers never share one */
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
 
@@ -130,6 +228,9 @@ static bool fwd_valid_pkt = true; /* packets with PAYLOAD CRC OK are forwarded *
 static bool fwd_error_pkt = false; /* packets with PAYLOAD CRC ERROR are NOT forwarded */
 static bool fwd_nocrc_pkt = false; /* packets with NO PAYLOAD CRC are NOT forwarded */
 
+/* firewall configuration variables */
+static char fw_conf_path[64] = "firewall_conf.json"; /* file containing the firewall_conf object */
+
 /* network configuration variables */
 static uint8_t serv_count = 0; /* Counter for defined servers */
 static uint64_t lgwm = 0; /* Lora gateway MAC address */
@@ -151,11 +252,25 @@ static int sock_up[MAX_SERVERS]; /* sockets for upstream traffic */
 static int sock_down[MAX_SERVERS]; /* sockets for downstream traffic */
 
 /* network protocol variables */
-static struct timeval push_timeout_half = {0, (PUSH_TIMEOUT_MS * 500)}; /* cut in half, critical for throughput */
-static struct timeval pull_timeout = {0, (PULL_TIMEOUT_MS * 1000)}; /* non critical for throughput */
+static unsigned push_timeout_ms = PUSH_TIMEOUT_MS; /* PUSH_ACK received later are not counted */
+static unsigned push_batch_us = 0; /* max time a PUSH_DATA waits for others to be sent in the same system call */
+static int log_verbosity = LOG_LVL_INFO; /* highest level of the messages logged by the threads */
 
 /* hardware access control and correction */
 static pthread_mutex_t mx_concent = PTHREAD_MUTEX_INITIALIZER; /* control access to the concentrator */
+
+/* packets fetched from the concentrator, fetch thread -> upstream thread */
+static struct ringbuf * rx_ring;
+static sem_t rx_ring_sem; /* posted when packets are queued */
+
+/* PUSH_DATA to send, upstream thread -> push thread of each server */
+static struct ringbuf * up_queue[MAX_SERVERS];
+static sem_t up_queue_sem[MAX_SERVERS]; /* posted when a datagram is queued */
+
+/* PUSH_DATA awaiting a PUSH_ACK, push threads -> ACK thread */
+static uint64_t inflight[MAX_SERVERS][INFLIGHT_SIZE]; /* 0 when free, else INFLIGHT_USED | token << 32 | send time in us */
+static uint64_t concent_ref; /* counter of the latest received packet << 32 | monotonic time in us it was fetched, 0 if none */
+
 static pthread_mutex_t mx_xcorr = PTHREAD_MUTEX_INITIALIZER; /* control access to the XTAL correction */
 static bool xtal_correct_ok = false; /* set true when XTAL correction is stable enough */
 static double xtal_correct = 1.0;
@@ -177,25 +292,10 @@ static struct coord_s reference_coord;
 static bool gps_fake_enable; /* fake coordinates override real coordinates */
 
 /* measurements to establish statistics */
-static pthread_mutex_t mx_meas_up = PTHREAD_MUTEX_INITIALIZER; /* control access to the upstream measurements */
-static uint32_t meas_nb_rx_rcv = 0; /* count packets received */
-static uint32_t meas_nb_rx_ok = 0; /* count packets received with PAYLOAD CRC OK */
-static uint32_t meas_nb_rx_bad = 0; /* count packets received with PAYLOAD CRC ERROR */
-static uint32_t meas_nb_rx_nocrc = 0; /* count packets received with NO PAYLOAD CRC */
-static uint32_t meas_up_pkt_fwd = 0; /* number of radio packet forwarded to the server */
-static uint32_t meas_up_network_byte = 0; /* sum of UDP bytes sent for upstream traffic */
-static uint32_t meas_up_payload_byte = 0; /* sum of radio payload bytes sent for upstream traffic */
-static uint32_t meas_up_dgram_sent = 0; /* number of datagrams sent for upstream traffic */
-static uint32_t meas_up_ack_rcv = 0; /* number of datagrams acknowledged for upstream traffic */
-
-static pthread_mutex_t mx_meas_dw = PTHREAD_MUTEX_INITIALIZER; /* control access to the downstream measurements */
-static uint32_t meas_dw_pull_sent = 0; /* number of PULL requests sent for downstream traffic */
-static uint32_t meas_dw_ack_rcv = 0; /* number of PULL requests acknowledged for downstream traffic */
-static uint32_t meas_dw_dgram_rcv = 0; /* count PULL response packets received for downstream traffic */
-static uint32_t meas_dw_network_byte = 0; /* sum of UDP bytes sent for upstream traffic */
-static uint32_t meas_dw_payload_byte = 0; /* sum of radio payload bytes sent for upstream traffic */
-static uint32_t meas_nb_tx_ok = 0; /* count packets emitted successfully */
-static uint32_t meas_nb_tx_fail = 0; /* count packets were TX failed for other reasons */
+static struct meas_block meas[MEAS_BLOCKS]; /* one block of counters per writing thread */
+static struct histogram latency[LAT_NB]; /* in us, recorded without lock by the uplink threads */
+static const char * latency_name[LAT_NB] = {"lgw_receive", "Upstream queue", "Filtering", "Serialization", "PUSH_DATA send", "PUSH_ACK"};
+static const char * latency_key[LAT_NB] = {"rcv", "que", "flt", "ser", "snd", "ack"}; /* in the JSON report */
 
 static pthread_mutex_t mx_meas_gps = PTHREAD_MUTEX_INITIALIZER; /* control access to the GPS statistics */
 static bool gps_coord_valid; /* could we get valid GPS coordinates ? */
@@ -210,7 +310,10 @@ static char status_report[STATUS_SIZE]; /* status report as a JSON object */
 static uint32_t beacon_period = 128; /* set beaconing period, must be a sub-multiple of 86400, the nb of sec in a day */
 static uint32_t beacon_offset = 0; /* must be < beacon_period, set when the beacon is emitted */
 static uint32_t beacon_freq_hz = 0; /* TX beacon frequency, in Hz */
-static bool beacon_next_pps = false; /* signal to prepare beacon packet for TX, no need for mutex */
+static pthread_mutex_t mx_beacon = PTHREAD_MUTEX_INITIALIZER; /* control access to beacon_time */
+static pthread_cond_t cv_beacon = PTHREAD_COND_INITIALIZER; /* signalled by the GPS thread when a beacon is due */
+static uint32_t beacon_time = 0; /* UTC second of the beacon to send on the next PPS, 0 = none */
+static uint64_t beacon_slot = 0; /* start counter << 32 | length in us of the TX time reserved for the beacon, 0 = none */
 
 /* auto-quit function */
 static uint32_t autoquit_threshold = 0; /* enable auto-quit after a number of non-acknowledged PULL_DATA (0 = disabled)*/
@@ -227,6 +330,7 @@ static char monitor_port[8]  = "2008";      /* port to listen on */
 static bool gps_enabled         = false;   /* controls the use of the GPS                      */
 static bool beacon_enabled      = false;   /* controls the activation of the time beacon.      */
 static bool monitor_enabled     = false;   /* controls the activation access mode.             */
+static bool firewall_enabled    = true;    /* controls the filtering of packets by device address */
 
 /* Control over the separate streams. Per default, the system behaves like a basic packet forwarder. */
 static bool upstream_enabled     = true;    /* controls the data flow from end-node to server         */
@@ -273,11 +377,31 @@ static uint16_t crc_ccit(const uint8_t * data, unsigned size);
 
 static uint8_t crc8_ccit(const uint8_t * data, unsigned size);
 
+static void beacon_load_time(uint8_t * payload, uint32_t field_time);
+
+static uint32_t mono_us(void);
+
+static bool concent_cnt(uint32_t * cnt);
+
+static void meas_add(int block, int id, uint64_t n);
+
+static void meas_read(uint64_t * total);
+
+static void sem_wait_us(sem_t * sem, unsigned us);
+
+static void down_transmit(int ic, uint8_t * buff_down, int msg_len, int fw_reader, struct jit_queue * jit);
+
+static int down_dispatch(struct jit_queue * jit);
+
 /* threads */
+void thread_fetch(void);
 void thread_up(void);
-void thread_down(void* pic);
+void thread_push(void* pic);
+void thread_ack(void);
+void thread_down(void);
 void thread_gps(void);
 void thread_valid(void);
+void thread_beacon(void);
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
@@ -287,6 +411,8 @@ static void sig_handler(int sigio) {
 		quit_sig = true;;
 	} else if ((sigio == SIGINT) || (sigio == SIGTERM)) {
 		exit_sig = true;
+	} else if (sigio == SIGHUP) {
+		fw_reload_request();
 	}
 	return;
 }
@@ -731,8 +857,32 @@ static int parse_gateway_configuration(const char * conf_file) {
 	/* get time-out value (in ms) for upstream datagrams (optional) */
 	val = json_object_get_value(conf_obj, "push_timeout_ms");
 	if (val != NULL) {
-		push_timeout_half.tv_usec = 500 * (long int)json_value_get_number(val);
-		MSG("INFO: upstream PUSH_DATA time-out is configured to %u ms\n", (unsigned)(push_timeout_half.tv_usec / 500));
+		push_timeout_ms = (unsigned)json_value_get_number(val);
+		MSG("INFO: upstream PUSH_DATA time-out is configured to %u ms\n", push_timeout_ms);
+	}
+	
+	/* get max delay (in us) for batching upstream datagrams (optional) */
+	val = json_object_get_value(conf_obj, "push_batch_us");
+	if (val != NULL) {
+		push_batch_us = (unsigned)json_value_get_number(val);
+		MSG("INFO: upstream PUSH_DATA are batched for up to %u us\n", push_batch_us);
+	}
+	
+	/* get the level of the messages logged by the threads (optional) */
+	str = json_object_get_string(conf_obj, "log_level");
+	if (str != NULL) {
+		if (!strcmp(str, "error")) {
+			log_verbosity = LOG_LVL_ERROR;
+		} else if (!strcmp(str, "warning")) {
+			log_verbosity = LOG_LVL_WARNING;
+		} else if (!strcmp(str, "info")) {
+			log_verbosity = LOG_LVL_INFO;
+		} else if (!strcmp(str, "debug")) {
+			log_verbosity = LOG_LVL_DEBUG;
+		} else {
+			MSG("WARNING: invalid log level \"%s\", use error, warning, info or debug\n", str);
+		}
+		MSG("INFO: log level is configured to %i\n", log_verbosity);
 	}
 	
 	/* packet filtering parameters */
@@ -915,6 +1065,37 @@ static int parse_gateway_configuration(const char * conf_file) {
 		MSG("INFO: Beacon is disabled\n");
     }
 
+	/* Read the value for firewall_enabled data */
+	val = json_object_get_value(conf_obj, "firewall");
+	if (json_value_get_type(val) == JSONBoolean) {
+		firewall_enabled = (bool)json_value_get_boolean(val);
+	}
+	if (firewall_enabled == true) {
+		MSG("INFO: Firewall is enabled\n");
+	} else {
+		MSG("INFO: Firewall is disabled\n");
+	}
+
+	/* Firewall rules file (optional) */
+	str = json_object_get_string(conf_obj, "firewall_path");
+	if (str != NULL) {
+		if (snprintf(fw_conf_path, sizeof fw_conf_path, "%s", str) >= (int)sizeof fw_conf_path) {
+			MSG("ERROR: \"firewall_path\" longer than %u characters\n", (unsigned)sizeof fw_conf_path - 1);
+			exit(EXIT_FAILURE);
+		}
+		MSG("INFO: Firewall rules file is configured to \"%s\"\n", fw_conf_path);
+	}
+
+	/* Duty-cycle budgets of the downlinks (optional) */
+	val = json_object_get_value(conf_obj, "duty_cycle");
+	if (val != NULL) {
+		if (duty_configure(json_value_get_object(val)) != 0) {
+			MSG("ERROR: invalid \"duty_cycle\" configuration, downlinks cannot be sent\n");
+			exit(EXIT_FAILURE);
+		}
+		MSG("INFO: Duty-cycle budgets are enforced\n");
+	}
+
 	/* Read the value for monitor_enabled data */
 	val = json_object_get_value(conf_obj, "monitor");
 	if (json_value_get_type(val) == JSONBoolean) {
@@ -999,6 +1180,73 @@ static uint8_t crc8_ccit(const uint8_t * data, unsigned size) {
 	return x;
 }
 
+/* load the time field of a beacon payload (bytes 3-6, little endian) and its CRC (byte 7) */
+static void beacon_load_time(uint8_t * payload, uint32_t field_time) {
+	payload[3] = 0xFF &  field_time;
+	payload[4] = 0xFF & (field_time >>  8);
+	payload[5] = 0xFF & (field_time >> 16);
+	payload[6] = 0xFF & (field_time >> 24);
+	payload[7] = crc8_ccit(payload, 7); /* CRC for the first 7 bytes */
+}
+
+/* add to a statistics counter, only called by the thread owning the block */
+static void meas_add(int block, int id, uint64_t n) {
+	uint64_t * c = &meas[block].cnt[id];
+	
+	/* single writer: a relaxed load and store, no locked read-modify-write */
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* sum the counters of all the threads */
+static void meas_read(uint64_t * total) {
+	int b, id;
+	
+	for (id = 0; id < MEAS_NB; ++id) {
+		total[id] = 0;
+	}
+	for (b = 0; b < MEAS_BLOCKS; ++b) {
+		for (id = 0; id < MEAS_NB; ++id) {
+			total[id] += __atomic_load_n(&meas[b].cnt[id], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* monotonic time in us, wraps every 71 minutes, only differences are meaningful */
+static uint32_t mono_us(void) {
+	struct timespec t;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint32_t)((uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000);
+}
+
+/* estimate the concentrator counter from the latest received packet, false if there is no recent one */
+static bool concent_cnt(uint32_t * cnt) {
+	uint64_t ref;
+	uint32_t now;
+	
+	ref = __atomic_load_n(&concent_ref, __ATOMIC_RELAXED);
+	now = mono_us();
+	if ((ref == 0) || ((now - (uint32_t)ref) > 1000000U * CONCENT_REF_MAX_AGE)) {
+		return false;
+	}
+	*cnt = (uint32_t)(ref >> 32) + (now - (uint32_t)ref);
+	return true;
+}
+
+/* wait for a semaphore at most us microseconds */
+static void sem_wait_us(sem_t * sem, unsigned us) {
+	struct timespec t;
+	
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_sec += us / 1000000;
+	t.tv_nsec += (us % 1000000) * 1000;
+	if (t.tv_nsec >= 1000000000) {
+		t.tv_sec += 1;
+		t.tv_nsec -= 1000000000;
+	}
+	sem_timedwait(sem, &t);
+}
+
 double difftimespec(struct timespec end, struct timespec beginning) {
 	double x;
 	
@@ -1023,10 +1271,14 @@ int main(void)
 	char *debug_cfg_path = "debug_conf.json"; /* if present, all other configuration files are ignored */
 	
 	/* threads */
+	pthread_t thrid_fetch;
 	pthread_t thrid_up;
-	pthread_t thrid_down[MAX_SERVERS];
+	pthread_t thrid_push[MAX_SERVERS];
+	pthread_t thrid_ack;
+	pthread_t thrid_down;
 	pthread_t thrid_gps;
 	pthread_t thrid_valid;
+	pthread_t thrid_beacon;
 	
 	/* network socket creation */
 	struct addrinfo hints;
@@ -1040,18 +1292,49 @@ int main(void)
 	uint32_t cp_nb_rx_ok;
 	uint32_t cp_nb_rx_bad;
 	uint32_t cp_nb_rx_nocrc;
+	uint32_t cp_nb_rx_fw;
+	uint32_t cp_nb_rx_limit;
+	uint32_t cp_nb_rx_replay;
+	uint32_t cp_nb_rx_forged;
+	uint32_t cp_nb_rx_ring;
 	uint32_t cp_up_pkt_fwd;
-	uint32_t cp_up_network_byte;
-	uint32_t cp_up_payload_byte;
+	struct histogram cp_latency;
+	uint32_t lat_pct[LAT_NB][3]; /* p50, p99 and p999 of each stage */
+	uint32_t lat_max[LAT_NB];
+	char lat_report[320]; /* "ltcy" member of the JSON report */
+	int lat_report_len;
+	uint64_t cp_up_network_byte;
+	uint64_t cp_up_payload_byte;
 	uint32_t cp_up_dgram_sent;
+	uint32_t cp_up_dgram_drop;
 	uint32_t cp_up_ack_rcv;
 	uint32_t cp_dw_pull_sent;
 	uint32_t cp_dw_ack_rcv;
 	uint32_t cp_dw_dgram_rcv;
-	uint32_t cp_dw_network_byte;
-	uint32_t cp_dw_payload_byte;
+	uint64_t cp_dw_network_byte;
+	uint64_t cp_dw_payload_byte;
 	uint32_t cp_nb_tx_ok;
 	uint32_t cp_nb_tx_fail;
+	uint32_t cp_nb_tx_fw;
+	uint32_t cp_nb_tx_limit;
+	uint32_t cp_nb_tx_duty;
+	uint32_t cp_nb_tx_collision;
+	uint32_t cp_nb_tx_full;
+	uint32_t cp_nb_tx_late;
+	uint64_t cp_tx_airtime;
+	uint64_t meas_total[MEAS_NB]; /* counters since the start */
+	uint64_t meas_last[MEAS_NB] = {0}; /* counters at the previous report */
+	uint64_t cp_meas[MEAS_NB]; /* counters over the reporting interval */
+	
+	/* firewall rule counters */
+	int fw_stat_reader = -1;
+	struct fw_rule_stat fw_top[FW_STAT_TOP];
+	int fw_nb_top = 0;
+	uint32_t fw_nb_dead = 0;
+	char fw_entry[64]; /* "fwdr" or a rule of "fwhr" in the JSON report */
+	int fw_entry_len;
+	int status_len;
+	int k;
 	
 	/* GPS coordinates variables */
 	bool coord_ok = false;
@@ -1080,6 +1363,12 @@ int main(void)
 		MSG("INFO: Host endianness unknown\n");
 	#endif
 	
+	/* time-on-air table, used by the duty-cycle budgets */
+	airtime_init();
+	
+	/* pick the base64 codec for this CPU */
+	MSG("INFO: [main] base64 codec uses %s instructions\n", b64_simd_init());
+	
 	/* load configuration files */
 	if (access(debug_cfg_path, R_OK) == 0) { /* if there is a debug conf, parse only the debug conf */
 		MSG("INFO: found debug configuration file %s, parsing it\n", debug_cfg_path);
@@ -1124,6 +1413,19 @@ int main(void)
 		}
 	}
 	
+	/* compile the firewall rules before any packet can be received, reloads happen in the background */
+	if (firewall_enabled == true) {
+		if (access(fw_conf_path, R_OK) != 0) {
+			MSG("WARNING: [main] firewall rules file %s not found, packets will not be filtered\n", fw_conf_path);
+			firewall_enabled = false;
+		} else if (fw_start(fw_conf_path) != 0) {
+			MSG("ERROR: [main] failed to load firewall rules from %s\n", fw_conf_path);
+			exit(EXIT_FAILURE);
+		} else {
+			fw_stat_reader = fw_reader_register();
+		}
+	}
+	
 	/* get timezone info */
 	tzset();
 	
@@ -1245,22 +1547,50 @@ int main(void)
 	}
 
 	
+	/* the threads log through the asynchronous writer */
+	log_start(log_verbosity);
+	
 	/* spawn threads to manage upstream and downstream */
 	if (upstream_enabled == true) {
+		rx_ring = ringbuf_new(RX_RING_SIZE, sizeof (struct rx_record));
+		if ((rx_ring == NULL) || (sem_init(&rx_ring_sem, 0, 0) != 0)) {
+			MSG("ERROR: [main] impossible to allocate the upstream queue\n");
+			exit(EXIT_FAILURE);
+		}
+		i = pthread_create( &thrid_fetch, NULL, (void * (*)(void *))thread_fetch, NULL);
+		if (i != 0) {
+			MSG("ERROR: [main] impossible to create fetch thread\n");
+			exit(EXIT_FAILURE);
+		}
 		i = pthread_create( &thrid_up, NULL, (void * (*)(void *))thread_up, NULL);
 		if (i != 0) {
 			MSG("ERROR: [main] impossible to create upstream thread\n");
 			exit(EXIT_FAILURE);
 		}
-	}
-	if (downstream_enabled == true) {
 		for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
-			i = pthread_create( &thrid_down[ic], NULL, (void * (*)(void *))thread_down, (void *) (long) ic);
+			up_queue[ic] = ringbuf_new(UP_QUEUE_SIZE, sizeof (struct up_dgram));
+			if ((up_queue[ic] == NULL) || (sem_init(&up_queue_sem[ic], 0, 0) != 0)) {
+				MSG("ERROR: [main] impossible to allocate the queue of server %s\n", serv_addr[ic]);
+				exit(EXIT_FAILURE);
+			}
+			i = pthread_create( &thrid_push[ic], NULL, (void * (*)(void *))thread_push, (void *) (long) ic);
 			if (i != 0) {
-				MSG("ERROR: [main] impossible to create downstream thread\n");
+				MSG("ERROR: [main] impossible to create push thread\n");
 				exit(EXIT_FAILURE);
 			}
 		}
+		i = pthread_create( &thrid_ack, NULL, (void * (*)(void *))thread_ack, NULL);
+		if (i != 0) {
+			MSG("ERROR: [main] impossible to create ACK thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (downstream_enabled == true) {
+		i = pthread_create( &thrid_down, NULL, (void * (*)(void *))thread_down, NULL);
+		if (i != 0) {
+			MSG("ERROR: [main] impossible to create downstream thread\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 	
 	/* spawn thread to manage GPS */
@@ -1275,6 +1605,13 @@ int main(void)
 			MSG("ERROR: [main] impossible to create validation thread\n");
 			exit(EXIT_FAILURE);
 		}
+		if (beacon_enabled == true) {
+			i = pthread_create( &thrid_beacon, NULL, (void * (*)(void *))thread_beacon, NULL);
+			if (i != 0) {
+				MSG("ERROR: [main] impossible to create beacon thread\n");
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
 	
 	/* configure signal handling */
@@ -1284,6 +1621,7 @@ int main(void)
 	sigaction(SIGQUIT, &sigact, NULL); /* Ctrl-\ */
 	sigaction(SIGINT, &sigact, NULL); /* Ctrl-C */
 	sigaction(SIGTERM, &sigact, NULL); /* default "kill" command */
+	sigaction(SIGHUP, &sigact, NULL); /* reload the firewall rules */
 
 	/* Start the ghost Listener */
     if (ghoststream_enabled == true) {
@@ -1311,27 +1649,40 @@ int main(void)
 		t = time(NULL);
 		strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
 		
-		/* access upstream statistics, copy and reset them */
-		pthread_mutex_lock(&mx_meas_up);
-		cp_nb_rx_rcv       = meas_nb_rx_rcv;
-		cp_nb_rx_ok        = meas_nb_rx_ok;
-		cp_nb_rx_bad       = meas_nb_rx_bad;
-		cp_nb_rx_nocrc     = meas_nb_rx_nocrc;
-		cp_up_pkt_fwd      = meas_up_pkt_fwd;
-		cp_up_network_byte = meas_up_network_byte;
-		cp_up_payload_byte = meas_up_payload_byte;
-		cp_up_dgram_sent   = meas_up_dgram_sent;
-		cp_up_ack_rcv      = meas_up_ack_rcv;
-		meas_nb_rx_rcv = 0;
-		meas_nb_rx_ok = 0;
-		meas_nb_rx_bad = 0;
-		meas_nb_rx_nocrc = 0;
-		meas_up_pkt_fwd = 0;
-		meas_up_network_byte = 0;
-		meas_up_payload_byte = 0;
-		meas_up_dgram_sent = 0;
-		meas_up_ack_rcv = 0;
-		pthread_mutex_unlock(&mx_meas_up);
+		/* read the counters of all threads, report their increase since the previous reading */
+		meas_read(meas_total);
+		for (k = 0; k < MEAS_NB; ++k) {
+			cp_meas[k] = meas_total[k] - meas_last[k];
+			meas_last[k] = meas_total[k];
+		}
+		
+		/* upstream statistics */
+		cp_nb_rx_rcv       = (uint32_t)cp_meas[MEAS_NB_RX_RCV];
+		cp_nb_rx_ok        = (uint32_t)cp_meas[MEAS_NB_RX_OK];
+		cp_nb_rx_bad       = (uint32_t)cp_meas[MEAS_NB_RX_BAD];
+		cp_nb_rx_nocrc     = (uint32_t)cp_meas[MEAS_NB_RX_NOCRC];
+		cp_nb_rx_fw        = (uint32_t)cp_meas[MEAS_NB_RX_FW];
+		cp_nb_rx_limit     = (uint32_t)cp_meas[MEAS_NB_RX_LIMIT];
+		cp_nb_rx_replay    = (uint32_t)cp_meas[MEAS_NB_RX_REPLAY];
+		cp_nb_rx_forged    = (uint32_t)cp_meas[MEAS_NB_RX_FORGED];
+		cp_nb_rx_ring      = (uint32_t)cp_meas[MEAS_NB_RX_RING];
+		cp_up_pkt_fwd      = (uint32_t)cp_meas[MEAS_UP_PKT_FWD];
+		cp_up_network_byte = cp_meas[MEAS_UP_NETWORK_BYTE];
+		cp_up_payload_byte = cp_meas[MEAS_UP_PAYLOAD_BYTE];
+		cp_up_dgram_sent   = (uint32_t)cp_meas[MEAS_UP_DGRAM_SENT];
+		cp_up_dgram_drop   = (uint32_t)cp_meas[MEAS_UP_DGRAM_DROP];
+		cp_up_ack_rcv      = (uint32_t)cp_meas[MEAS_UP_ACK_RCV];
+		for (k = 0; k < LAT_NB; ++k) {
+			hist_collect(&latency[k], &cp_latency);
+			lat_pct[k][0] = hist_percentile(&cp_latency, 50.0);
+			lat_pct[k][1] = hist_percentile(&cp_latency, 99.0);
+			lat_pct[k][2] = hist_percentile(&cp_latency, 99.9);
+			lat_max[k] = cp_latency.max;
+		}
+		if (fw_stat_reader >= 0) {
+			fw_nb_top = fw_stats(fw_stat_reader, fw_top, FW_STAT_TOP, &fw_nb_dead);
+			fw_reorder(fw_stat_reader); /* most hit filters first for the next interval */
+		}
 		if (cp_nb_rx_rcv > 0) {
 			rx_ok_ratio = (float)cp_nb_rx_ok / (float)cp_nb_rx_rcv;
 			rx_bad_ratio = (float)cp_nb_rx_bad / (float)cp_nb_rx_rcv;
@@ -1347,23 +1698,21 @@ int main(void)
 			up_ack_ratio = 0.0;
 		}
 		
-		/* access downstream statistics, copy and reset them */
-		pthread_mutex_lock(&mx_meas_dw);
-		cp_dw_pull_sent    =  meas_dw_pull_sent;
-		cp_dw_ack_rcv      =  meas_dw_ack_rcv;
-		cp_dw_dgram_rcv    =  meas_dw_dgram_rcv;
-		cp_dw_network_byte =  meas_dw_network_byte;
-		cp_dw_payload_byte =  meas_dw_payload_byte;
-		cp_nb_tx_ok        =  meas_nb_tx_ok;
-		cp_nb_tx_fail      =  meas_nb_tx_fail;
-		meas_dw_pull_sent = 0;
-		meas_dw_ack_rcv = 0;
-		meas_dw_dgram_rcv = 0;
-		meas_dw_network_byte = 0;
-		meas_dw_payload_byte = 0;
-		meas_nb_tx_ok = 0;
-		meas_nb_tx_fail = 0;
-		pthread_mutex_unlock(&mx_meas_dw);
+		/* downstream statistics */
+		cp_dw_pull_sent    = (uint32_t)cp_meas[MEAS_DW_PULL_SENT];
+		cp_dw_ack_rcv      = (uint32_t)cp_meas[MEAS_DW_ACK_RCV];
+		cp_dw_dgram_rcv    = (uint32_t)cp_meas[MEAS_DW_DGRAM_RCV];
+		cp_dw_network_byte = cp_meas[MEAS_DW_NETWORK_BYTE];
+		cp_dw_payload_byte = cp_meas[MEAS_DW_PAYLOAD_BYTE];
+		cp_nb_tx_ok        = (uint32_t)cp_meas[MEAS_NB_TX_OK];
+		cp_nb_tx_fail      = (uint32_t)cp_meas[MEAS_NB_TX_FAIL];
+		cp_nb_tx_fw        = (uint32_t)cp_meas[MEAS_NB_TX_FW];
+		cp_nb_tx_limit     = (uint32_t)cp_meas[MEAS_NB_TX_LIMIT];
+		cp_nb_tx_duty      = (uint32_t)cp_meas[MEAS_NB_TX_DUTY];
+		cp_nb_tx_collision = (uint32_t)cp_meas[MEAS_NB_TX_COLLISION];
+		cp_nb_tx_full      = (uint32_t)cp_meas[MEAS_NB_TX_FULL];
+		cp_nb_tx_late      = (uint32_t)cp_meas[MEAS_NB_TX_LATE];
+		cp_tx_airtime      = cp_meas[MEAS_TX_AIRTIME];
 		if (cp_dw_pull_sent > 0) {
 			dw_ack_ratio = (float)cp_dw_ack_rcv / (float)cp_dw_pull_sent;
 		} else {
@@ -1390,14 +1739,30 @@ int main(void)
 		printf("\n##### %s #####\n", stat_timestamp);
 		printf("# RF packets received by concentrator: %u\n", cp_nb_rx_rcv);
 		printf("# CRC_OK: %.2f%%, CRC_FAIL: %.2f%%, NO_CRC: %.2f%%\n", 100.0 * rx_ok_ratio, 100.0 * rx_bad_ratio, 100.0 * rx_nocrc_ratio);
-		printf("# RF packets forwarded: %u (%u bytes)\n", cp_up_pkt_fwd, cp_up_payload_byte);
-		printf("# PUSH_DATA datagrams sent: %u (%u bytes)\n", cp_up_dgram_sent, cp_up_network_byte);
+		printf("# RF packets dropped by firewall: %u (%u rate limited, %u replayed, %u forged)\n", cp_nb_rx_fw + cp_nb_rx_limit + cp_nb_rx_replay + cp_nb_rx_forged, cp_nb_rx_limit, cp_nb_rx_replay, cp_nb_rx_forged);
+		printf("# RF packets lost, upstream queue full: %u\n", cp_nb_rx_ring);
+		if (fw_stat_reader >= 0) {
+			printf("# Firewall rules never hit: %u\n", fw_nb_dead);
+			for (k = 0; k < fw_nb_top; ++k) {
+				printf("#   rule %s: %u passed, %u dropped\n", fw_top[k].name, fw_top[k].pass, fw_top[k].drop);
+			}
+		}
+		printf("# RF packets forwarded: %u (%llu bytes)\n", cp_up_pkt_fwd, (unsigned long long)cp_up_payload_byte);
+		printf("# PUSH_DATA datagrams sent: %u (%llu bytes)\n", cp_up_dgram_sent, (unsigned long long)cp_up_network_byte);
+		printf("# PUSH_DATA dropped, server queue full: %u\n", cp_up_dgram_drop);
 		printf("# PUSH_DATA acknowledged: %.2f%%\n", 100.0 * up_ack_ratio);
+		for (k = 0; k < LAT_NB; ++k) {
+			printf("# %s latency p50: %.3f ms, p99: %.3f ms, p999: %.3f ms, max: %.3f ms\n", latency_name[k], lat_pct[k][0] / 1000.0, lat_pct[k][1] / 1000.0, lat_pct[k][2] / 1000.0, lat_max[k] / 1000.0);
+		}
 		printf("### [DOWNSTREAM] ###\n");
 		printf("# PULL_DATA sent: %u (%.2f%% acknowledged)\n", cp_dw_pull_sent, 100.0 * dw_ack_ratio);
-		printf("# PULL_RESP(onse) datagrams received: %u (%u bytes)\n", cp_dw_dgram_rcv, cp_dw_network_byte);
-		printf("# RF packets sent to concentrator: %u (%u bytes)\n", (cp_nb_tx_ok+cp_nb_tx_fail), cp_dw_payload_byte);
+		printf("# PULL_RESP(onse) datagrams received: %u (%llu bytes)\n", cp_dw_dgram_rcv, (unsigned long long)cp_dw_network_byte);
+		printf("# RF packets sent to concentrator: %u (%llu bytes)\n", (cp_nb_tx_ok+cp_nb_tx_fail), (unsigned long long)cp_dw_payload_byte);
 		printf("# TX errors: %u\n", cp_nb_tx_fail);
+		printf("# TX rejected by firewall: %u (%u rate limited)\n", cp_nb_tx_fw + cp_nb_tx_limit, cp_nb_tx_limit);
+		printf("# TX rejected by duty-cycle: %u\n", cp_nb_tx_duty);
+		printf("# TX rejected by JIT queue: %u (%u collisions, %u queue full, %u too late)\n", cp_nb_tx_collision + cp_nb_tx_full + cp_nb_tx_late, cp_nb_tx_collision, cp_nb_tx_full, cp_nb_tx_late);
+		printf("# TX airtime: %.3f s (%.2f%% duty-cycle)\n", cp_tx_airtime / 1e6, cp_tx_airtime / (10000.0 * stat_interval));
 		printf("### [GPS] ###\n");
 		//TODO: this is not symmetrical. time can also be derived from other sources, fix
 		if (gps_enabled == true) {
@@ -1421,13 +1786,39 @@ int main(void)
 		
 		/* generate a JSON report (will be sent to server by upstream thread) */
 		if (statusstream_enabled == true) {
+			lat_report_len = snprintf(lat_report, sizeof lat_report, ",\"ltcy\":{");
+			for (k = 0; k < LAT_NB; ++k) {
+				lat_report_len += snprintf(lat_report + lat_report_len, sizeof lat_report - lat_report_len, "%s\"%s\":[%u,%u,%u]", (k > 0) ? "," : "", latency_key[k], lat_pct[k][0], lat_pct[k][1], lat_pct[k][2]);
+			}
+			snprintf(lat_report + lat_report_len, sizeof lat_report - lat_report_len, "}");
 			pthread_mutex_lock(&mx_stat_rep);
 			if ((gps_enabled == true) && (coord_ok == true)) {
-				snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"lati\":%.5f,\"long\":%.5f,\"alti\":%i,\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u,\"pfrm\":\"%s\",\"mail\":\"%s\",\"desc\":\"%s\"}", stat_timestamp, cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok,platform,email,description);
+				status_len = snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"lati\":%.5f,\"long\":%.5f,\"alti\":%i,\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u,\"pfrm\":\"%s\",\"mail\":\"%s\",\"desc\":\"%s\"%s", stat_timestamp, cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok,platform,email,description,lat_report);
+			} else {
+				status_len = snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u,\"pfrm\":\"%s\",\"mail\":\"%s\",\"desc\":\"%s\"%s", stat_timestamp, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok,platform,email,description,lat_report);
+			}
+			if ((status_len < 0) || (status_len + 1 >= STATUS_SIZE)) {
+				MSG("WARNING: [main] status report too long, not sent\n");
 			} else {
-				snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u,\"pfrm\":\"%s\",\"mail\":\"%s\",\"desc\":\"%s\"}", stat_timestamp, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok,platform,email,description);
+				/* firewall rules, most hit first, the least hit are left out if the report would not fit with its closing braces */
+				if (fw_stat_reader >= 0) {
+					fw_entry_len = snprintf(fw_entry, sizeof fw_entry, ",\"fwdr\":%u,\"fwhr\":{", fw_nb_dead);
+					if (status_len + fw_entry_len + 2 < STATUS_SIZE) {
+						memcpy(status_report + status_len, fw_entry, fw_entry_len);
+						status_len += fw_entry_len;
+						for (k = 0; k < fw_nb_top; ++k) {
+							fw_entry_len = snprintf(fw_entry, sizeof fw_entry, "%s\"%s\":[%u,%u]", (k > 0) ? "," : "", fw_top[k].name, fw_top[k].pass, fw_top[k].drop);
+							if (status_len + fw_entry_len + 2 >= STATUS_SIZE) break;
+							memcpy(status_report + status_len, fw_entry, fw_entry_len);
+							status_len += fw_entry_len;
+						}
+						status_report[status_len++] = '}';
+					}
+				}
+				status_report[status_len++] = '}';
+				status_report[status_len] = 0;
+				report_ready = true;
 			}
-			report_ready = true;
 			pthread_mutex_unlock(&mx_stat_rep);
 		}
 
@@ -1441,17 +1832,29 @@ int main(void)
 		pthread_mutex_unlock(&mx_concent);
 	}
 	
-	/* wait for upstream thread to finish (1 fetch cycle max) */
-	if (upstream_enabled == true) pthread_join(thrid_up, NULL);
+	/* wait for upstream threads to finish (1 fetch cycle max) */
+	if (upstream_enabled == true) {
+		pthread_join(thrid_fetch, NULL);
+		pthread_join(thrid_up, NULL);
+		pthread_join(thrid_ack, NULL);
+		for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
+			pthread_join(thrid_push[ic], NULL);
+			ringbuf_free(up_queue[ic]);
+			sem_destroy(&up_queue_sem[ic]);
+		}
+		ringbuf_free(rx_ring);
+		sem_destroy(&rx_ring_sem);
+	}
 	if (downstream_enabled == true) {
-		for (ic = 0; ic < serv_count; ic++)
-			if (serv_live[ic] == true)
-				pthread_join(thrid_down[ic], NULL);
+		pthread_join(thrid_down, NULL);
 	}
 	if (ghoststream_enabled == true) ghost_stop();
 	if (monitor_enabled == true) monitor_stop();
+	if (firewall_enabled == true) fw_stop();
+	if ((gps_active == true) && (beacon_enabled == true)) pthread_join(thrid_beacon, NULL);
 	if (gps_active == true) pthread_cancel(thrid_gps);   /* don't wait for GPS thread */
 	if (gps_active == true) pthread_cancel(thrid_valid); /* don't wait for validation thread */
+	log_stop();
 	
 	/* if an exit signal was received, try to quit properly */
 	if (exit_sig) {
@@ -1475,6 +1878,70 @@ int main(void)
 	exit(EXIT_SUCCESS);
 }
 
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 0: FETCHING PACKETS FROM THE CONCENTRATOR --------------------- */
+
+void thread_fetch(void) {
+	int i; /* loop variable */
+	struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX]; /* array containing inbound packets + metadata */
+	struct rx_record *rec; /* free slot of the upstream queue */
+	struct timespec fetch_time;
+	uint32_t fetch_us; /* monotonic time of the fetch */
+	int nb_pkt;
+	
+	LOG(LOG_LVL_INFO, "INFO: [fetch] Thread activated.\n");
+	
+	while (!exit_sig && !quit_sig) {
+		/* fetch packets */
+		pthread_mutex_lock(&mx_concent);
+		if (radiostream_enabled == true) {
+			fetch_us = mono_us();
+			nb_pkt = lgw_receive(NB_PKT_MAX, rxpkt);
+			hist_record(&latency[LAT_RECEIVE], mono_us() - fetch_us);
+		} else {
+			nb_pkt = 0;
+		}
+		if (nb_pkt == LGW_HAL_ERROR) {
+			pthread_mutex_unlock(&mx_concent);
+			LOG(LOG_LVL_ERROR, "ERROR: [fetch] failed packet fetch, exiting\n");
+			exit(EXIT_FAILURE);
+		}
+		fetch_us = mono_us();
+		if (nb_pkt > 0) {
+			/* latest counter value known, for the downlink scheduler */
+			__atomic_store_n(&concent_ref, ((uint64_t)rxpkt[nb_pkt-1].count_us << 32) | fetch_us, __ATOMIC_RELAXED);
+		}
+		if (ghoststream_enabled == true) nb_pkt = ghost_get(NB_PKT_MAX-nb_pkt, &rxpkt[nb_pkt]) + nb_pkt;
+		pthread_mutex_unlock(&mx_concent);
+		
+		/* wait a short time if no packets */
+		if (nb_pkt == 0) {
+			wait_ms(FETCH_SLEEP_MS);
+			continue;
+		}
+		
+		/* queue the packets for the upstream thread, never wait for it */
+		clock_gettime(CLOCK_REALTIME, &fetch_time);
+		for (i = 0; i < nb_pkt; ++i) {
+			rec = ringbuf_slot_write(rx_ring);
+			if (rec == NULL) {
+				break;
+			}
+			rec->pkt = rxpkt[i];
+			rec->fetch_time = fetch_time;
+			rec->fetch_us = fetch_us;
+			ringbuf_commit(rx_ring);
+		}
+		sem_post(&rx_ring_sem);
+		if (i < nb_pkt) {
+			meas_add(MEAS_FETCH, MEAS_NB_RX_RING, nb_pkt - i);
+			LOG(LOG_LVL_WARNING, "WARNING: [fetch] upstream queue full, %i packets lost\n", nb_pkt - i);
+		}
+	}
+	sem_post(&rx_ring_sem);
+	LOG(LOG_LVL_INFO, "\nINFO: End of fetch thread\n");
+}
+
 /* -------------------------------------------------------------------------- */
 /* --- THREAD 1: RECEIVING PACKETS AND FORWARDING THEM ---------------------- */
 
@@ -1482,42 +1949,26 @@ void thread_up(void) {
 	int i, j; /* loop variables */
 	int ic; /* Server Loop Variable */
 	unsigned pkt_in_dgram; /* nb on Lora packet in the current datagram */
-	/* allocate memory for packet fetching and processing */
-	struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX]; /* array containing inbound packets + metadata */
+	/* packets queued by the fetch thread */
+	struct rx_record *rec;
 	struct lgw_pkt_rx_s *p; /* pointer on a RX packet */
 	int nb_pkt;
-	//device address
-	uint8_t deviceaddr[4];
-	/*char*  addDevices[5];
-	int numAddr = 0;
-	int l = 0;
-	char deviceaddr[4];
-	//int g = 0;
-	char line[50];
-	//arquivo
-	FILE *arq;
-	//abrir o arquivo
-	if ( !(arq = fopen("/etc/firewallLora/hosts_denied", "r")))
-		printf("deu ruim");
-	else{
-
-		while (fgets(line, sizeof line, arq) != NULL)
-		{
-			addDevices[l] = strdup(line);
-			l++;
-		 	numAddr++;
-		}
-		
-    	fclose(arq);
-	}*/
-	//setando endereco
-	deviceaddr[0] = 0x26;
-	deviceaddr[1] = 0x03;	
-	deviceaddr[2] = 0x1C;
-	deviceaddr[3] = 0x2C;
+	
+	/* firewall rules, only valid during the filtering of a fetch cycle */
+	const struct fw_table * fw_rules;
+	int fw_reader = -1;
+	struct fw_limiter * fw_limiter = NULL; /* token buckets, only used by this thread */
+	struct fw_replay * fw_replay = NULL; /* frame counters, only used by this thread */
+	uint32_t fw_now_ms; /* monotonic time of the fetch, for the token buckets */
+	
+	/* latency measurement variables */
+	uint32_t start_us; /* start of the filtering and serialization of a datagram */
+	uint32_t pkt_us; /* start of the serialization of a packet */
+	uint32_t ser_us; /* time spent serializing the packets of a datagram */
 	
 	/* local timestamp variables until we get accurate GPS time */
-	struct timespec fetch_time;
+	struct timespec fetch_time = {0, 0}; /* fetch time of the packet whose time is in fetch_timestamp */
+	struct timespec fetch_mono;
 	struct tm * x1;
 	char fetch_timestamp[28]; /* timestamp as a text string */
 
@@ -1528,15 +1979,13 @@ void thread_up(void) {
 	/* data buffers */
 	uint8_t buff_up[TX_BUFF_SIZE]; /* buffer to compose the upstream packet */
 	int buff_index;
-	uint8_t buff_ack[32]; /* buffer to receive acknowledges */
 	
 	/* protocol variables */
 	uint8_t token_h; /* random token for acknowledgement matching */
 	uint8_t token_l; /* random token for acknowledgement matching */
-	
-	/* ping measurement variables */
-	struct timespec send_time;
-	struct timespec recv_time;
+	struct up_dgram *dgram; /* free slot of a server queue */
+	unsigned nb_drop; /* number of servers the datagram could not be queued for */
+	uint32_t queued_us;
 	
 	/* GPS synchronization variables */
 	struct timespec pkt_utc_time;
@@ -1545,18 +1994,28 @@ void thread_up(void) {
 	/* report management variable */
 	bool send_report = false;
 	
-	MSG("INFO: [up] Thread activated for all servers.\n");
-	MSG("INFO: [up] >> OLA POLY <<.\n");
-
-	/* set upstream socket RX timeout */
-	for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
-		i = setsockopt(sock_up[ic], SOL_SOCKET, SO_RCVTIMEO, (void *)&push_timeout_half, sizeof push_timeout_half);
-		if (i != 0) {
-			MSG("ERROR: [up] setsockopt for server %s returned %s\n", serv_addr[ic], strerror(errno));
+	LOG(LOG_LVL_INFO, "INFO: [up] Thread activated for all servers.\n");
+	LOG(LOG_LVL_INFO, "INFO: [up] >> OLA POLY <<.\n");
+	
+	/* register as reader of the firewall rules */
+	if (firewall_enabled == true) {
+		fw_reader = fw_reader_register();
+		if (fw_reader < 0) {
+			LOG(LOG_LVL_ERROR, "ERROR: [up] failed to register as firewall reader\n");
+			exit(EXIT_FAILURE);
+		}
+		fw_limiter = fw_limiter_new(FW_LIMIT_DEVICES);
+		if (fw_limiter == NULL) {
+			LOG(LOG_LVL_ERROR, "ERROR: [up] failed to allocate firewall rate limiter\n");
+			exit(EXIT_FAILURE);
+		}
+		fw_replay = fw_replay_new(FW_REPLAY_DEVICES);
+		if (fw_replay == NULL) {
+			LOG(LOG_LVL_ERROR, "ERROR: [up] failed to allocate firewall replay filter\n");
 			exit(EXIT_FAILURE);
 		}
 	}
-	
+
 	/* pre-fill the data buffer with fixed fields */
 	buff_up[0] = PROTOCOL_VERSION;
 	buff_up[3] = PKT_PUSH_DATA;
@@ -1566,27 +2025,17 @@ void thread_up(void) {
 
 	while (!exit_sig && !quit_sig) {
 
-	
-		/* fetch packets */
-		pthread_mutex_lock(&mx_concent);
-		if (radiostream_enabled == true) nb_pkt = lgw_receive(NB_PKT_MAX, rxpkt); else nb_pkt = 0;
-		if (ghoststream_enabled == true) nb_pkt = ghost_get(NB_PKT_MAX-nb_pkt, &rxpkt[nb_pkt]) + nb_pkt;
-
-
-        //TODO this test should in fact be before the ghost packets are collected.
-		pthread_mutex_unlock(&mx_concent);
-		if (nb_pkt == LGW_HAL_ERROR) {
-			MSG("ERROR: [up] failed packet fetch, exiting\n");
-			exit(EXIT_FAILURE);
-		} 
+		/* get the packets queued by the fetch thread */
+		nb_pkt = (int)ringbuf_count(rx_ring);
+		if (nb_pkt > NB_PKT_MAX) nb_pkt = NB_PKT_MAX;
 		
 		/* check if there are status report to send */
 		send_report = report_ready; /* copy the variable so it doesn't change mid-function */
 		/* no mutex, we're only reading */
 		
-		/* wait a short time if no packets, nor status report */
+		/* wait for packets, or a short time for a status report */
 		if ((nb_pkt == 0) && (send_report == false)) {
-			wait_ms(FETCH_SLEEP_MS);
+			sem_wait_us(&rx_ring_sem, 1000 * FETCH_SLEEP_MS);
 			continue;
 		}
 		
@@ -1601,10 +2050,6 @@ void thread_up(void) {
 			ref_ok = false;
 		}
 		
-		/* local timestamp generation until we get accurate GPS time */
-		clock_gettime(CLOCK_REALTIME, &fetch_time);
-		x1 = gmtime(&(fetch_time.tv_sec)); /* split the UNIX timestamp to its calendar components */
-		snprintf(fetch_timestamp, sizeof fetch_timestamp, "%04i-%02i-%02iT%02i:%02i:%02i.%06liZ", (x1->tm_year)+1900, (x1->tm_mon)+1, x1->tm_mday, x1->tm_hour, x1->tm_min, x1->tm_sec, (fetch_time.tv_nsec)/1000); /* ISO 8601 format */
 
 		/* start composing datagram with the header */
 		token_h = (uint8_t)rand(); /* random token */
@@ -1619,61 +2064,72 @@ void thread_up(void) {
 		
 		/* serialize Lora packets metadata and payload */
 		pkt_in_dgram = 0;
-		//teste
+		clock_gettime(CLOCK_MONOTONIC, &fetch_mono);
+		fw_now_ms = (uint32_t)(fetch_mono.tv_sec * 1000 + fetch_mono.tv_nsec / 1000000);
+		start_us = mono_us();
+		ser_us = 0;
+		fw_rules = (fw_reader >= 0) ? fw_acquire(fw_reader) : NULL; /* rules cannot be freed until fw_release */
 		for (i=0; i < nb_pkt; ++i) {
-			p = &rxpkt[i];
-			//PACOTE
-			/*if(deviceaddr[0] == p->payload[4] && deviceaddr[1] == p->payload[3] && deviceaddr[2] == p->payload[2] && deviceaddr[3] == p->payload[1]){
-			printf("deu bom xD \n");
-			break;
-			}
-			*/	
-			/*int resul = strcmp("True", addDevices[0]);
-
-			printf("%c", resul);
-			
-			printf("\n\n"); 
-			printf("DEVICE ADR -> ");
-			printf("%X ", p->payload[4]);
-			printf("%X ", p->payload[3]);
-			printf("%X ", p->payload[2]);
-			printf("%X ", p->payload[1]);	
-			*/	
+			rec = ringbuf_slot_read(rx_ring, i);
+			p = &rec->pkt;
+			hist_record(&latency[LAT_QUEUE], start_us - rec->fetch_us);
 			
 			/* basic packet filtering */
-			pthread_mutex_lock(&mx_meas_up);
-			meas_nb_rx_rcv += 1;
+			meas_add(MEAS_UP, MEAS_NB_RX_RCV, 1);
 			switch(p->status) {
 				case STAT_CRC_OK:
-					meas_nb_rx_ok += 1;
+					meas_add(MEAS_UP, MEAS_NB_RX_OK, 1);
 					if (!fwd_valid_pkt) {
-						pthread_mutex_unlock(&mx_meas_up);
 						continue; /* skip that packet */
 					}
 					break;
 				case STAT_CRC_BAD:
-					meas_nb_rx_bad += 1;
+					meas_add(MEAS_UP, MEAS_NB_RX_BAD, 1);
 					if (!fwd_error_pkt) {
-						pthread_mutex_unlock(&mx_meas_up);
 						continue; /* skip that packet */
 					}
 					break;
 				case STAT_NO_CRC:
-					meas_nb_rx_nocrc += 1;
+					meas_add(MEAS_UP, MEAS_NB_RX_NOCRC, 1);
 					if (!fwd_nocrc_pkt) {
-						pthread_mutex_unlock(&mx_meas_up);
 						continue; /* skip that packet */
 					}
 					break;
 				default:
-					MSG("WARNING: [up] received packet with unknown status %u (size %u, modulation %u, BW %u, DR %u, RSSI %.1f)\n", p->status, p->size, p->modulation, p->bandwidth, p->datarate, p->rssi);
-					pthread_mutex_unlock(&mx_meas_up);
+					LOG(LOG_LVL_WARNING, "WARNING: [up] received packet with unknown status %u (size %u, modulation %u, BW %u, DR %u, RSSI %.1f)\n", p->status, p->size, p->modulation, p->bandwidth, p->datarate, p->rssi);
 					continue; /* skip that packet */
 					// exit(EXIT_FAILURE);
 			}
-			meas_up_pkt_fwd += 1;
-			meas_up_payload_byte += p->size;
-			pthread_mutex_unlock(&mx_meas_up);
+			
+			/* firewall filtering, before any serialization work */
+			if (fw_rules != NULL) {
+				/* MIC and frame counter first, forged or replayed frames must not take tokens nor hit rules */
+				/* (both are meaningless in a corrupted frame) */
+				if (p->status == STAT_CRC_OK) {
+					j = fw_check_mic(fw_rules, p);
+					if (j == FW_FORGED) {
+						meas_add(MEAS_UP, MEAS_NB_RX_FORGED, 1);
+						continue; /* skip that packet */
+					}
+					if (fw_check_replay(fw_replay, p, fw_now_ms, j == FW_VERIFIED) == FW_REPLAY) {
+						meas_add(MEAS_UP, MEAS_NB_RX_REPLAY, 1);
+						continue; /* skip that packet */
+					}
+				}
+				switch (fw_check_rxpkt(fw_rules, fw_limiter, p, fw_now_ms)) {
+					case FW_PASS:
+						break;
+					case FW_LIMITED:
+						meas_add(MEAS_UP, MEAS_NB_RX_LIMIT, 1);
+						continue; /* skip that packet */
+					default:
+						meas_add(MEAS_UP, MEAS_NB_RX_FW, 1);
+						continue; /* skip that packet */
+				}
+			}
+			meas_add(MEAS_UP, MEAS_UP_PKT_FWD, 1);
+			meas_add(MEAS_UP, MEAS_UP_PAYLOAD_BYTE, p->size);
+			pkt_us = mono_us();
 			
 			/* Start of packet, add inter-packet separator if necessary */
 			if (pkt_in_dgram == 0) {
@@ -1686,13 +2142,7 @@ void thread_up(void) {
 			}
 			
 			/* RAW timestamp, 8-17 useful chars */
-			j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, "\"tmst\":%u", p->count_us);
-			if (j > 0) {
-				buff_index += j;
-			} else {
-				MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-				exit(EXIT_FAILURE);
-			}
+			buff_index += rxpk_tmst((char *)(buff_up + buff_index), p->count_us);
 
 			/* Packet RX time (GPS based), 37 useful chars */
 			//TODO: From the block below only one can be exectuted, decide on the presence of GPS.
@@ -1704,179 +2154,42 @@ void thread_up(void) {
 					if (j == LGW_GPS_SUCCESS) {
 						/* split the UNIX timestamp to its calendar components */
 						x = gmtime(&(pkt_utc_time.tv_sec));
-						j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (pkt_utc_time.tv_nsec)/1000); /* ISO 8601 format */
-						if (j > 0) {
-							buff_index += j;
-						} else {
-							MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-							exit(EXIT_FAILURE);
-						}
+						memcpy((void *)(buff_up + buff_index), (void *)",\"time\":\"", 9);
+						buff_index += 9;
+						buff_index += rxpk_time((char *)(buff_up + buff_index), x, (pkt_utc_time.tv_nsec)/1000); /* ISO 8601 format */
+						buff_up[buff_index] = '"';
+						++buff_index;
 					}
 				}
 			} else {
+				/* local timestamp generation until we get accurate GPS time, once per fetch */
+				if ((rec->fetch_time.tv_sec != fetch_time.tv_sec) || (rec->fetch_time.tv_nsec != fetch_time.tv_nsec)) {
+					fetch_time = rec->fetch_time;
+					x1 = gmtime(&(fetch_time.tv_sec)); /* split the UNIX timestamp to its calendar components */
+					fetch_timestamp[rxpk_time(fetch_timestamp, x1, (fetch_time.tv_nsec)/1000)] = 0; /* ISO 8601 format */
+				}
 				memcpy((void *)(buff_up + buff_index), (void *)",\"time\":\"???????????????????????????\"", 37);
 				memcpy((void *)(buff_up + buff_index + 9), (void *)fetch_timestamp, 27);
 				buff_index += 37;
 			}
 			
-			/* Packet concentrator channel, RF chain & RX frequency, 34-36 useful chars */
-			j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
-			if (j > 0) {
-				buff_index += j;
-			} else {
-				MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-				exit(EXIT_FAILURE);
-			}
-			
-			/* Packet status, 9-10 useful chars */
-			switch (p->status) {
-				case STAT_CRC_OK:
-					memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
-					buff_index += 9;
-					break;
-				case STAT_CRC_BAD:
-					memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":-1", 10);
-					buff_index += 10;
-					break;
-				case STAT_NO_CRC:
-					memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":0", 9);
-					buff_index += 9;
-					break;
-				default:
-					MSG("ERROR: [up] received packet with unknown status\n");
-					memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":?", 9);
-					buff_index += 9;
-					exit(EXIT_FAILURE);
-			}
-			
-			/* Packet modulation, 13-14 useful chars */
-			if (p->modulation == MOD_LORA) {
-				memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
-				buff_index += 14;
-				
-				/* Lora datarate & bandwidth, 16-19 useful chars */
-				switch (p->datarate) {
-					case DR_LORA_SF7:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12);
-						buff_index += 12;
-						break;
-					case DR_LORA_SF8:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12);
-						buff_index += 12;
-						break;
-					case DR_LORA_SF9:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12);
-						buff_index += 12;
-						break;
-					case DR_LORA_SF10:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13);
-						buff_index += 13;
-						break;
-					case DR_LORA_SF11:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13);
-						buff_index += 13;
-						break;
-					case DR_LORA_SF12:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13);
-						buff_index += 13;
-						break;
-					default:
-						MSG("ERROR: [up] lora packet with unknown datarate\n");
-						memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF?", 12);
-						buff_index += 12;
-						exit(EXIT_FAILURE);
-				}
-				switch (p->bandwidth) {
-					case BW_125KHZ:
-						memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
-						buff_index += 6;
-						break;
-					case BW_250KHZ:
-						memcpy((void *)(buff_up + buff_index), (void *)"BW250\"", 6);
-						buff_index += 6;
-						break;
-					case BW_500KHZ:
-						memcpy((void *)(buff_up + buff_index), (void *)"BW500\"", 6);
-						buff_index += 6;
-						break;
-					default:
-						MSG("ERROR: [up] lora packet with unknown bandwidth\n");
-						memcpy((void *)(buff_up + buff_index), (void *)"BW?\"", 4);
-						buff_index += 4;
-						exit(EXIT_FAILURE);
-				}
-				
-				/* Packet ECC coding rate, 11-13 useful chars */
-				switch (p->coderate) {
-					case CR_LORA_4_5:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
-						buff_index += 13;
-						break;
-					case CR_LORA_4_6:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/6\"", 13);
-						buff_index += 13;
-						break;
-					case CR_LORA_4_7:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/7\"", 13);
-						buff_index += 13;
-						break;
-					case CR_LORA_4_8:
-						memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/8\"", 13);
-						buff_index += 13;
-						break;
-					case 0: /* treat the CR0 case (mostly false sync) */
-						memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"OFF\"", 13);
-						buff_index += 13;
-						break;
-					default:
-						MSG("ERROR: [up] lora packet with unknown coderate\n");
-						memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"?\"", 11);
-						buff_index += 11;
-						exit(EXIT_FAILURE);
-				}
-				
-				/* Lora SNR, 11-13 useful chars */
-				j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"lsnr\":%.1f", p->snr);
-				if (j > 0) {
-					buff_index += j;
-				} else {
-					MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-					exit(EXIT_FAILURE);
-				}
-			} else if (p->modulation == MOD_FSK) {
-				memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"FSK\"", 13);
-				buff_index += 13;
-				
-				/* FSK datarate, 11-14 useful chars */
-				j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"datr\":%u", p->datarate);
-				if (j > 0) {
-					buff_index += j;
-				} else {
-					MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-					exit(EXIT_FAILURE);
-				}
-			} else {
-				MSG("ERROR: [up] received packet with unknown modulation\n");
-				exit(EXIT_FAILURE);
-			}
-			
-			/* Packet RSSI, payload size, 18-23 useful chars */
-			j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"rssi\":%.0f,\"size\":%u", p->rssi, p->size);
+			/* Packet channel, RF chain, frequency, status, modulation, datarate, coderate, SNR, RSSI and size, 100-130 useful chars */
+			j = rxpk_meta((char *)(buff_up + buff_index), p);
 			if (j > 0) {
 				buff_index += j;
 			} else {
-				MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+				LOG(LOG_LVL_ERROR, "ERROR: [up] received packet with unknown status, modulation, datarate, bandwidth or coderate\n");
 				exit(EXIT_FAILURE);
 			}
 			
 			/* Packet base64-encoded payload, 14-350 useful chars */
 			memcpy((void *)(buff_up + buff_index), (void *)",\"data\":\"", 9);
 			buff_index += 9;
-			j = bin_to_b64(p->payload, p->size, (char *)(buff_up + buff_index), 341); /* 255 bytes = 340 chars in b64 + null char */
+			j = bin_to_b64_simd(p->payload, p->size, (char *)(buff_up + buff_index), 341); /* 255 bytes = 340 chars in b64 + null char */
 			if (j>=0) {
 				buff_index += j;
 			} else {
-				MSG("ERROR: [up] bin_to_b64 failed line %u\n", (__LINE__ - 5));
+				LOG(LOG_LVL_ERROR, "ERROR: [up] bin_to_b64 failed line %u\n", (__LINE__ - 5));
 				exit(EXIT_FAILURE);
 			}
 			buff_up[buff_index] = '"';
@@ -1886,7 +2199,16 @@ void thread_up(void) {
 			buff_up[buff_index] = '}';
 			++buff_index;
 			++pkt_in_dgram;
+			ser_us += mono_us() - pkt_us;
+		}
+		if (fw_reader >= 0) fw_release(fw_reader);
+		if (nb_pkt > 0) {
+			hist_record(&latency[LAT_FILTER], mono_us() - start_us - ser_us);
+		}
+		if (pkt_in_dgram > 0) {
+			hist_record(&latency[LAT_SERIALIZE], ser_us);
 		}
+		ringbuf_release(rx_ring, nb_pkt); /* packets are serialized, the fetch thread can reuse their slots */
 		
 		/* restart fetch sequence without sending empty JSON if all packets have been filtered out */
 		if (pkt_in_dgram == 0) {
@@ -1917,7 +2239,7 @@ void thread_up(void) {
 			if (j > 0) {
 				buff_index += j;
 			} else {
-				MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 5));
+				LOG(LOG_LVL_ERROR, "ERROR: [up] snprintf failed line %u\n", (__LINE__ - 5));
 				exit(EXIT_FAILURE);
 			}
 		}
@@ -1930,595 +2252,570 @@ void thread_up(void) {
 		// descomentei	
 		//printf("\nJSON up: %s\n", (char *)(buff_up + 12)); /* DEBUG: display JSON payload */
 		
-		/* send datagram to servers sequentially */
-		// TODO make this parallel.
+		/* queue datagram for all servers, a server that can't keep up only loses its own datagrams */
+		nb_drop = 0;
+		queued_us = mono_us();
 		for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
-
-			send(sock_up[ic], (void *)buff_up, buff_index, 0);
-			clock_gettime(CLOCK_MONOTONIC, &send_time);
-			pthread_mutex_lock(&mx_meas_up);
-			meas_up_dgram_sent += 1;
-			meas_up_network_byte += buff_index;
-
-			/* wait for acknowledge (in 2 times, to catch extra packets) */
-			for (i=0; i<2; ++i) {
-				j = recv(sock_up[ic], (void *)buff_ack, sizeof buff_ack, 0);
-				clock_gettime(CLOCK_MONOTONIC, &recv_time);
-				if (j == -1) {
-					if (errno == EAGAIN) { /* timeout */
-						continue;
-					} else { /* server connection error */
-						break;
-					}
-				} else if ((j < 4) || (buff_ack[0] != PROTOCOL_VERSION) || (buff_ack[3] != PKT_PUSH_ACK)) {
-					//MSG("WARNING: [up] ignored invalid non-ACL packet\n");
-					continue;
-				} else if ((buff_ack[1] != token_h) || (buff_ack[2] != token_l)) {
-					//MSG("WARNING: [up] ignored out-of sync ACK packet\n");
-					continue;
-				} else {
-					//TODO: This may generate a lot of logdata, see other todo for a solution.
-					MSG("INFO: [up] PUSH_ACK for server %s received in %i ms\n", serv_addr[ic], (int)(1000 * difftimespec(recv_time, send_time)));
-					meas_up_ack_rcv += 1;
-					break;
-				}
+			dgram = ringbuf_slot_write(up_queue[ic]);
+			if (dgram == NULL) {
+				++nb_drop;
+				continue;
 			}
-			pthread_mutex_unlock(&mx_meas_up);
+			dgram->size = buff_index;
+			dgram->queued_us = queued_us;
+			memcpy(dgram->buff, buff_up, buff_index);
+			ringbuf_commit(up_queue[ic]);
+			sem_post(&up_queue_sem[ic]);
+		}
+		if (nb_drop > 0) {
+			meas_add(MEAS_UP, MEAS_UP_DGRAM_DROP, nb_drop);
 		}
 	}
-	MSG("\nINFO: End of upstream thread\n");
+	fw_limiter_free(fw_limiter);
+	fw_replay_free(fw_replay);
+	LOG(LOG_LVL_INFO, "\nINFO: End of upstream thread\n");
 }
 
 /* -------------------------------------------------------------------------- */
-/* --- THREAD 2: POLLING SERVER AND EMITTING PACKETS ------------------------ */
+/* --- THREAD 1 TER: SENDING QUEUED DATAGRAMS TO ONE SERVER ----------------- */
 
-// TODO: factor this out and inspect the use of global variables. (Cause this is started for each server)
-
-void thread_down(void* pic) {
-	int i; /* loop variables */
+void thread_push(void* pic) {
+	int i, j; /* loop variables */
 	int ic = (int) (long) pic;
+	struct up_dgram *dgram;
+	struct mmsghdr msgs[UP_QUEUE_SIZE]; /* one system call for all the queued datagrams */
+	struct iovec iov[UP_QUEUE_SIZE];
+	int nb_dgram;
+	uint32_t nb_byte;
+	uint32_t age;
+	uint32_t now;
+	unsigned inflight_next = 0; /* next in-flight table entry to fill */
 	
-	/* configuration and metadata for an outbound packet */
-	struct lgw_pkt_tx_s txpkt;
-	bool sent_immediate = false; /* option to sent the packet immediately */
-	
-	/* local timekeeping variables */
-	struct timespec send_time; /* time of the pull request */
-	struct timespec recv_time; /* time of return from recv socket call */
+	memset(msgs, 0, sizeof msgs);
+	for (i = 0; i < UP_QUEUE_SIZE; ++i) {
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 	
-	/* data buffers */
-	uint8_t buff_down[1000]; /* buffer to receive downstream packets */
-	uint8_t buff_req[12]; /* buffer to compose pull requests */
-	int msg_len;
+	while (!exit_sig && !quit_sig) {
+		nb_dgram = (int)ringbuf_count(up_queue[ic]);
+		if (nb_dgram == 0) {
+			sem_wait_us(&up_queue_sem[ic], 1000 * FETCH_SLEEP_MS);
+			continue;
+		}
+		/* hold a partial batch until its oldest datagram has waited push_batch_us */
+		if ((nb_dgram < UP_QUEUE_SIZE) && (push_batch_us > 0)) {
+			dgram = ringbuf_slot_read(up_queue[ic], 0);
+			age = mono_us() - dgram->queued_us;
+			if (age < push_batch_us) {
+				sem_wait_us(&up_queue_sem[ic], push_batch_us - age);
+				continue;
+			}
+		}
+		
+		/* register the tokens before sending, an ACK may come back before sendmmsg returns */
+		/* an entry still in use after INFLIGHT_SIZE datagrams is overwritten, counted as not acknowledged */
+		nb_byte = 0;
+		for (i = 0; i < nb_dgram; ++i) {
+			dgram = ringbuf_slot_read(up_queue[ic], i);
+			iov[i].iov_base = dgram->buff;
+			iov[i].iov_len = dgram->size;
+			nb_byte += dgram->size;
+			__atomic_store_n(&inflight[ic][inflight_next], INFLIGHT_USED | ((uint64_t)dgram->buff[1] << 40) | ((uint64_t)dgram->buff[2] << 32) | mono_us(), __ATOMIC_RELEASE);
+			inflight_next = (inflight_next + 1) & (INFLIGHT_SIZE - 1);
+		}
+		/* a datagram refused by the socket is skipped, like a failed send */
+		for (i = 0; i < nb_dgram; i += (j > 0) ? j : 1) {
+			j = sendmmsg(sock_up[ic], msgs + i, nb_dgram - i, 0);
+		}
+		now = mono_us();
+		for (i = 0; i < nb_dgram; ++i) {
+			dgram = ringbuf_slot_read(up_queue[ic], i);
+			hist_record(&latency[LAT_SEND], now - dgram->queued_us);
+		}
+		
+		meas_add(MEAS_PUSH + ic, MEAS_UP_DGRAM_SENT, nb_dgram);
+		meas_add(MEAS_PUSH + ic, MEAS_UP_NETWORK_BYTE, nb_byte);
+		ringbuf_release(up_queue[ic], nb_dgram);
+	}
+	LOG(LOG_LVL_INFO, "\nINFO: End of push thread for server %s\n", serv_addr[ic]);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 1 BIS: MATCHING PUSH_ACK WITH THE DATAGRAMS IN FLIGHT --------- */
+
+void thread_ack(void) {
+	int i, j, k, m; /* loop variables */
+	int ic; /* server index */
+	int ep; /* epoll instance watching all upstream sockets */
+	struct epoll_event ev;
+	struct epoll_event events[MAX_SERVERS];
+	int nb_ev;
+	struct mmsghdr msgs[ACK_BATCH]; /* several ACK read per system call */
+	struct iovec iov[ACK_BATCH];
+	uint8_t buff_ack[ACK_BATCH][32]; /* buffers to receive acknowledges */
+	uint8_t *ack;
+	int nb_ack;
+	uint64_t entry;
+	uint32_t now;
+	uint32_t rtt;
+	
+	memset(msgs, 0, sizeof msgs);
+	for (m = 0; m < ACK_BATCH; ++m) {
+		iov[m].iov_base = buff_ack[m];
+		iov[m].iov_len = sizeof buff_ack[m];
+		msgs[m].msg_hdr.msg_iov = &iov[m];
+		msgs[m].msg_hdr.msg_iovlen = 1;
+	}
+	
+	ep = epoll_create1(0);
+	if (ep == -1) {
+		LOG(LOG_LVL_ERROR, "ERROR: [ack] epoll_create1 returned %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
+		ev.events = EPOLLIN;
+		ev.data.u32 = ic;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, sock_up[ic], &ev) == -1) {
+			LOG(LOG_LVL_ERROR, "ERROR: [ack] epoll_ctl for server %s returned %s\n", serv_addr[ic], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
 	
-	/* protocol variables */
-	uint8_t token_h; /* random token for acknowledgement matching */
-	uint8_t token_l; /* random token for acknowledgement matching */
-	bool req_ack = false; /* keep track of whether PULL_DATA was acknowledged or not */
+	while (!exit_sig && !quit_sig) {
+		/* wake up at least twice per time-out to expire entries and check the exit flags */
+		nb_ev = epoll_wait(ep, events, MAX_SERVERS, (push_timeout_ms > 1) ? push_timeout_ms / 2 : 1);
+		for (k = 0; k < nb_ev; ++k) {
+			ic = events[k].data.u32;
+			/* drain the socket, several ACK may be pending */
+			do {
+				nb_ack = recvmmsg(sock_up[ic], msgs, ACK_BATCH, MSG_DONTWAIT, NULL);
+				if (nb_ack > 0) now = mono_us();
+				for (m = 0; m < nb_ack; ++m) {
+					j = (int)msgs[m].msg_len;
+					ack = buff_ack[m];
+					if ((j < 4) || (ack[0] != PROTOCOL_VERSION) || (ack[3] != PKT_PUSH_ACK)) {
+						//MSG("WARNING: [ack] ignored invalid non-ACL packet\n");
+						continue;
+					}
+					for (i = 0; i < INFLIGHT_SIZE; ++i) {
+						entry = __atomic_load_n(&inflight[ic][i], __ATOMIC_ACQUIRE);
+						if ((entry & ~(uint64_t)0xFFFFFFFF) != (INFLIGHT_USED | ((uint64_t)ack[1] << 40) | ((uint64_t)ack[2] << 32))) continue;
+						/* the push thread may reuse the entry meanwhile, only one of us wins */
+						if (!__atomic_compare_exchange_n(&inflight[ic][i], &entry, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+						rtt = now - (uint32_t)entry;
+						if (rtt <= 1000 * push_timeout_ms) {
+							hist_record(&latency[LAT_ACK], rtt);
+							meas_add(MEAS_ACK, MEAS_UP_ACK_RCV, 1);
+						}
+						break;
+					}
+					/* no match: out-of sync or expired ACK, ignored */
+				}
+			} while (nb_ack == ACK_BATCH);
+		}
+		
+		/* expire the datagrams not acknowledged in time, a later ACK won't match */
+		now = mono_us();
+		for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
+			for (i = 0; i < INFLIGHT_SIZE; ++i) {
+				entry = __atomic_load_n(&inflight[ic][i], __ATOMIC_RELAXED);
+				if ((entry != 0) && (now - (uint32_t)entry > 1000 * push_timeout_ms)) {
+					__atomic_compare_exchange_n(&inflight[ic][i], &entry, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				}
+			}
+		}
+	}
+	close(ep);
+	LOG(LOG_LVL_INFO, "\nINFO: End of ACK thread\n");
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 2: POLLING SERVERS AND EMITTING PACKETS ----------------------- */
+
+/* parse a PULL_RESP, filter it and queue it for the concentrator */
+static void down_transmit(int ic, uint8_t * buff_down, int msg_len, int fw_reader, struct jit_queue * jit) {
+	int i;
 	
-	/* JSON parsing variables */
-	JSON_Value *root_val = NULL;
-	JSON_Object *txpk_obj = NULL;
-	JSON_Value *val = NULL; /* needed to detect the absence of some fields */
-	const char *str; /* pointer to sub-strings in the JSON data */
-	short x0, x1;
-	short x2, x3, x4;
-	double x5, x6;
+	/* configuration and metadata for an outbound packet */
+	struct txpk tx;
+	const char *err; /* parsing error */
 	
 	/* variables to send on UTC timestamp */
 	struct tref local_ref; /* time reference used for UTC <-> timestamp conversion */
-	struct tm utc_vector; /* for collecting the elements of the UTC time */
-	struct timespec utc_tx; /* UTC time that needs to be converted to timestamp */
 	
-	/* beacon variables */
-	struct lgw_pkt_tx_s beacon_pkt;
-	uint8_t tx_status_var;
+	/* downlink firewall variables */
+	const struct fw_table * fw_rules;
+	int fw_verdict;
+	struct timespec fw_mono; /* monotonic time of the request, for the token buckets */
+	uint32_t toa_us; /* time-on-air of the downlink */
 	
-	/* auto-quit variable */
-	uint32_t autoquit_cnt = 0; /* count the number of PULL_DATA sent since the latest PULL_ACK */
-	
-	MSG("INFO: [down] Thread activated for all server %s\n",serv_addr[ic]);
+	/* the datagram is a PULL_RESP */
+	buff_down[msg_len] = 0; /* add string terminator, just to be safe */
+	LOG(LOG_LVL_DEBUG, "INFO: [down] for server %s serv_addr[ic]PULL_RESP received :)\n",serv_addr[ic]); /* very verbose */
 
-	/* set downstream socket RX timeout */
-	i = setsockopt(sock_down[ic], SOL_SOCKET, SO_RCVTIMEO, (void *)&pull_timeout, sizeof pull_timeout);
-	if (i != 0) {
-		//TODO Should this failure bring the application down?
-		MSG("ERROR: [down] setsockopt for server %s returned %s\n", serv_addr[ic], strerror(errno));
-		exit(EXIT_FAILURE);
+
+                         //vou descomentar para teste
+	LOG_DUMP(LOG_LVL_DEBUG, "\nJSON down: ", (char *)(buff_down + 4), msg_len - 4); /* display JSON payload */
+	
+	/* parse JSON straight into the TX struct, no allocation */
+	if (txpk_parse((const char *)(buff_down + 4), &tx, &err) != 0) { /* JSON offset */
+		LOG(LOG_LVL_WARNING, "WARNING: [down] %s, TX aborted\n", err);
+		return;
 	}
 	
-	/* pre-fill the pull request buffer with fixed fields */
-	buff_req[0] = PROTOCOL_VERSION;
-	buff_req[3] = PKT_PULL_DATA;
-	*(uint32_t *)(buff_req + 4) = net_mac_h;
-	*(uint32_t *)(buff_req + 8) = net_mac_l;
+	/* "immediate" tag, or target timestamp, or UTC time to be converted by GPS */
+	if (tx.imme) {
+		/* TX procedure: send immediately */
+		LOG(LOG_LVL_INFO, "INFO: [down] a packet will be sent in \"immediate\" mode\n");
+	} else if (tx.has_tmst) {
+		/* TX procedure: send on timestamp value */
+		LOG(LOG_LVL_INFO, "INFO: [down] a packet will be sent on timestamp value %u\n", tx.pkt.count_us);
+	} else {
+		/* TX procedure: send on UTC time (converted to timestamp value) */
+		if (gps_active == true) {
+			pthread_mutex_lock(&mx_timeref);
+			if (gps_ref_valid == true) {
+				local_ref = time_reference_gps;
+				pthread_mutex_unlock(&mx_timeref);
+			} else {
+				pthread_mutex_unlock(&mx_timeref);
+				LOG(LOG_LVL_WARNING, "WARNING: [down] no valid GPS time reference yet, impossible to send packet on specific UTC time, TX aborted\n");
+				return;
+			}
+		} else {
+			LOG(LOG_LVL_WARNING, "WARNING: [down] GPS disabled, impossible to send packet on specific UTC time, TX aborted\n");
+			return;
+		}
+		
+		/* transform UTC time to timestamp */
+		i = lgw_utc2cnt(local_ref, tx.utc, &(tx.pkt.count_us));
+		if (i != LGW_GPS_SUCCESS) {
+			LOG(LOG_LVL_WARNING, "WARNING: [down] could not convert UTC time to timestamp, TX aborted\n");
+			return;
+		} else {
+			LOG(LOG_LVL_INFO, "INFO: [down] a packet will be sent on timestamp value %u (calculated from UTC time)\n", tx.pkt.count_us);
+		}
+	}
 	
-	//TODO: this should only be present in one thread => make special beacon thread?
-	/* beacon data fields, byte 0 is Least Significant Byte */
-	uint32_t field_netid = 0xC0FFEE; /* ID, 3 bytes only */
-	uint32_t field_time; /* variable field */
-	uint8_t field_crc1; /* variable field */
-	uint8_t field_info = 0;
-	int32_t field_latitude; /* 3 bytes, derived from reference latitude */
-	int32_t field_longitude; /* 3 bytes, derived from reference longitude */
-	uint16_t field_crc2;
-
-	//TODO: this should only be present in one thread => make special beacon thread?
-	/* beacon packet parameters */
-	beacon_pkt.tx_mode = ON_GPS; /* send on PPS pulse */
-	beacon_pkt.rf_chain = 0; /* antenna A */
-	beacon_pkt.rf_power = 14;
-	beacon_pkt.modulation = MOD_LORA;
-	beacon_pkt.bandwidth = BW_125KHZ;
-	beacon_pkt.datarate = DR_LORA_SF9;
-	beacon_pkt.coderate = CR_LORA_4_5;
-	beacon_pkt.invert_pol = true;
-	beacon_pkt.preamble = 6;
-	beacon_pkt.no_crc = true;
-	beacon_pkt.no_header = true;
-	beacon_pkt.size = 17;
+	/* preamble length (optional field, optimum min value enforced) */
+	if (tx.pkt.modulation == MOD_LORA) {
+		if (tx.pkt.preamble == 0) {
+			tx.pkt.preamble = (uint16_t)STD_LORA_PREAMB;
+		} else if (tx.pkt.preamble < MIN_LORA_PREAMB) {
+			tx.pkt.preamble = (uint16_t)MIN_LORA_PREAMB;
+		}
+	} else {
+		if (tx.pkt.preamble == 0) {
+			tx.pkt.preamble = (uint16_t)STD_FSK_PREAMB;
+		} else if (tx.pkt.preamble < MIN_FSK_PREAMB) {
+			tx.pkt.preamble = (uint16_t)MIN_FSK_PREAMB;
+		}
+	}
 	
-	/* fixed bacon fields (little endian) */
-	beacon_pkt.payload[0] = 0xFF &  field_netid;
-	beacon_pkt.payload[1] = 0xFF & (field_netid >>  8);
-	beacon_pkt.payload[2] = 0xFF & (field_netid >> 16);
-	/* 3-6 : time (variable) */
-	/* 7 : crc1 (variable) */
+	if (tx.data_size != tx.pkt.size) {
+		LOG(LOG_LVL_WARNING, "WARNING: [down] mismatch between .size and .data size once converter to binary\n");
+	}
 	
-	/* calculate the latitude and longitude that must be publicly reported */
-	field_latitude = (int32_t)((reference_coord.lat / 90.0) * (double)(1<<23));
-	if (field_latitude > (int32_t)0x007FFFFF) {
-		field_latitude = (int32_t)0x007FFFFF; /* +90 N is represented as 89.99999 N */
-	} else if (field_latitude < (int32_t)0xFF800000) {
-		field_latitude = (int32_t)0xFF800000;
+	/* select TX mode */
+	if (tx.imme) {
+		tx.pkt.tx_mode = IMMEDIATE;
+	} else {
+		tx.pkt.tx_mode = TIMESTAMPED;
+	}
+	
+	/* downlink firewall, rejected frames never take the concentrator lock */
+	if (fw_reader >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &fw_mono);
+		fw_rules = fw_acquire(fw_reader);
+		fw_verdict = (fw_rules != NULL) ? fw_check_txpkt(fw_rules, ic, &tx.pkt, (uint32_t)(fw_mono.tv_sec * 1000 + fw_mono.tv_nsec / 1000000)) : FW_PASS;
+		fw_release(fw_reader);
+		if (fw_verdict != FW_PASS) {
+			meas_add(MEAS_DOWN, MEAS_DW_DGRAM_RCV, 1);
+			meas_add(MEAS_DOWN, MEAS_DW_NETWORK_BYTE, msg_len);
+			meas_add(MEAS_DOWN, (fw_verdict == FW_LIMITED) ? MEAS_NB_TX_LIMIT : MEAS_NB_TX_FW, 1);
+			LOG(LOG_LVL_WARNING, "WARNING: [down] downlink from server %s rejected by firewall\n", serv_addr[ic]);
+			return;
+		}
 	}
-	field_longitude = 0x00FFFFFF & (int32_t)((reference_coord.lon / 180.0) * (double)(1<<23)); /* +180 = -180 = 0x800000 */
 	
-	/* optional beacon fields */
-	beacon_pkt.payload[ 8] = field_info;
-	beacon_pkt.payload[ 9] = 0xFF &  field_latitude;
-	beacon_pkt.payload[10] = 0xFF & (field_latitude >>  8);
-	beacon_pkt.payload[11] = 0xFF & (field_latitude >> 16);
-	beacon_pkt.payload[12] = 0xFF &  field_longitude;
-	beacon_pkt.payload[13] = 0xFF & (field_longitude >>  8);
-	beacon_pkt.payload[14] = 0xFF & (field_longitude >> 16);
+	/* duty-cycle budgets, checked again and charged by the dispatcher when the frame is sent */
+	clock_gettime(CLOCK_MONOTONIC, &fw_mono);
+	i = duty_check(&tx.pkt, (uint32_t)(fw_mono.tv_sec * 1000 + fw_mono.tv_nsec / 1000000), &toa_us);
+	if (i != DUTY_PASS) {
+		meas_add(MEAS_DOWN, MEAS_DW_DGRAM_RCV, 1);
+		meas_add(MEAS_DOWN, MEAS_DW_NETWORK_BYTE, msg_len);
+		meas_add(MEAS_DOWN, MEAS_NB_TX_DUTY, 1);
+		LOG(LOG_LVL_WARNING, "WARNING: [down] %u us downlink at %u Hz rejected, %s over its duty-cycle budget\n", toa_us, tx.pkt.freq_hz, (i == DUTY_BAND) ? "sub-band" : "RF chain");
+		return;
+	}
 	
-	field_crc2 = crc_ccit((beacon_pkt.payload + 8), 7); /* CRC optional 7 bytes */
-	beacon_pkt.payload[15] = 0xFF &  field_crc2;
-	beacon_pkt.payload[16] = 0xFF & (field_crc2 >>  8);
+	/* queue the frame, the dispatcher hands it to the concentrator shortly before its slot */
+	i = jit_enqueue(jit, &tx.pkt, toa_us);
 	
-	while (!exit_sig && !quit_sig) {
-		
-		/* auto-quit if the threshold is crossed */
-		if ((autoquit_threshold > 0) && (autoquit_cnt >= autoquit_threshold)) {
-			exit_sig = true;
-			MSG("INFO: [down] for server %s the last %u PULL_DATA were not ACKed, exiting application\n", serv_addr[ic], autoquit_threshold);
-			break;
+	/* record measurement data */
+	meas_add(MEAS_DOWN, MEAS_DW_DGRAM_RCV, 1); /* count only datagrams with no JSON errors */
+	meas_add(MEAS_DOWN, MEAS_DW_NETWORK_BYTE, msg_len);
+	if (i == JIT_OK) {
+		meas_add(MEAS_DOWN, MEAS_DW_PAYLOAD_BYTE, tx.pkt.size);
+	} else if (i == JIT_COLLISION) {
+		meas_add(MEAS_DOWN, MEAS_NB_TX_COLLISION, 1);
+	} else {
+		meas_add(MEAS_DOWN, MEAS_NB_TX_FULL, 1);
+	}
+	if (i == JIT_COLLISION) {
+		LOG(LOG_LVL_WARNING, "WARNING: [down] downlink from server %s on timestamp %u collides with a queued one, TX aborted\n", serv_addr[ic], tx.pkt.count_us);
+	} else if (i == JIT_FULL) {
+		LOG(LOG_LVL_WARNING, "WARNING: [down] JIT queue full, downlink from server %s aborted\n", serv_addr[ic]);
+	}
+}
+
+/* hand the next queued frame to the concentrator if its slot is near and the TX is free, return the ms to wait before the next attempt */
+static int down_dispatch(struct jit_queue * jit) {
+	int i;
+	struct jit_entry * e;
+	bool known; /* true if the concentrator counter can be estimated */
+	uint32_t cnt = 0; /* estimated concentrator counter */
+	uint64_t beacon; /* slot reserved for the beacon */
+	uint32_t start;
+	int32_t ahead; /* time in us until the slot of the frame */
+	uint8_t tx_status_var;
+	struct timespec mono;
+	uint32_t now_ms; /* time base of the duty-cycle ledgers */
+	
+	while ((e = jit_peek(jit)) != NULL) {
+		known = concent_cnt(&cnt);
+		if ((e->pkt.tx_mode == IMMEDIATE) || !known) {
+			ahead = JIT_LEAD_US; /* no usable estimate, let the concentrator wait for the slot */
+		} else {
+			ahead = (int32_t)(e->pkt.count_us - cnt);
 		}
 		
-		/* generate random token for request */
-		token_h = (uint8_t)rand(); /* random token */
-		token_l = (uint8_t)rand(); /* random token */
-		buff_req[1] = token_h;
-		buff_req[2] = token_l;
-		
-		/* send PULL request and record time */
-		send(sock_down[ic], (void *)buff_req, sizeof buff_req, 0);
-		clock_gettime(CLOCK_MONOTONIC, &send_time);
-		pthread_mutex_lock(&mx_meas_dw);
-		meas_dw_pull_sent += 1;
-		pthread_mutex_unlock(&mx_meas_dw);
-		req_ack = false;
-		autoquit_cnt++;
+		/* a frame sent past its slot would wait for the counter to wrap */
+		if (ahead < JIT_LATE_US) {
+			meas_add(MEAS_DOWN, MEAS_NB_TX_LATE, 1);
+			LOG(LOG_LVL_WARNING, "WARNING: [down] downlink on timestamp %u is %i us too late, TX aborted\n", e->pkt.count_us, JIT_LATE_US - ahead);
+			jit_pop(jit);
+			continue;
+		}
 		
-		/* listen to packets and process them until a new PULL request must be sent */
-		recv_time = send_time;
-		while ((int)difftimespec(recv_time, send_time) < keepalive_time) {
-			
-			/* try to receive a datagram */
-			msg_len = recv(sock_down[ic], (void *)buff_down, (sizeof buff_down)-1, 0);
-			clock_gettime(CLOCK_MONOTONIC, &recv_time);
-			
-			/* if beacon must be prepared, load it and wait for it to trigger */
-			//TODO: this should only be present in one thread => make special beacon thread?
-			//TODO: beacon can also work on local time base, implement.
-			if ((beacon_next_pps == true) && (gps_active == true)) {
-				pthread_mutex_lock(&mx_timeref);
-				beacon_next_pps = false;
-				if ((gps_ref_valid == true) && (xtal_correct_ok == true)) {
-					field_time = time_reference_gps.utc.tv_sec + 1; /* the beacon is prepared 1 sec before becon time */
-					pthread_mutex_unlock(&mx_timeref);
-					
-					/* load time in beacon payload */
-					beacon_pkt.payload[ 9] = 0xFF &  field_time;
-					beacon_pkt.payload[10] = 0xFF & (field_time >>  8);
-					beacon_pkt.payload[11] = 0xFF & (field_time >> 16);
-					beacon_pkt.payload[12] = 0xFF & (field_time >> 24);
-					
-					/* calculate CRC */
-					field_crc1 = crc8_ccit(beacon_pkt.payload, 7); /* CRC for the first 7 bytes */
-					beacon_pkt.payload[7] = field_crc1;
-					
-					/* apply frequency correction to beacon TX frequency */
-					pthread_mutex_lock(&mx_xcorr);
-					beacon_pkt.freq_hz = (uint32_t)(xtal_correct * (double)beacon_freq_hz);
-					pthread_mutex_unlock(&mx_xcorr);
-					MSG("NOTE: [down] beacon ready to send (frequency %u Hz)\n", beacon_pkt.freq_hz);
-					
-					/* display beacon payload */
-					//testebeacon
-					MSG("--- Beacon payload ---\n");
-					for (i=0; i<24; ++i) {
-						MSG("0x%02X", beacon_pkt.payload[i]);
-						if (i%8 == 7) {
-							MSG("\n");
-						} else {
-							MSG(" - ");
-						}
-					}
-					if (i%8 != 0) {
-						MSG("\n");
-					}
-					MSG("--- end of payload ---\n");
-					
-					/* send bacon packet and check for status */
-					pthread_mutex_lock(&mx_concent); /* may have to wait for a fetch to finish */
-					i = lgw_send(beacon_pkt);
-					pthread_mutex_unlock(&mx_concent); /* free concentrator ASAP */
-					if (i == LGW_HAL_ERROR) {
-						MSG("WARNING: [down] failed to send beacon packet\n");
-					} else {
-						tx_status_var = TX_STATUS_UNKNOWN;
-						for (i=0; (i < (1500/BEACON_POLL_MS)) && (tx_status_var != TX_FREE); ++i) {
-							wait_ms(BEACON_POLL_MS);
-							pthread_mutex_lock(&mx_concent);
-							lgw_status(TX_STATUS, &tx_status_var);
-							pthread_mutex_unlock(&mx_concent);
-						}
-						if (tx_status_var == TX_FREE) {
-							MSG("NOTE: [down] beacon sent successfully\n");
-						} else {
-							MSG("WARNING: [down] beacon was scheduled but failed to TX\n");
-						}
-					}
-				} else {
-					pthread_mutex_unlock(&mx_timeref);
+		/* the beacon has priority, a timestamped frame overlapping its slot is dropped, an immediate one waits */
+		beacon = __atomic_load_n(&beacon_slot, __ATOMIC_ACQUIRE);
+		if ((beacon != 0) && ((e->pkt.tx_mode != IMMEDIATE) || known)) {
+			start = (e->pkt.tx_mode == IMMEDIATE) ? cnt : e->pkt.count_us;
+			if (((int32_t)(start - ((uint32_t)(beacon >> 32) + (uint32_t)beacon)) < 0) &&
+			    ((int32_t)((uint32_t)(beacon >> 32) - (start + e->toa_us + JIT_MARGIN_US)) < 0)) {
+				if (e->pkt.tx_mode == IMMEDIATE) {
+					ahead = (int32_t)((uint32_t)(beacon >> 32) + (uint32_t)beacon - cnt);
+					return (ahead / 1000 < PULL_TIMEOUT_MS) ? ahead / 1000 + 1 : PULL_TIMEOUT_MS;
 				}
-			}
-			
-			/* if no network message was received, got back to listening sock_down socket */
-			if (msg_len == -1) {
-				//MSG("WARNING: [down] recv returned %s\n", strerror(errno)); /* too verbose */
+				meas_add(MEAS_DOWN, MEAS_NB_TX_COLLISION, 1);
+				LOG(LOG_LVL_WARNING, "WARNING: [down] downlink on timestamp %u collides with the beacon, TX aborted\n", e->pkt.count_us);
+				jit_pop(jit);
 				continue;
 			}
-			
-			/* if the datagram does not respect protocol, just ignore it */
-			if ((msg_len < 4) || (buff_down[0] != PROTOCOL_VERSION) || ((buff_down[3] != PKT_PULL_RESP) && (buff_down[3] != PKT_PULL_ACK))) {
-				//TODO Investigate why this message is logged only at shutdown, i.e. all messages produced here are collected and
-				//     spit out at program termination. This can lead to an unstable application.
-				//MSG("WARNING: [down] ignoring invalid packet\n");
-				continue;
-			}
-			
-			/* if the datagram is an ACK, check token */
-			if (buff_down[3] == PKT_PULL_ACK) {
-				if ((buff_down[1] == token_h) && (buff_down[2] == token_l)) {
-					if (req_ack) {
-						MSG("INFO: [down] for server %s duplicate ACK received :)\n",serv_addr[ic]);
-					} else { /* if that packet was not already acknowledged */
-						req_ack = true;
-						autoquit_cnt = 0;
-						pthread_mutex_lock(&mx_meas_dw);
-						meas_dw_ack_rcv += 1;
-						pthread_mutex_unlock(&mx_meas_dw);
-						MSG("INFO: [down] for server %s PULL_ACK received in %i ms\n", serv_addr[ic], (int)(1000 * difftimespec(recv_time, send_time)));
-					}
-				} else { /* out-of-sync token */
-					MSG("INFO: [down] for server %s, received out-of-sync ACK\n",serv_addr[ic]);
-				}
-				continue;
-			}
-			
-
-			//TODO: This might generate to much logging data. The reporting should be reevaluated and an option -q should be added.
-			/* the datagram is a PULL_RESP */
-			buff_down[msg_len] = 0; /* add string terminator, just to be safe */
-			MSG("INFO: [down] for server %s serv_addr[ic]PULL_RESP received :)\n",serv_addr[ic]); /* very verbose */
-
+		}
+		
+		if (ahead > JIT_LEAD_US) {
+			return ((ahead - JIT_LEAD_US) / 1000 < PULL_TIMEOUT_MS) ? (ahead - JIT_LEAD_US) / 1000 + 1 : PULL_TIMEOUT_MS;
+		}
+		
+		/* the frames sent since it was queued may have used the budget */
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		now_ms = (uint32_t)(mono.tv_sec * 1000 + mono.tv_nsec / 1000000);
+		i = duty_check(&e->pkt, now_ms, NULL);
+		if (i != DUTY_PASS) {
+			meas_add(MEAS_DOWN, MEAS_NB_TX_DUTY, 1);
+			LOG(LOG_LVL_WARNING, "WARNING: [down] %u us downlink at %u Hz aborted, %s over its duty-cycle budget\n", e->toa_us, e->pkt.freq_hz, (i == DUTY_BAND) ? "sub-band" : "RF chain");
+			jit_pop(jit);
+			continue;
+		}
+		
+		/* the concentrator holds a single frame, never overwrite a scheduled or emitting one */
+		pthread_mutex_lock(&mx_concent); /* may have to wait for a fetch to finish */
+		i = lgw_status(TX_STATUS, &tx_status_var);
+		if ((i == LGW_HAL_SUCCESS) && (tx_status_var != TX_FREE)) {
+			pthread_mutex_unlock(&mx_concent);
+			return 1;
+		}
+		
+		/* transfer data and metadata to the concentrator, and schedule TX */
+		i = lgw_send(e->pkt);
+		pthread_mutex_unlock(&mx_concent); /* free concentrator ASAP */
+		if (i == LGW_HAL_ERROR) {
+			meas_add(MEAS_DOWN, MEAS_NB_TX_FAIL, 1);
+			LOG(LOG_LVL_WARNING, "WARNING: [down] lgw_send failed\n");
+		} else {
+			meas_add(MEAS_DOWN, MEAS_NB_TX_OK, 1);
+			meas_add(MEAS_DOWN, MEAS_TX_AIRTIME, e->toa_us);
+			duty_charge(&e->pkt, now_ms, e->toa_us);
+		}
+		jit_pop(jit);
+		return 1;
+	}
+	return PULL_TIMEOUT_MS;
+}
 
-                         //vou descomentar para teste
-			printf("\nJSON down: %s\n", (char *)(buff_down + 4)); /* DEBUG: display JSON payload */
-			
-			/* initialize TX struct and try to parse JSON */
-			memset(&txpkt, 0, sizeof txpkt);
-			root_val = json_parse_string_with_comments((const char *)(buff_down + 4)); /* JSON offset */
-			if (root_val == NULL) {
-				MSG("WARNING: [down] invalid JSON, TX aborted\n");
-				continue;
-			}
-			
-			/* look for JSON sub-object 'txpk' */
-			txpk_obj = json_object_get_object(json_value_get_object(root_val), "txpk");
-			if (txpk_obj == NULL) {
-				MSG("WARNING: [down] no \"txpk\" object in JSON, TX aborted\n");
-				json_value_free(root_val);
-				continue;
-			}
-			
-			/* Parse "immediate" tag, or target timestamp, or UTC time to be converted by GPS (mandatory) */
-			i = json_object_get_boolean(txpk_obj,"imme"); /* can be 1 if true, 0 if false, or -1 if not a JSON boolean */
-			if (i == 1) {
-				/* TX procedure: send immediately */
-				sent_immediate = true;
-				MSG("INFO: [down] a packet will be sent in \"immediate\" mode\n");
-			} else {
-				sent_immediate = false;
-				val = json_object_get_value(txpk_obj,"tmst");
-				if (val != NULL) {
-					/* TX procedure: send on timestamp value */
-					txpkt.count_us = (uint32_t)json_value_get_number(val);
-					MSG("INFO: [down] a packet will be sent on timestamp value %u\n", txpkt.count_us);
-				} else {
-					/* TX procedure: send on UTC time (converted to timestamp value) */
-					str = json_object_get_string(txpk_obj, "time");
-					if (str == NULL) {
-						MSG("WARNING: [down] no mandatory \"txpk.tmst\" or \"txpk.time\" objects in JSON, TX aborted\n");
-						json_value_free(root_val);
-						continue;
-					}
-					if (gps_active == true) {
-						pthread_mutex_lock(&mx_timeref);
-						if (gps_ref_valid == true) {
-							local_ref = time_reference_gps;
-							pthread_mutex_unlock(&mx_timeref);
-						} else {
-							pthread_mutex_unlock(&mx_timeref);
-							MSG("WARNING: [down] no valid GPS time reference yet, impossible to send packet on specific UTC time, TX aborted\n");
-							json_value_free(root_val);
-							continue;
-						}
-					} else {
-						MSG("WARNING: [down] GPS disabled, impossible to send packet on specific UTC time, TX aborted\n");
-						json_value_free(root_val);
-						continue;
-					}
-					
-					i = sscanf (str, "%4hd-%2hd-%2hdT%2hd:%2hd:%9lf", &x0, &x1, &x2, &x3, &x4, &x5);
-					if (i != 6 ) {
-						MSG("WARNING: [down] \"txpk.time\" must follow ISO 8601 format, TX aborted\n");
-						json_value_free(root_val);
-						continue;
-					}
-					x5 = modf(x5, &x6); /* x6 get the integer part of x5, x5 the fractional part */
-					utc_vector.tm_year = x0 - 1900; /* years since 1900 */
-					utc_vector.tm_mon = x1 - 1; /* months since January */
-					utc_vector.tm_mday = x2; /* day of the month 1-31 */
-					utc_vector.tm_hour = x3; /* hours since midnight */
-					utc_vector.tm_min = x4; /* minutes after the hour */
-					utc_vector.tm_sec = (int)x6;
-					utc_tx.tv_sec = mktime(&utc_vector) - timezone;
-					utc_tx.tv_nsec = (long)(1e9 * x5);
-					
-					/* transform UTC time to timestamp */
-					i = lgw_utc2cnt(local_ref, utc_tx, &(txpkt.count_us));
-					if (i != LGW_GPS_SUCCESS) {
-						MSG("WARNING: [down] could not convert UTC time to timestamp, TX aborted\n");
-						json_value_free(root_val);
-						continue;
-					} else {
-						MSG("INFO: [down] a packet will be sent on timestamp value %u (calculated from UTC time)\n", txpkt.count_us);
-					}
-				}
-			}
-			
-			/* Parse "No CRC" flag (optional field) */
-			val = json_object_get_value(txpk_obj,"ncrc");
-			if (val != NULL) {
-				txpkt.no_crc = (bool)json_value_get_boolean(val);
+void thread_down(void) {
+	int k; /* loop variables */
+	int ic; /* server index */
+	
+	/* event loop variables */
+	int ep; /* epoll instance watching the downstream sockets and the keepalive timer */
+	int tfd; /* keepalive timer */
+	struct epoll_event ev;
+	struct epoll_event events[MAX_SERVERS + 1];
+	int nb_ev;
+	struct itimerspec keepalive;
+	uint64_t expirations;
+	bool pull_due = true; /* send the first PULL_DATA right away */
+	
+	/* local timekeeping variables */
+	struct timespec send_time[MAX_SERVERS]; /* time of the pull request */
+	struct timespec recv_time; /* time of return from recv socket call */
+	
+	/* data buffers */
+	uint8_t buff_down[1000]; /* buffer to receive downstream packets */
+	uint8_t buff_req[12]; /* buffer to compose pull requests */
+	int msg_len;
+	
+	/* protocol variables, per server */
+	uint8_t token_h[MAX_SERVERS]; /* random token for acknowledgement matching */
+	uint8_t token_l[MAX_SERVERS]; /* random token for acknowledgement matching */
+	bool req_ack[MAX_SERVERS]; /* keep track of whether PULL_DATA was acknowledged or not */
+	
+	/* auto-quit variable */
+	uint32_t autoquit_cnt[MAX_SERVERS] = {0}; /* count the number of PULL_DATA sent since the latest PULL_ACK */
+	
+	/* downlink firewall variables */
+	int fw_reader = -1;
+	
+	/* downlinks waiting for their slot */
+	struct jit_queue jit;
+	int jit_wait_ms = PULL_TIMEOUT_MS;
+	
+	LOG(LOG_LVL_INFO, "INFO: [down] Thread activated for all servers.\n");
+	
+	jit_init(&jit);
+	
+	/* register as reader of the firewall rules */
+	if (firewall_enabled == true) {
+		fw_reader = fw_reader_register();
+		if (fw_reader < 0) {
+			LOG(LOG_LVL_ERROR, "ERROR: [down] failed to register as firewall reader\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	/* one epoll instance for all downstream sockets and the keepalive timer */
+	ep = epoll_create1(0);
+	tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if ((ep == -1) || (tfd == -1)) {
+		LOG(LOG_LVL_ERROR, "ERROR: [down] failed to create the event loop: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	for (ic = 0; ic < serv_count; ic++) if (serv_live[ic] == true) {
+		ev.events = EPOLLIN;
+		ev.data.u32 = ic;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, sock_down[ic], &ev) == -1) {
+			LOG(LOG_LVL_ERROR, "ERROR: [down] epoll_ctl for server %s returned %s\n", serv_addr[ic], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	ev.events = EPOLLIN;
+	ev.data.u32 = MAX_SERVERS; /* not a server index */
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev) == -1) {
+		LOG(LOG_LVL_ERROR, "ERROR: [down] epoll_ctl for the keepalive timer returned %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	
+	/* PULL_DATA are sent every keepalive_time seconds, a negative value disables the periodic requests */
+	memset(&keepalive, 0, sizeof keepalive);
+	if (keepalive_time > 0) {
+		keepalive.it_value.tv_sec = keepalive_time;
+		keepalive.it_interval.tv_sec = keepalive_time;
+	}
+	timerfd_settime(tfd, 0, &keepalive, NULL);
+	
+	/* pre-fill the pull request buffer with fixed fields */
+	buff_req[0] = PROTOCOL_VERSION;
+	buff_req[3] = PKT_PULL_DATA;
+	*(uint32_t *)(buff_req + 4) = net_mac_h;
+	*(uint32_t *)(buff_req + 8) = net_mac_l;
+	
+	while (!exit_sig && !quit_sig) {
+		
+		/* send PULL request to all servers and record time */
+		for (ic = 0; pull_due && (ic < serv_count); ic++) if (serv_live[ic] == true) {
+			/* auto-quit if the threshold is crossed */
+			if ((autoquit_threshold > 0) && (autoquit_cnt[ic] >= autoquit_threshold)) {
+				exit_sig = true;
+				LOG(LOG_LVL_INFO, "INFO: [down] for server %s the last %u PULL_DATA were not ACKed, exiting application\n", serv_addr[ic], autoquit_threshold);
+				break;
 			}
 			
-			/* parse target frequency (mandatory) */
-			val = json_object_get_value(txpk_obj,"freq");
-			if (val == NULL) {
-				MSG("WARNING: [down] no mandatory \"txpk.freq\" object in JSON, TX aborted\n");
-				json_value_free(root_val);
-				continue;
-			}
-			txpkt.freq_hz = (uint32_t)((double)(1.0e6) * json_value_get_number(val));
+			/* generate random token for request */
+			token_h[ic] = (uint8_t)rand(); /* random token */
+			token_l[ic] = (uint8_t)rand(); /* random token */
+			buff_req[1] = token_h[ic];
+			buff_req[2] = token_l[ic];
 			
-			/* parse RF chain used for TX (mandatory) */
-			val = json_object_get_value(txpk_obj,"rfch");
-			if (val == NULL) {
-				MSG("WARNING: [down] no mandatory \"txpk.rfch\" object in JSON, TX aborted\n");
-				json_value_free(root_val);
+			send(sock_down[ic], (void *)buff_req, sizeof buff_req, 0);
+			clock_gettime(CLOCK_MONOTONIC, &send_time[ic]);
+			meas_add(MEAS_DOWN, MEAS_DW_PULL_SENT, 1);
+			req_ack[ic] = false;
+			autoquit_cnt[ic]++;
+		}
+		pull_due = false;
+		
+		/* wait for datagrams, the next keepalive or the next downlink slot, wake up regularly to check the exit flags */
+		nb_ev = epoll_wait(ep, events, MAX_SERVERS + 1, jit_wait_ms);
+		
+		for (k = 0; k < nb_ev; ++k) {
+			if (events[k].data.u32 == MAX_SERVERS) {
+				if (read(tfd, &expirations, sizeof expirations) > 0) pull_due = true;
 				continue;
 			}
-			txpkt.rf_chain = (uint8_t)json_value_get_number(val);
-			
-			/* parse TX power (optional field) */
-			val = json_object_get_value(txpk_obj,"powe");
-			if (val != NULL) {
-				txpkt.rf_power = (int8_t)json_value_get_number(val);
-			}
+			ic = events[k].data.u32;
 			
-			/* Parse modulation (mandatory) */
-			str = json_object_get_string(txpk_obj, "modu");
-			if (str == NULL) {
-				MSG("WARNING: [down] no mandatory \"txpk.modu\" object in JSON, TX aborted\n");
-				json_value_free(root_val);
-				continue;
-			}
-			if (strcmp(str, "LORA") == 0) {
-				/* Lora modulation */
-				txpkt.modulation = MOD_LORA;
-				
-				/* Parse Lora spreading-factor and modulation bandwidth (mandatory) */
-				str = json_object_get_string(txpk_obj, "datr");
-				if (str == NULL) {
-					MSG("WARNING: [down] no mandatory \"txpk.datr\" object in JSON, TX aborted\n");
-					json_value_free(root_val);
-					continue;
-				}
-				i = sscanf(str, "SF%2hdBW%3hd", &x0, &x1);
-				if (i != 2) {
-					MSG("WARNING: [down] format error in \"txpk.datr\", TX aborted\n");
-					json_value_free(root_val);
-					continue;
-				}
-				switch (x0) {
-					case  7: txpkt.datarate = DR_LORA_SF7;  break;
-					case  8: txpkt.datarate = DR_LORA_SF8;  break;
-					case  9: txpkt.datarate = DR_LORA_SF9;  break;
-					case 10: txpkt.datarate = DR_LORA_SF10; break;
-					case 11: txpkt.datarate = DR_LORA_SF11; break;
-					case 12: txpkt.datarate = DR_LORA_SF12; break;
-					default:
-						MSG("WARNING: [down] format error in \"txpk.datr\", invalid SF, TX aborted\n");
-						json_value_free(root_val);
-						continue;
-				}
-				switch (x1) {
-					case 125: txpkt.bandwidth = BW_125KHZ; break;
-					case 250: txpkt.bandwidth = BW_250KHZ; break;
-					case 500: txpkt.bandwidth = BW_500KHZ; break;
-					default:
-						MSG("WARNING: [down] format error in \"txpk.datr\", invalid BW, TX aborted\n");
-						json_value_free(root_val);
-						continue;
-				}
+			/* drain the socket, several datagrams may be pending */
+			while ((msg_len = recv(sock_down[ic], (void *)buff_down, (sizeof buff_down)-1, MSG_DONTWAIT)) != -1) {
+				clock_gettime(CLOCK_MONOTONIC, &recv_time);
 				
-				/* Parse ECC coding rate (optional field) */
-				str = json_object_get_string(txpk_obj, "codr");
-				if (str == NULL) {
-					MSG("WARNING: [down] no mandatory \"txpk.codr\" object in json, TX aborted\n");
-					json_value_free(root_val);
-					continue;
-				}
-				if      (strcmp(str, "4/5") == 0) txpkt.coderate = CR_LORA_4_5;
-				else if (strcmp(str, "4/6") == 0) txpkt.coderate = CR_LORA_4_6;
-				else if (strcmp(str, "2/3") == 0) txpkt.coderate = CR_LORA_4_6;
-				else if (strcmp(str, "4/7") == 0) txpkt.coderate = CR_LORA_4_7;
-				else if (strcmp(str, "4/8") == 0) txpkt.coderate = CR_LORA_4_8;
-				else if (strcmp(str, "1/2") == 0) txpkt.coderate = CR_LORA_4_8;
-				else {
-					MSG("WARNING: [down] format error in \"txpk.codr\", TX aborted\n");
-					json_value_free(root_val);
+				/* if the datagram does not respect protocol, just ignore it */
+				if ((msg_len < 4) || (buff_down[0] != PROTOCOL_VERSION) || ((buff_down[3] != PKT_PULL_RESP) && (buff_down[3] != PKT_PULL_ACK))) {
+					//MSG("WARNING: [down] ignoring invalid packet\n");
 					continue;
 				}
 				
-				/* Parse signal polarity switch (optional field) */
-				val = json_object_get_value(txpk_obj,"ipol");
-				if (val != NULL) {
-					txpkt.invert_pol = (bool)json_value_get_boolean(val);
-				}
-				
-				/* parse Lora preamble length (optional field, optimum min value enforced) */
-				val = json_object_get_value(txpk_obj,"prea");
-				if (val != NULL) {
-					i = (int)json_value_get_number(val);
-					if (i >= MIN_LORA_PREAMB) {
-						txpkt.preamble = (uint16_t)i;
-					} else {
-						txpkt.preamble = (uint16_t)MIN_LORA_PREAMB;
+				/* if the datagram is an ACK, check token */
+				if (buff_down[3] == PKT_PULL_ACK) {
+					if ((buff_down[1] == token_h[ic]) && (buff_down[2] == token_l[ic])) {
+						if (req_ack[ic]) {
+							LOG(LOG_LVL_INFO, "INFO: [down] for server %s duplicate ACK received :)\n",serv_addr[ic]);
+						} else { /* if that packet was not already acknowledged */
+							req_ack[ic] = true;
+							autoquit_cnt[ic] = 0;
+							meas_add(MEAS_DOWN, MEAS_DW_ACK_RCV, 1);
+							LOG(LOG_LVL_INFO, "INFO: [down] for server %s PULL_ACK received in %i ms\n", serv_addr[ic], (int)(1000 * difftimespec(recv_time, send_time[ic])));
+						}
+					} else { /* out-of-sync token */
+						LOG(LOG_LVL_INFO, "INFO: [down] for server %s, received out-of-sync ACK\n",serv_addr[ic]);
 					}
-				} else {
-					txpkt.preamble = (uint16_t)STD_LORA_PREAMB;
-				}
-				
-			} else if (strcmp(str, "FSK") == 0) {
-				/* FSK modulation */
-				txpkt.modulation = MOD_FSK;
-				
-				/* parse FSK bitrate (mandatory) */
-				val = json_object_get_value(txpk_obj,"datr");
-				if (val == NULL) {
-					MSG("WARNING: [down] no mandatory \"txpk.datr\" object in JSON, TX aborted\n");
-					json_value_free(root_val);
 					continue;
 				}
-				txpkt.datarate = (uint32_t)(json_value_get_number(val));
 				
-				/* parse frequency deviation (mandatory) */
-				val = json_object_get_value(txpk_obj,"fdev");
-				if (val == NULL) {
-					MSG("WARNING: [down] no mandatory \"txpk.fdev\" object in JSON, TX aborted\n");
-					json_value_free(root_val);
-					continue;
-				}
-				txpkt.f_dev = (uint8_t)(json_value_get_number(val) / 1000.0); /* JSON value in Hz, txpkt.f_dev in kHz */
-					
-				/* parse FSK preamble length (optional field, optimum min value enforced) */
-				val = json_object_get_value(txpk_obj,"prea");
-				if (val != NULL) {
-					i = (int)json_value_get_number(val);
-					if (i >= MIN_FSK_PREAMB) {
-						txpkt.preamble = (uint16_t)i;
-					} else {
-						txpkt.preamble = (uint16_t)MIN_FSK_PREAMB;
-					}
-				} else {
-					txpkt.preamble = (uint16_t)STD_FSK_PREAMB;
-				}
-			
-			} else {
-				MSG("WARNING: [down] invalid modulation in \"txpk.modu\", TX aborted\n");
-				json_value_free(root_val);
-				continue;
-			}
-			
-			/* Parse payload length (mandatory) */
-			val = json_object_get_value(txpk_obj,"size");
-			if (val == NULL) {
-				MSG("WARNING: [down] no mandatory \"txpk.size\" object in JSON, TX aborted\n");
-				json_value_free(root_val);
-				continue;
-			}
-			txpkt.size = (uint16_t)json_value_get_number(val);
-			
-			/* Parse payload data (mandatory) */
-			str = json_object_get_string(txpk_obj, "data");
-			if (str == NULL) {
-				MSG("WARNING: [down] no mandatory \"txpk.data\" object in JSON, TX aborted\n");
-				json_value_free(root_val);
-				continue;
-			}
-			i = b64_to_bin(str, strlen(str), txpkt.payload, sizeof txpkt.payload);
-			if (i != txpkt.size) {
-				MSG("WARNING: [down] mismatch between .size and .data size once converter to binary\n");
-			}
-			
-			/* free the JSON parse tree from memory */
-			json_value_free(root_val);
-			
-			/* select TX mode */
-			if (sent_immediate) {
-				txpkt.tx_mode = IMMEDIATE;
-			} else {
-				txpkt.tx_mode = TIMESTAMPED;
-			}
-			
-			/* record measurement data */
-			pthread_mutex_lock(&mx_meas_dw);
-			meas_dw_dgram_rcv += 1; /* count only datagrams with no JSON errors */
-			meas_dw_network_byte += msg_len; /* meas_dw_network_byte */
-			meas_dw_payload_byte += txpkt.size;
-			
-			/* transfer data and metadata to the concentrator, and schedule TX */
-			pthread_mutex_lock(&mx_concent); /* may have to wait for a fetch to finish */
-			i = lgw_send(txpkt);
-			pthread_mutex_unlock(&mx_concent); /* free concentrator ASAP */
-			if (i == LGW_HAL_ERROR) {
-				meas_nb_tx_fail += 1;
-				pthread_mutex_unlock(&mx_meas_dw);
-				MSG("WARNING: [down] lgw_send failed\n");
-				continue;
-			} else {
-				meas_nb_tx_ok += 1;
-				pthread_mutex_unlock(&mx_meas_dw);
+				/* the datagram is a PULL_RESP */
+				down_transmit(ic, buff_down, msg_len, fw_reader, &jit);
 			}
 		}
+		
+		/* hand the next downlink to the concentrator when its slot is near */
+		jit_wait_ms = down_dispatch(&jit);
 	}
-	MSG("\nINFO: End of downstream thread for server  %i.\n",ic);
+	close(tfd);
+	close(ep);
+	LOG(LOG_LVL_INFO, "\nINFO: End of downstream thread\n");
 }
 
 /* -------------------------------------------------------------------------- */
@@ -2546,13 +2843,13 @@ void thread_gps(void) {
 	/* initialize some variables before loop */
 	memset(serial_buff, 0, sizeof serial_buff);
 
-	MSG("INFO: GPS thread activated.\n");
+	LOG(LOG_LVL_INFO, "INFO: GPS thread activated.\n");
 	
 	while (!exit_sig && !quit_sig) {
 		/* blocking canonical read on serial port */
 		nb_char = read(gps_tty_fd, serial_buff, sizeof(serial_buff)-1);
 		if (nb_char <= 0) {
-			MSG("WARNING: [gps] read() returned value <= 0\n");
+			LOG(LOG_LVL_WARNING, "WARNING: [gps] read() returned value <= 0\n");
 			continue;
 		} else {
 			serial_buff[nb_char] = 0; /* add null terminator, just to be sure */
@@ -2566,17 +2863,18 @@ void thread_gps(void) {
 			/* get UTC time for synchronization */
 			i = lgw_gps_get(&utc_time, NULL, NULL);
 			if (i != LGW_GPS_SUCCESS) {
-				MSG("WARNING: [gps] could not get UTC time from GPS\n");
+				LOG(LOG_LVL_WARNING, "WARNING: [gps] could not get UTC time from GPS\n");
 				continue;
 			}
 			
-			/* check if beacon must be sent */
+			/* wake the beacon thread if a beacon must be sent on the next PPS */
 			if (beacon_period > 0) {
 				sec_of_cycle = (utc_time.tv_sec + 1) % (time_t)(beacon_period);
 				if (sec_of_cycle == beacon_offset) {
-					beacon_next_pps = true;
-				} else {
-					beacon_next_pps = false;
+					pthread_mutex_lock(&mx_beacon);
+					beacon_time = (uint32_t)utc_time.tv_sec + 1;
+					pthread_cond_signal(&cv_beacon);
+					pthread_mutex_unlock(&mx_beacon);
 				}
 			}
 			
@@ -2585,7 +2883,7 @@ void thread_gps(void) {
 			i = lgw_get_trigcnt(&trig_tstamp);
 			pthread_mutex_unlock(&mx_concent);
 			if (i != LGW_HAL_SUCCESS) {
-				MSG("WARNING: [gps] failed to read concentrator timestamp\n");
+				LOG(LOG_LVL_WARNING, "WARNING: [gps] failed to read concentrator timestamp\n");
 				continue;
 			}
 			
@@ -2594,7 +2892,7 @@ void thread_gps(void) {
 			i = lgw_gps_sync(&time_reference_gps, trig_tstamp, utc_time);
 			pthread_mutex_unlock(&mx_timeref);
 			if (i != LGW_GPS_SUCCESS) {
-				MSG("WARNING: [gps] GPS out of sync, keeping previous time reference\n");
+				LOG(LOG_LVL_WARNING, "WARNING: [gps] GPS out of sync, keeping previous time reference\n");
 				continue;
 			}
 			
@@ -2612,7 +2910,7 @@ void thread_gps(void) {
 			pthread_mutex_unlock(&mx_meas_gps);
 		}
 	}
-	MSG("\nINFO: End of GPS thread\n");
+	LOG(LOG_LVL_INFO, "\nINFO: End of GPS thread\n");
 }
 
 /* -------------------------------------------------------------------------- */
@@ -2699,4 +2997,192 @@ void thread_valid(void) {
 	MSG("\nINFO: End of validation thread\n");
 }
 
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 5: EMITTING BEACONS ON THE GPS PPS ---------------------------- */
+
+void thread_beacon(void) {
+	int i, k; /* loop variables */
+	
+	/* beacon variables */
+	struct lgw_pkt_tx_s beacon_pkt;
+	uint8_t tx_status_var;
+	uint32_t send_time; /* UTC second of the beacon signalled by the GPS thread */
+	uint32_t next_time = 0; /* UTC second the payload is prepared for */
+	bool ready;
+	struct timespec wake; /* limit of a wait, to check the exit flags */
+	struct tref local_ref; /* time reference used for UTC -> timestamp conversion */
+	struct timespec pps_utc;
+	uint32_t pps_cnt; /* concentrator counter at the PPS the beacon is sent on */
+	uint32_t beacon_toa;
+	uint32_t cnt; /* estimated concentrator counter */
+	bool known, sent;
+	int32_t ahead; /* time in us until the PPS */
+	
+	/* beacon data fields, byte 0 is Least Significant Byte */
+	uint32_t field_netid = 0xC0FFEE; /* ID, 3 bytes only */
+	uint8_t field_info = 0;
+	int32_t field_latitude; /* 3 bytes, derived from reference latitude */
+	int32_t field_longitude; /* 3 bytes, derived from reference longitude */
+	uint16_t field_crc2;
+	
+	memset(&beacon_pkt, 0, sizeof beacon_pkt);
+	
+	/* beacon packet parameters */
+	beacon_pkt.tx_mode = ON_GPS; /* send on PPS pulse */
+	beacon_pkt.rf_chain = 0; /* antenna A */
+	beacon_pkt.rf_power = 14;
+	beacon_pkt.modulation = MOD_LORA;
+	beacon_pkt.bandwidth = BW_125KHZ;
+	beacon_pkt.datarate = DR_LORA_SF9;
+	beacon_pkt.coderate = CR_LORA_4_5;
+	beacon_pkt.invert_pol = true;
+	beacon_pkt.preamble = 6;
+	beacon_pkt.no_crc = true;
+	beacon_pkt.no_header = true;
+	beacon_pkt.size = 17;
+	
+	/* fixed bacon fields (little endian) */
+	beacon_pkt.payload[0] = 0xFF &  field_netid;
+	beacon_pkt.payload[1] = 0xFF & (field_netid >>  8);
+	beacon_pkt.payload[2] = 0xFF & (field_netid >> 16);
+	/* 3-6 : time (variable) */
+	/* 7 : crc1 (variable) */
+	
+	/* calculate the latitude and longitude that must be publicly reported */
+	field_latitude = (int32_t)((reference_coord.lat / 90.0) * (double)(1<<23));
+	if (field_latitude > (int32_t)0x007FFFFF) {
+		field_latitude = (int32_t)0x007FFFFF; /* +90 N is represented as 89.99999 N */
+	} else if (field_latitude < (int32_t)0xFF800000) {
+		field_latitude = (int32_t)0xFF800000;
+	}
+	field_longitude = 0x00FFFFFF & (int32_t)((reference_coord.lon / 180.0) * (double)(1<<23)); /* +180 = -180 = 0x800000 */
+	
+	/* optional beacon fields */
+	beacon_pkt.payload[ 8] = field_info;
+	beacon_pkt.payload[ 9] = 0xFF &  field_latitude;
+	beacon_pkt.payload[10] = 0xFF & (field_latitude >>  8);
+	beacon_pkt.payload[11] = 0xFF & (field_latitude >> 16);
+	beacon_pkt.payload[12] = 0xFF &  field_longitude;
+	beacon_pkt.payload[13] = 0xFF & (field_longitude >>  8);
+	beacon_pkt.payload[14] = 0xFF & (field_longitude >> 16);
+	
+	field_crc2 = crc_ccit((beacon_pkt.payload + 8), 7); /* CRC optional 7 bytes */
+	beacon_pkt.payload[15] = 0xFF &  field_crc2;
+	beacon_pkt.payload[16] = 0xFF & (field_crc2 >>  8);
+	beacon_toa = airtime_us(&beacon_pkt);
+	
+	MSG("INFO: [beacon] Thread activated.\n");
+	
+	while (!exit_sig && !quit_sig) {
+		/* sleep until the GPS thread announces a beacon for the next PPS */
+		pthread_mutex_lock(&mx_beacon);
+		if (beacon_time == 0) {
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_sec += 1;
+			pthread_cond_timedwait(&cv_beacon, &mx_beacon, &wake);
+		}
+		send_time = beacon_time;
+		beacon_time = 0;
+		pthread_mutex_unlock(&mx_beacon);
+		if (send_time == 0) {
+			continue;
+		}
+		
+		//TODO: beacon can also work on local time base, implement.
+		pthread_mutex_lock(&mx_timeref);
+		ready = gps_ref_valid;
+		local_ref = time_reference_gps;
+		pthread_mutex_unlock(&mx_timeref);
+		pthread_mutex_lock(&mx_xcorr);
+		ready = ready && xtal_correct_ok;
+		beacon_pkt.freq_hz = (uint32_t)(xtal_correct * (double)beacon_freq_hz); /* apply frequency correction */
+		pthread_mutex_unlock(&mx_xcorr);
+		pps_utc.tv_sec = (time_t)send_time;
+		pps_utc.tv_nsec = 0;
+		if ((ready == false) || (lgw_utc2cnt(local_ref, pps_utc, &pps_cnt) != LGW_GPS_SUCCESS)) {
+			continue;
+		}
+		
+		/* reserve the slot, the downstream thread hands over no frame overlapping it */
+		__atomic_store_n(&beacon_slot, ((uint64_t)(pps_cnt - BEACON_GUARD_US) << 32) | (BEACON_GUARD_US + beacon_toa + JIT_MARGIN_US), __ATOMIC_RELEASE);
+		
+		/* the payload is normally prepared right after the previous beacon */
+		if (send_time != next_time) {
+			beacon_load_time(beacon_pkt.payload, send_time);
+		}
+		
+		/* the concentrator holds a single frame, hand the beacon over just before the PPS once the earlier downlinks are out */
+		/* (without a counter estimate, only if the TX is free right away) */
+		sent = false;
+		while (!exit_sig && !quit_sig) {
+			known = concent_cnt(&cnt);
+			if (known) {
+				ahead = (int32_t)(pps_cnt - cnt);
+				if (ahead < BEACON_LATE_US) {
+					break;
+				} else if (ahead > BEACON_GUARD_US) {
+					wait_ms((ahead - BEACON_GUARD_US) / 1000 + 1);
+					continue;
+				}
+			}
+			pthread_mutex_lock(&mx_concent); /* may have to wait for a fetch to finish */
+			i = lgw_status(TX_STATUS, &tx_status_var);
+			if ((i != LGW_HAL_SUCCESS) || (tx_status_var == TX_FREE)) {
+				i = lgw_send(beacon_pkt);
+				sent = true;
+			}
+			pthread_mutex_unlock(&mx_concent); /* free concentrator ASAP */
+			if (sent || !known) {
+				break;
+			}
+			wait_ms(1);
+		}
+		if (!sent) {
+			MSG("WARNING: [beacon] TX busy, beacon for second %u skipped\n", send_time);
+			__atomic_store_n(&beacon_slot, 0, __ATOMIC_RELEASE);
+			continue; /* the payload is reloaded on the next wake-up */
+		}
+		MSG("NOTE: [beacon] beacon queued for the next PPS (frequency %u Hz)\n", beacon_pkt.freq_hz);
+		
+		/* display beacon payload */
+		MSG("--- Beacon payload ---\n");
+		for (k = 0; k < beacon_pkt.size; ++k) {
+			MSG("0x%02X", beacon_pkt.payload[k]);
+			if (k%8 == 7) {
+				MSG("\n");
+			} else {
+				MSG(" - ");
+			}
+		}
+		if (k%8 != 0) {
+			MSG("\n");
+		}
+		MSG("--- end of payload ---\n");
+		
+		/* check for status */
+		if (i == LGW_HAL_ERROR) {
+			MSG("WARNING: [beacon] failed to send beacon packet\n");
+		} else {
+			tx_status_var = TX_STATUS_UNKNOWN;
+			for (i=0; (i < (1500/BEACON_POLL_MS)) && (tx_status_var != TX_FREE); ++i) {
+				wait_ms(BEACON_POLL_MS);
+				pthread_mutex_lock(&mx_concent);
+				lgw_status(TX_STATUS, &tx_status_var);
+				pthread_mutex_unlock(&mx_concent);
+			}
+			if (tx_status_var == TX_FREE) {
+				MSG("NOTE: [beacon] beacon sent successfully\n");
+			} else {
+				MSG("WARNING: [beacon] beacon was scheduled but failed to TX\n");
+			}
+		}
+		__atomic_store_n(&beacon_slot, 0, __ATOMIC_RELEASE);
+		
+		/* prepare the payload of the next beacon, off the critical path */
+		next_time = send_time + beacon_period;
+		beacon_load_time(beacon_pkt.payload, next_time);
+	}
+	MSG("\nINFO: End of beacon thread\n");
+}
+
 /* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,262 @@
+/*
+Description:
+	push-bench: load benchmark of the upstream path, PUSH_DATA batching and
+	PUSH_ACK draining. The forwarder is built in, its push and ACK threads
+	run unchanged against servers emulated on the loopback interface that
+	acknowledge every datagram. A producer stands for the upstream thread
+	and queues datagrams for every server in bursts, as fetches do on a busy
+	gateway. sendmmsg and recvmmsg are counted on their way to the kernel.
+	The load is run without batching, then with push_batch_us set, and the
+	system calls per datagram, the queue-to-send latency and the ACK ratio
+	of both runs are printed.
+
+	Usage: push-bench [nb_servers] [datagrams_per_s] [burst] [batch_us]
+	Build with the sources and libraries of the packet forwarder, this file
+	replacing poly_pkt_fwd.c.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+/* the batched system calls must be declared before the forwarder redirects them */
+#define _GNU_SOURCE		/* sendmmsg, recvmmsg */
+#include <sys/socket.h>
+#undef _XOPEN_SOURCE	/* set by the forwarder, the headers already saw _GNU_SOURCE */
+
+static int bench_sendmmsg(int sockfd, struct mmsghdr * msgvec, unsigned int vlen, int flags);
+static int bench_recvmmsg(int sockfd, struct mmsghdr * msgvec, unsigned int vlen, int flags, struct timespec * timeout);
+
+/* the forwarder, its entry point renamed and its batched system calls counted */
+#define main		pkt_fwd_main
+#define sendmmsg	bench_sendmmsg
+#define recvmmsg	bench_recvmmsg
+#include "poly_pkt_fwd.c"
+#undef main
+#undef sendmmsg
+#undef recvmmsg
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define BENCH_SERVERS		2
+#define BENCH_RATE			2000	/* datagrams per second queued for each server */
+#define BENCH_BURST			4		/* datagrams queued at once */
+#define BENCH_BATCH_US		2000	/* push_batch_us of the second run */
+#define BENCH_DURATION_S	5		/* duration of a run */
+#define BENCH_DGRAM_SIZE	240		/* typical PUSH_DATA with one rxpk */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static uint32_t bench_nb_sendmmsg;
+static uint32_t bench_nb_recvmmsg;
+static int bench_sock_serv[MAX_SERVERS]; /* emulated servers */
+static volatile bool bench_stop;
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static int bench_sendmmsg(int sockfd, struct mmsghdr * msgvec, unsigned int vlen, int flags) {
+	__atomic_fetch_add(&bench_nb_sendmmsg, 1, __ATOMIC_RELAXED);
+	return sendmmsg(sockfd, msgvec, vlen, flags);
+}
+
+static int bench_recvmmsg(int sockfd, struct mmsghdr * msgvec, unsigned int vlen, int flags, struct timespec * timeout) {
+	__atomic_fetch_add(&bench_nb_recvmmsg, 1, __ATOMIC_RELAXED);
+	return recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+}
+
+/* acknowledge every PUSH_DATA received by the emulated servers */
+static void bench_server(void) {
+	uint8_t buff[TX_BUFF_SIZE];
+	uint8_t ack[4];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	ssize_t n;
+	int ic;
+	bool idle;
+
+	while (!bench_stop) {
+		idle = true;
+		for (ic = 0; ic < serv_count; ++ic) {
+			from_len = sizeof from;
+			n = recvfrom(bench_sock_serv[ic], buff, sizeof buff, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+			if ((n < 12) || (buff[3] != PKT_PUSH_DATA)) continue;
+			ack[0] = PROTOCOL_VERSION;
+			ack[1] = buff[1];
+			ack[2] = buff[2];
+			ack[3] = PKT_PUSH_ACK;
+			sendto(bench_sock_serv[ic], ack, sizeof ack, 0, (struct sockaddr *)&from, from_len);
+			idle = false;
+		}
+		if (idle) wait_ms(1);
+	}
+}
+
+/* open the emulated servers and connect the upstream sockets to them */
+static int bench_connect(int nb_servers) {
+	struct sockaddr_in addr;
+	socklen_t len;
+	int ic;
+
+	for (ic = 0; ic < nb_servers; ++ic) {
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof addr;
+		bench_sock_serv[ic] = socket(AF_INET, SOCK_DGRAM, 0);
+		sock_up[ic] = socket(AF_INET, SOCK_DGRAM, 0);
+		if ((bench_sock_serv[ic] == -1) || (sock_up[ic] == -1)
+			|| (bind(bench_sock_serv[ic], (struct sockaddr *)&addr, sizeof addr) != 0)
+			|| (getsockname(bench_sock_serv[ic], (struct sockaddr *)&addr, &len) != 0)
+			|| (connect(sock_up[ic], (struct sockaddr *)&addr, sizeof addr) != 0)) {
+			MSG("ERROR: failed to open the emulated server %i, %s\n", ic, strerror(errno));
+			return -1;
+		}
+		snprintf(serv_addr[ic], sizeof serv_addr[ic], "127.0.0.1:%u", ntohs(addr.sin_port));
+		serv_live[ic] = true;
+		up_queue[ic] = ringbuf_new(UP_QUEUE_SIZE, sizeof (struct up_dgram));
+		if ((up_queue[ic] == NULL) || (sem_init(&up_queue_sem[ic], 0, 0) != 0)) {
+			MSG("ERROR: failed to allocate the queue of server %i\n", ic);
+			return -1;
+		}
+	}
+	serv_count = (uint8_t)nb_servers;
+	return 0;
+}
+
+/* queue the datagrams for the push threads, as the upstream thread does, return the number dropped */
+static uint32_t bench_produce(unsigned rate, unsigned burst, unsigned duration_s) {
+	uint8_t buff[BENCH_DGRAM_SIZE];
+	struct up_dgram * dgram;
+	uint32_t start, next, now;
+	uint32_t nb_drop = 0;
+	unsigned period_us = (unsigned)(1000000ULL * burst / rate);
+	unsigned b;
+	int ic;
+
+	memset(buff, ' ', sizeof buff);
+	buff[0] = PROTOCOL_VERSION;
+	buff[3] = PKT_PUSH_DATA;
+	start = mono_us();
+	for (next = start; (uint32_t)(next - start) < 1000000U * duration_s; next += period_us) {
+		now = mono_us();
+		if ((int32_t)(next - now) > 0) {
+			wait_ms((next - now) / 1000);
+		}
+		for (b = 0; b < burst; ++b) {
+			buff[1] = (uint8_t)rand();
+			buff[2] = (uint8_t)rand();
+			now = mono_us();
+			for (ic = 0; ic < serv_count; ++ic) {
+				dgram = ringbuf_slot_write(up_queue[ic]);
+				if (dgram == NULL) {
+					++nb_drop;
+					continue;
+				}
+				dgram->size = sizeof buff;
+				dgram->queued_us = now;
+				memcpy(dgram->buff, buff, sizeof buff);
+				ringbuf_commit(up_queue[ic]);
+				sem_post(&up_queue_sem[ic]);
+			}
+		}
+	}
+	return nb_drop;
+}
+
+/* run the push and ACK threads under load, return -1 if they could not be started */
+static int bench_run(unsigned batch_us, unsigned rate, unsigned burst) {
+	pthread_t thrid_bench_push[MAX_SERVERS];
+	pthread_t thrid_bench_ack;
+	struct histogram snap;
+	uint64_t total[MEAS_NB];
+	uint32_t nb_drop, nb_sent;
+	int ic;
+
+	push_batch_us = batch_us;
+	memset(meas, 0, sizeof meas);
+	hist_collect(&latency[LAT_SEND], &snap);
+	hist_collect(&latency[LAT_ACK], &snap);
+	bench_nb_sendmmsg = 0;
+	bench_nb_recvmmsg = 0;
+	quit_sig = false;
+	for (ic = 0; ic < serv_count; ++ic) {
+		if (pthread_create(&thrid_bench_push[ic], NULL, (void * (*)(void *))thread_push, (void *) (long) ic) != 0) {
+			MSG("ERROR: impossible to create push thread\n");
+			return -1;
+		}
+	}
+	if (pthread_create(&thrid_bench_ack, NULL, (void * (*)(void *))thread_ack, NULL) != 0) {
+		MSG("ERROR: impossible to create ACK thread\n");
+		return -1;
+	}
+
+	nb_drop = bench_produce(rate, burst, BENCH_DURATION_S);
+	wait_ms(2 * push_timeout_ms); /* last ACK */
+	quit_sig = true;
+	for (ic = 0; ic < serv_count; ++ic) {
+		pthread_join(thrid_bench_push[ic], NULL);
+	}
+	pthread_join(thrid_bench_ack, NULL);
+
+	meas_read(total);
+	nb_sent = (uint32_t)total[MEAS_UP_DGRAM_SENT];
+	MSG("### push_batch_us %u ###\n", batch_us);
+	MSG("# datagrams sent: %u, dropped (queue full): %u\n", nb_sent, nb_drop);
+	MSG("# sendmmsg calls: %u, %.2f datagrams per call\n", bench_nb_sendmmsg, (bench_nb_sendmmsg > 0) ? (double)nb_sent / bench_nb_sendmmsg : 0.0);
+	MSG("# recvmmsg calls: %u, %.2f PUSH_ACK per call\n", bench_nb_recvmmsg, (bench_nb_recvmmsg > 0) ? (double)total[MEAS_UP_ACK_RCV] / bench_nb_recvmmsg : 0.0);
+	MSG("# system calls per datagram: %.3f\n", (nb_sent > 0) ? (double)(bench_nb_sendmmsg + bench_nb_recvmmsg) / nb_sent : 0.0);
+	MSG("# PUSH_ACK received: %.1f%%\n", (nb_sent > 0) ? 100.0 * total[MEAS_UP_ACK_RCV] / nb_sent : 0.0);
+	hist_collect(&latency[LAT_SEND], &snap);
+	MSG("# queue to send: p50 %u us, p99 %u us, max %u us\n", hist_percentile(&snap, 50.0), hist_percentile(&snap, 99.0), snap.max);
+	hist_collect(&latency[LAT_ACK], &snap);
+	MSG("# send to ACK: p50 %u us, p99 %u us, max %u us\n", hist_percentile(&snap, 50.0), hist_percentile(&snap, 99.0), snap.max);
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	pthread_t thrid_bench_server;
+	int nb_servers = BENCH_SERVERS;
+	int rate = BENCH_RATE;
+	int burst = BENCH_BURST;
+	int batch_us = BENCH_BATCH_US;
+	int i;
+
+	if (argc > 1) nb_servers = atoi(argv[1]);
+	if (argc > 2) rate = atoi(argv[2]);
+	if (argc > 3) burst = atoi(argv[3]);
+	if (argc > 4) batch_us = atoi(argv[4]);
+	if ((argc > 5) || (nb_servers < 1) || (nb_servers > MAX_SERVERS) || (rate < 1) || (burst < 1) || (burst > rate) || (batch_us < 1)) {
+		MSG("Usage: push-bench [nb_servers] [datagrams_per_s] [burst] [batch_us]\n");
+		MSG("Defaults: %i servers, %i datagrams/s in bursts of %i, %i us batching\n", BENCH_SERVERS, BENCH_RATE, BENCH_BURST, BENCH_BATCH_US);
+		return EXIT_FAILURE;
+	}
+
+	log_verbosity = LOG_LVL_WARNING;
+	log_start(log_verbosity);
+	if (bench_connect(nb_servers) != 0) {
+		return EXIT_FAILURE;
+	}
+	if (pthread_create(&thrid_bench_server, NULL, (void * (*)(void *))bench_server, NULL) != 0) {
+		MSG("ERROR: impossible to create server thread\n");
+		return EXIT_FAILURE;
+	}
+
+	MSG("##### push-bench: %i servers, %i datagrams/s in bursts of %i, %i s per run #####\n", nb_servers, rate, burst, BENCH_DURATION_S);
+	i = bench_run(0, (unsigned)rate, (unsigned)burst);
+	if (i == 0) i = bench_run((unsigned)batch_us, (unsigned)rate, (unsigned)burst);
+
+	bench_stop = true;
+	pthread_join(thrid_bench_server, NULL);
+	log_stop();
+	return (i == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
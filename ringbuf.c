@@ -0,0 +1,93 @@
+/*
+Description:
+	Lock-free single-producer single-consumer ring of fixed-size records.
+	The write index is only stored by the producer and the read index by the
+	consumer, each on its own cache line. The producer keeps a copy of the
+	read index and only reloads it when the ring looks full, the consumer
+	loads the write index once per batch. Indexes run freely and are masked
+	on access; publishing uses release stores paired with acquire loads.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdlib.h>		/* posix_memalign, free */
+#include <string.h>		/* memset */
+
+#include "ringbuf.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define RB_LINE		64	/* cache line size */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct ringbuf {
+	/* producer line */
+	uint32_t head __attribute__((aligned(RB_LINE)));	/* next slot to write */
+	uint32_t tail_cache;	/* last read index seen by the producer */
+	/* consumer line */
+	uint32_t tail __attribute__((aligned(RB_LINE)));	/* next slot to read */
+	/* read-only after allocation */
+	uint32_t mask __attribute__((aligned(RB_LINE)));
+	uint32_t record_size;
+	uint8_t * records;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+struct ringbuf * ringbuf_new(uint32_t nb_records, uint32_t record_size) {
+	struct ringbuf * r;
+	uint32_t n = 1;
+
+	if ((nb_records == 0) || (nb_records > 0x80000000) || (record_size == 0)) return NULL;
+	while (n < nb_records) n <<= 1;
+	if (posix_memalign((void **)&r, RB_LINE, sizeof *r) != 0) return NULL;
+	memset(r, 0, sizeof *r);
+	r->mask = n - 1;
+	r->record_size = (record_size + 7) & ~7u; /* keep records 8-byte aligned */
+	if (posix_memalign((void **)&r->records, RB_LINE, (size_t)n * r->record_size) != 0) {
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void ringbuf_free(struct ringbuf * r) {
+	if (r == NULL) return;
+	free(r->records);
+	free(r);
+}
+
+void * ringbuf_slot_write(struct ringbuf * r) {
+	if (r->head - r->tail_cache > r->mask) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (r->head - r->tail_cache > r->mask) return NULL;
+	}
+	return r->records + (size_t)(r->head & r->mask) * r->record_size;
+}
+
+void ringbuf_commit(struct ringbuf * r) {
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t ringbuf_count(struct ringbuf * r) {
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+}
+
+void * ringbuf_slot_read(struct ringbuf * r, uint32_t i) {
+	return r->records + (size_t)((r->tail + i) & r->mask) * r->record_size;
+}
+
+void ringbuf_release(struct ringbuf * r, uint32_t n) {
+	__atomic_store_n(&r->tail, r->tail + n, __ATOMIC_RELEASE);
+}
+
+/* --- EOF ------------------------------------------------------------------ */
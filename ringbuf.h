@@ -0,0 +1,79 @@
+/*
+Description:
+	Lock-free single-producer single-consumer ring of fixed-size records.
+	Records are written and read in place: the producer fills the slot
+	returned by ringbuf_slot_write then publishes it, the consumer reads up
+	to ringbuf_count records then releases them.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _RINGBUF_H
+#define _RINGBUF_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct ringbuf; /* opaque, shared by one producer and one consumer thread */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Allocate a ring
+@param nb_records capacity, rounded up to a power of 2
+@param record_size size of a record in bytes
+@return pointer to the ring, NULL if allocation failed
+*/
+struct ringbuf * ringbuf_new(uint32_t nb_records, uint32_t record_size);
+
+/**
+@brief Release a ring, neither thread may use it anymore
+@param r pointer to the ring, may be NULL
+*/
+void ringbuf_free(struct ringbuf * r);
+
+/**
+@brief Get the next free slot, producer side
+@param r pointer to the ring
+@return pointer to the slot to fill, NULL if the ring is full
+*/
+void * ringbuf_slot_write(struct ringbuf * r);
+
+/**
+@brief Publish the slot returned by ringbuf_slot_write, producer side
+@param r pointer to the ring
+*/
+void ringbuf_commit(struct ringbuf * r);
+
+/**
+@brief Count the records ready to be read, consumer side
+@param r pointer to the ring
+@return number of published records not released yet
+*/
+uint32_t ringbuf_count(struct ringbuf * r);
+
+/**
+@brief Get a published record, consumer side
+@param r pointer to the ring
+@param i index of the record, from 0 (oldest) to ringbuf_count - 1
+@return pointer to the record, valid until it is released
+*/
+void * ringbuf_slot_read(struct ringbuf * r, uint32_t i);
+
+/**
+@brief Give the oldest records back to the producer, consumer side
+@param r pointer to the ring
+@param n number of records, at most ringbuf_count
+*/
+void ringbuf_release(struct ringbuf * r, uint32_t n);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,223 @@
+/*
+Description:
+	Serialization of the rxpk objects sent upstream, without printf.
+	Integers are converted two digits at a time from a table. The frequency
+	is an integer number of Hz, "%.6lf" of freq_hz / 1e6 always prints its
+	exact decimal digits, so it is written as MHz, a dot and 6 digits.
+	RSSI and SNR are floats: multiplied by 10^precision in double precision
+	they stay exact, rounding that product to the nearest integer, ties to
+	even, gives the digits printf produces in the default rounding mode.
+	Values too large for that path (never seen from a concentrator) still go
+	through snprintf. Fixed strings depending on the modulation parameters
+	are precomputed and indexed by their HAL value.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdio.h>		/* snprintf */
+#include <string.h>		/* memcpy */
+#include <math.h>		/* nearbyint, signbit */
+#include <time.h>		/* struct tm */
+
+#include "loragw_hal.h"
+#include "rxpk.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define FRAG(str)	{str, sizeof(str) - 1}
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define RXPK_FLOAT_MAX	1e9	/* larger values are formatted by snprintf */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct rxpk_frag {
+	const char * str;
+	int len;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static const char rxpk_digits[200] =
+	"00010203040506070809" "10111213141516171819" "20212223242526272829"
+	"30313233343536373839" "40414243444546474849" "50515253545556575859"
+	"60616263646566676869" "70717273747576777879" "80818283848586878889"
+	"90919293949596979899";
+
+/* indexed by log2(DR_LORA_SFx) - 1 and by BW_xxxKHZ - 1 */
+static const struct rxpk_frag rxpk_datr[6][3] = {
+	{FRAG(",\"datr\":\"SF7BW500\""),  FRAG(",\"datr\":\"SF7BW250\""),  FRAG(",\"datr\":\"SF7BW125\"")},
+	{FRAG(",\"datr\":\"SF8BW500\""),  FRAG(",\"datr\":\"SF8BW250\""),  FRAG(",\"datr\":\"SF8BW125\"")},
+	{FRAG(",\"datr\":\"SF9BW500\""),  FRAG(",\"datr\":\"SF9BW250\""),  FRAG(",\"datr\":\"SF9BW125\"")},
+	{FRAG(",\"datr\":\"SF10BW500\""), FRAG(",\"datr\":\"SF10BW250\""), FRAG(",\"datr\":\"SF10BW125\"")},
+	{FRAG(",\"datr\":\"SF11BW500\""), FRAG(",\"datr\":\"SF11BW250\""), FRAG(",\"datr\":\"SF11BW125\"")},
+	{FRAG(",\"datr\":\"SF12BW500\""), FRAG(",\"datr\":\"SF12BW250\""), FRAG(",\"datr\":\"SF12BW125\"")}
+};
+
+/* indexed by CR_LORA_4_x, 0 is the CR0 case (mostly false sync) */
+static const struct rxpk_frag rxpk_codr[5] = {
+	FRAG(",\"codr\":\"OFF\""),
+	FRAG(",\"codr\":\"4/5\""),
+	FRAG(",\"codr\":\"4/6\""),
+	FRAG(",\"codr\":\"4/7\""),
+	FRAG(",\"codr\":\"4/8\"")
+};
+
+static const struct rxpk_frag rxpk_stat_ok = FRAG(",\"stat\":1");
+static const struct rxpk_frag rxpk_stat_bad = FRAG(",\"stat\":-1");
+static const struct rxpk_frag rxpk_stat_none = FRAG(",\"stat\":0");
+static const struct rxpk_frag rxpk_modu_lora = FRAG(",\"modu\":\"LORA\"");
+static const struct rxpk_frag rxpk_modu_fsk = FRAG(",\"modu\":\"FSK\"");
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static inline char * rxpk_put(char * s, const struct rxpk_frag * f) {
+	memcpy(s, f->str, f->len);
+	return s + f->len;
+}
+
+static inline char * rxpk_put2(char * s, unsigned v) {
+	memcpy(s, &rxpk_digits[2 * v], 2);
+	return s + 2;
+}
+
+/* "%0<width>u", width up to 10 */
+static char * rxpk_uint(char * s, uint32_t v, int width) {
+	char tmp[10];
+	int n = 0;
+
+	while (v >= 100) {
+		n += 2;
+		memcpy(&tmp[10 - n], &rxpk_digits[2 * (v % 100)], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		n += 2;
+		memcpy(&tmp[10 - n], &rxpk_digits[2 * v], 2);
+	} else {
+		n += 1;
+		tmp[10 - n] = (char)('0' + v);
+	}
+	while (n < width) {
+		n += 1;
+		tmp[10 - n] = '0';
+	}
+	memcpy(s, &tmp[10 - n], n);
+	return s + n;
+}
+
+/* "%.<prec>f" of a float, prec is 0 or 1 */
+static char * rxpk_float(char * s, float f, int prec) {
+	double x;
+	uint32_t n;
+
+	x = (prec == 0) ? (double)f : (double)f * 10.0; /* exact, a float has 24 significant bits */
+	if (!(fabs(x) < RXPK_FLOAT_MAX)) {
+		return s + snprintf(s, 48, (prec == 0) ? "%.0f" : "%.1f", f);
+	}
+	if (signbit(x)) {
+		*(s++) = '-';
+		x = -x;
+	}
+	n = (uint32_t)nearbyint(x);
+	if (prec == 0) {
+		return rxpk_uint(s, n, 1);
+	}
+	s = rxpk_uint(s, n / 10, 1);
+	*(s++) = '.';
+	*(s++) = (char)('0' + n % 10);
+	return s;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int rxpk_time(char * s, const struct tm * t, long usec) {
+	char * p = s;
+
+	p = rxpk_uint(p, (uint32_t)(t->tm_year + 1900), 4);
+	*(p++) = '-';
+	p = rxpk_put2(p, t->tm_mon + 1);
+	*(p++) = '-';
+	p = rxpk_put2(p, t->tm_mday);
+	*(p++) = 'T';
+	p = rxpk_put2(p, t->tm_hour);
+	*(p++) = ':';
+	p = rxpk_put2(p, t->tm_min);
+	*(p++) = ':';
+	p = rxpk_put2(p, t->tm_sec);
+	*(p++) = '.';
+	p = rxpk_uint(p, (uint32_t)usec, 6);
+	*(p++) = 'Z';
+	return (int)(p - s);
+}
+
+int rxpk_tmst(char * s, uint32_t tmst) {
+	char * p = s;
+
+	memcpy(p, "\"tmst\":", 7);
+	p = rxpk_uint(p + 7, tmst, 1);
+	return (int)(p - s);
+}
+
+int rxpk_meta(char * s, const struct lgw_pkt_rx_s * p) {
+	char * q = s;
+	int sf;
+
+	/* channel, RF chain & RX frequency */
+	memcpy(q, ",\"chan\":", 8);
+	q = rxpk_uint(q + 8, p->if_chain, 1);
+	memcpy(q, ",\"rfch\":", 8);
+	q = rxpk_uint(q + 8, p->rf_chain, 1);
+	memcpy(q, ",\"freq\":", 8);
+	q = rxpk_uint(q + 8, p->freq_hz / 1000000, 1);
+	*(q++) = '.';
+	q = rxpk_uint(q, p->freq_hz % 1000000, 6);
+
+	/* status */
+	switch (p->status) {
+		case STAT_CRC_OK:  q = rxpk_put(q, &rxpk_stat_ok);   break;
+		case STAT_CRC_BAD: q = rxpk_put(q, &rxpk_stat_bad);  break;
+		case STAT_NO_CRC:  q = rxpk_put(q, &rxpk_stat_none); break;
+		default: return -1;
+	}
+
+	/* modulation, datarate, coderate and SNR */
+	if (p->modulation == MOD_LORA) {
+		if ((p->datarate < DR_LORA_SF7) || (p->datarate > DR_LORA_SF12) || ((p->datarate & (p->datarate - 1)) != 0)) return -1;
+		if ((p->bandwidth < BW_500KHZ) || (p->bandwidth > BW_125KHZ)) return -1;
+		if (p->coderate > CR_LORA_4_8) return -1;
+		sf = __builtin_ctz(p->datarate) - 1;
+		q = rxpk_put(q, &rxpk_modu_lora);
+		q = rxpk_put(q, &rxpk_datr[sf][p->bandwidth - 1]);
+		q = rxpk_put(q, &rxpk_codr[p->coderate]);
+		memcpy(q, ",\"lsnr\":", 8);
+		q = rxpk_float(q + 8, p->snr, 1);
+	} else if (p->modulation == MOD_FSK) {
+		q = rxpk_put(q, &rxpk_modu_fsk);
+		memcpy(q, ",\"datr\":", 8);
+		q = rxpk_uint(q + 8, p->datarate, 1);
+	} else {
+		return -1;
+	}
+
+	/* RSSI and payload size */
+	memcpy(q, ",\"rssi\":", 8);
+	q = rxpk_float(q + 8, p->rssi, 0);
+	memcpy(q, ",\"size\":", 8);
+	q = rxpk_uint(q + 8, p->size, 1);
+	return (int)(q - s);
+}
+
+/* --- EOF ------------------------------------------------------------------ */
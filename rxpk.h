@@ -0,0 +1,58 @@
+/*
+Description:
+	Serialization of the rxpk objects sent upstream, without printf.
+	The output is byte-identical to the snprintf formats of the Semtech
+	packet forwarder ("%u", "%.6lf", "%.1f", "%.0f", ISO 8601 time).
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _RXPK_H
+#define _RXPK_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <time.h>		/* struct tm */
+
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define RXPK_TIME_LEN	27	/* "2016-01-31T12:34:56.123456Z" */
+#define RXPK_META_MAX	224	/* longest output of rxpk_meta, with out-of-range RSSI and SNR */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Write a UTC time in ISO 8601 format with microseconds
+@param s destination, at least RXPK_TIME_LEN chars, not null-terminated
+@param t broken-down UTC time, typ. from gmtime
+@param usec microseconds
+@return number of chars written
+*/
+int rxpk_time(char * s, const struct tm * t, long usec);
+
+/**
+@brief Write the "tmst" field that opens a rxpk object
+@param s destination, at least 17 chars, not null-terminated
+@param tmst concentrator timestamp
+@return number of chars written
+*/
+int rxpk_tmst(char * s, uint32_t tmst);
+
+/**
+@brief Write the radio metadata of a packet, from ,"chan" to ,"size"
+@param s destination, at least RXPK_META_MAX chars, not null-terminated
+@param p pointer to the received packet
+@return number of chars written, -1 if the status, modulation, datarate, bandwidth or coderate is unknown
+*/
+int rxpk_meta(char * s, const struct lgw_pkt_rx_s * p);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,257 @@
+/*
+Description:
+	rxpk-bench: compare the rxpk serializer with the snprintf code it replaced.
+	Random packets (status, modulation, datarate, bandwidth, coderate,
+	frequency, RSSI, SNR, timestamps and UTC times) are serialized by
+	rxpk_tmst, rxpk_time and rxpk_meta and by the formats thread_up used
+	before, the outputs must be byte-identical. Then both are timed over the
+	same packets.
+
+	Usage: rxpk-bench [nb_packets]
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+/* fix an issue between POSIX and C99 */
+#if __STDC_VERSION__ >= 199901L
+	#define _XOPEN_SOURCE 600
+#else
+	#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stdio.h>		/* printf, snprintf */
+#include <stdlib.h>		/* atoi */
+#include <string.h>		/* memcpy, memcmp */
+#include <time.h>		/* clock_gettime, gmtime_r */
+
+#include "loragw_hal.h"
+#include "rxpk.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define BENCH_PACKETS	10000000
+#define BENCH_BATCH		4096	/* packets generated, then serialized by both */
+#define BENCH_OUT_SIZE	512
+
+static const uint8_t bench_status[3] = {STAT_CRC_OK, STAT_CRC_BAD, STAT_NO_CRC};
+static const uint32_t bench_sf[6] = {DR_LORA_SF7, DR_LORA_SF8, DR_LORA_SF9, DR_LORA_SF10, DR_LORA_SF11, DR_LORA_SF12};
+static const uint8_t bench_bw[3] = {BW_125KHZ, BW_250KHZ, BW_500KHZ};
+static const uint8_t bench_cr[5] = {0, CR_LORA_4_5, CR_LORA_4_6, CR_LORA_4_7, CR_LORA_4_8};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct bench_pkt {
+	struct lgw_pkt_rx_s pkt;
+	struct tm utc;
+	long usec;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+static struct bench_pkt bench_pkts[BENCH_BATCH];
+static volatile uint32_t bench_sink; /* keeps the serialization from being optimized out */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static uint64_t bench_ns(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* xorshift64* */
+static uint32_t bench_rand(void) {
+	bench_seed ^= bench_seed >> 12;
+	bench_seed ^= bench_seed << 25;
+	bench_seed ^= bench_seed >> 27;
+	return (uint32_t)((bench_seed * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* random float in [min, min + range), with the resolution of the HAL or any */
+static float bench_float(float min, float range, float step) {
+	float x = min + range * (bench_rand() / 4294967296.0f);
+
+	if ((step > 0) && (bench_rand() & 1)) x = step * (int)(x / step);
+	return x;
+}
+
+static void bench_fill(struct bench_pkt * b) {
+	struct lgw_pkt_rx_s * p = &b->pkt;
+	time_t t;
+
+	memset(p, 0, sizeof *p);
+	p->if_chain = (uint8_t)(bench_rand() % 10);
+	p->rf_chain = (uint8_t)(bench_rand() % 2);
+	p->freq_hz = (bench_rand() & 3) ? 863000000 + 100000 * (bench_rand() % 200) : bench_rand();
+	p->status = bench_status[bench_rand() % 3];
+	p->count_us = bench_rand();
+	if (bench_rand() % 4) {
+		p->modulation = MOD_LORA;
+		p->datarate = bench_sf[bench_rand() % 6];
+		p->bandwidth = bench_bw[bench_rand() % 3];
+		p->coderate = bench_cr[bench_rand() % 5];
+		p->snr = bench_float(-30.0f, 50.0f, 0.25f);
+	} else {
+		p->modulation = MOD_FSK;
+		p->datarate = (bench_rand() & 1) ? 50000 : bench_rand() % 300001;
+	}
+	p->rssi = bench_float(-160.0f, 170.0f, 1.0f);
+	p->size = (uint16_t)(bench_rand() % 256);
+	t = (time_t)bench_rand();
+	gmtime_r(&t, &b->utc);
+	b->usec = (long)(bench_rand() % 1000000);
+}
+
+/* thread_up before rxpk.c */
+static int old_time(char * s, const struct tm * x, long usec) {
+	return snprintf(s, BENCH_OUT_SIZE, "%04i-%02i-%02iT%02i:%02i:%02i.%06liZ", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, usec);
+}
+
+static int old_tmst(char * s, uint32_t tmst) {
+	return snprintf(s, BENCH_OUT_SIZE, "\"tmst\":%u", tmst);
+}
+
+static int old_meta(char * s, const struct lgw_pkt_rx_s * p) {
+	int i;
+	const char * str;
+
+	i = snprintf(s, BENCH_OUT_SIZE, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
+	switch (p->status) {
+		case STAT_CRC_OK:	str = ",\"stat\":1"; break;
+		case STAT_CRC_BAD:	str = ",\"stat\":-1"; break;
+		case STAT_NO_CRC:	str = ",\"stat\":0"; break;
+		default: return -1;
+	}
+	i += snprintf(s + i, BENCH_OUT_SIZE - i, "%s", str);
+	if (p->modulation == MOD_LORA) {
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, ",\"modu\":\"LORA\"");
+		switch (p->datarate) {
+			case DR_LORA_SF7:	str = ",\"datr\":\"SF7"; break;
+			case DR_LORA_SF8:	str = ",\"datr\":\"SF8"; break;
+			case DR_LORA_SF9:	str = ",\"datr\":\"SF9"; break;
+			case DR_LORA_SF10:	str = ",\"datr\":\"SF10"; break;
+			case DR_LORA_SF11:	str = ",\"datr\":\"SF11"; break;
+			case DR_LORA_SF12:	str = ",\"datr\":\"SF12"; break;
+			default: return -1;
+		}
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, "%s", str);
+		switch (p->bandwidth) {
+			case BW_125KHZ:	str = "BW125\""; break;
+			case BW_250KHZ:	str = "BW250\""; break;
+			case BW_500KHZ:	str = "BW500\""; break;
+			default: return -1;
+		}
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, "%s", str);
+		switch (p->coderate) {
+			case CR_LORA_4_5:	str = ",\"codr\":\"4/5\""; break;
+			case CR_LORA_4_6:	str = ",\"codr\":\"4/6\""; break;
+			case CR_LORA_4_7:	str = ",\"codr\":\"4/7\""; break;
+			case CR_LORA_4_8:	str = ",\"codr\":\"4/8\""; break;
+			case 0:				str = ",\"codr\":\"OFF\""; break;
+			default: return -1;
+		}
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, "%s", str);
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, ",\"lsnr\":%.1f", p->snr);
+	} else if (p->modulation == MOD_FSK) {
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, ",\"modu\":\"FSK\"");
+		i += snprintf(s + i, BENCH_OUT_SIZE - i, ",\"datr\":%u", p->datarate);
+	} else {
+		return -1;
+	}
+	i += snprintf(s + i, BENCH_OUT_SIZE - i, ",\"rssi\":%.0f,\"size\":%u", p->rssi, p->size);
+	return i;
+}
+
+/* both serializers on one packet, false and the outputs printed if they differ */
+static bool bench_same(const struct bench_pkt * b) {
+	char a[BENCH_OUT_SIZE], n[BENCH_OUT_SIZE];
+	int la, ln;
+
+	la = old_tmst(a, b->pkt.count_us);
+	ln = rxpk_tmst(n, b->pkt.count_us);
+	if ((la != ln) || (memcmp(a, n, la) != 0)) goto differ;
+	la = old_time(a, &b->utc, b->usec);
+	ln = rxpk_time(n, &b->utc, b->usec);
+	if ((la != ln) || (memcmp(a, n, la) != 0)) goto differ;
+	la = old_meta(a, &b->pkt);
+	ln = rxpk_meta(n, &b->pkt);
+	if ((la != ln) || (memcmp(a, n, la) != 0)) goto differ;
+	return true;
+
+differ:
+	MSG("ERROR: outputs differ\n# snprintf: %.*s\n# rxpk:     %.*s\n", (la > 0) ? la : 0, a, (ln > 0) ? ln : 0, n);
+	return false;
+}
+
+/* ns spent serializing the batch with one of the serializers */
+static uint64_t bench_time(bool old) {
+	char out[BENCH_OUT_SIZE];
+	uint64_t start;
+	uint32_t sum = 0;
+	int k;
+
+	start = bench_ns();
+	if (old) {
+		for (k = 0; k < BENCH_BATCH; ++k) {
+			sum += old_tmst(out, bench_pkts[k].pkt.count_us);
+			sum += old_time(out, &bench_pkts[k].utc, bench_pkts[k].usec);
+			sum += old_meta(out, &bench_pkts[k].pkt);
+		}
+	} else {
+		for (k = 0; k < BENCH_BATCH; ++k) {
+			sum += rxpk_tmst(out, bench_pkts[k].pkt.count_us);
+			sum += rxpk_time(out, &bench_pkts[k].utc, bench_pkts[k].usec);
+			sum += rxpk_meta(out, &bench_pkts[k].pkt);
+		}
+	}
+	bench_sink += sum + (uint8_t)out[0];
+	return bench_ns() - start;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	int nb_packets = BENCH_PACKETS;
+	int n, k;
+	uint64_t ns_old = 0, ns_new = 0;
+
+	if ((argc > 2) || ((argc > 1) && ((nb_packets = atoi(argv[1])) <= 0))) {
+		MSG("Usage: rxpk-bench [nb_packets]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; n < nb_packets; n += BENCH_BATCH) {
+		for (k = 0; k < BENCH_BATCH; ++k) {
+			bench_fill(&bench_pkts[k]);
+			if (!bench_same(&bench_pkts[k])) return EXIT_FAILURE;
+		}
+		ns_old += bench_time(true);
+		ns_new += bench_time(false);
+	}
+	n = (nb_packets + BENCH_BATCH - 1) / BENCH_BATCH * BENCH_BATCH;
+
+	MSG("##### rxpk-bench: %i random packets, outputs identical #####\n", n);
+	MSG("# snprintf: %.0f ns per packet\n", (double)ns_old / n);
+	MSG("# rxpk: %.0f ns per packet, %.1fx faster\n", (double)ns_new / n, (double)ns_old / ns_new);
+	return EXIT_SUCCESS;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
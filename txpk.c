@@ -0,0 +1,575 @@
+/*
+Description:
+	Single-pass parser of the txpk object of a PULL_RESP.
+	The JSON text is scanned once, values are converted where they stand.
+	All txpk keys are 4 chars long, so a key is loaded as a 32-bit word and
+	dispatched by a switch on the packed constants: no string compare, no
+	hash table. Unknown keys and values are skipped. The mandatory fields
+	are checked once the object is read, since the modulation, which tells
+	how to read "datr", may come after it. Numbers must follow the JSON
+	grammar and fit their field, a value out of range fails the parsing
+	rather than wrapping in the cast. String values are used in place unless
+	they hold escapes ("\/" from PHP json_encode for instance), then they are
+	unescaped into a stack buffer first. Unlike parson, which rejected the
+	object, a key given twice is not an error: the last value wins.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stdlib.h>		/* strtod */
+#include <string.h>		/* memset, memcmp, strncmp */
+#include <time.h>		/* struct timespec */
+
+#include "loragw_hal.h"
+#include "base64_simd.h"
+#include "txpk.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define KEY(a, b, c, d)	((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define TXPK_MAX_DEPTH	16	/* nesting limit of the skipped values */
+#define TXPK_STR_SIZE	512	/* unescaped string values, longer than any valid one (344 chars of "data") */
+
+/* fields seen, for the mandatory checks */
+#define F_TXPK		0x0001
+#define F_TIME		0x0002
+#define F_FREQ		0x0004
+#define F_RFCH		0x0008
+#define F_MODU		0x0010
+#define F_DATR_STR	0x0020
+#define F_DATR_NUM	0x0040
+#define F_CODR		0x0080
+#define F_FDEV		0x0100
+#define F_SIZE		0x0200
+#define F_DATA		0x0400
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+/* values that can only be checked at the end of the object */
+struct txpk_state {
+	uint32_t found;
+	uint8_t modulation;		/* 0 if "modu" is not a known modulation */
+	uint8_t sf;				/* from a LoRa "datr" */
+	uint8_t bw;
+	uint32_t fsk_dr;		/* from a FSK "datr" */
+	uint8_t coderate;		/* 0 if "codr" is not a known coderate */
+	const char * datr_err;	/* NULL if the LoRa "datr" is valid */
+	const char * range_err;	/* NULL if all numbers fit their field */
+	bool time_ok;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static inline void skip_ws(const char ** pp) {
+	while ((**pp == ' ') || (**pp == '\t') || (**pp == '\n') || (**pp == '\r')) ++*pp;
+}
+
+/* string value, s and len are the raw chars between the quotes */
+static int get_string(const char ** pp, const char ** s, int * len) {
+	const char * p = *pp;
+
+	if (*p != '"') return -1;
+	*s = ++p;
+	while (*p != '"') {
+		if (*p == 0) return -1;
+		if ((*p == '\\') && (*++p == 0)) return -1;
+		++p;
+	}
+	*len = (int)(p - *s);
+	*pp = p + 1;
+	return 0;
+}
+
+static int hex_digit(char c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+/* string value, as get_string if it has no escape, else decoded and null-terminated in buf */
+/* (a non-ASCII \u escape is turned into '?', no txpk value accepts one) */
+static int get_text(const char ** pp, const char ** s, int * len, char * buf) {
+	const char * r;
+	const char * end;
+	int i, n, h, u;
+
+	if (get_string(pp, s, len) != 0) return -1;
+	if (memchr(*s, '\\', *len) == NULL) return 0;
+	end = *s + *len;
+	for (r = *s, n = 0; r < end; ++n) {
+		if (n == TXPK_STR_SIZE - 1) return -1;
+		if (*r != '\\') {
+			buf[n] = *r++;
+			continue;
+		}
+		++r;
+		switch (*r++) {
+			case '"':  buf[n] = '"';  break;
+			case '\\': buf[n] = '\\'; break;
+			case '/':  buf[n] = '/';  break;
+			case 'b':  buf[n] = '\b'; break;
+			case 'f':  buf[n] = '\f'; break;
+			case 'n':  buf[n] = '\n'; break;
+			case 'r':  buf[n] = '\r'; break;
+			case 't':  buf[n] = '\t'; break;
+			case 'u':
+				for (i = 0, u = 0; i < 4; ++i) {
+					if ((r >= end) || ((h = hex_digit(*r++)) < 0)) return -1;
+					u = (u << 4) | h;
+				}
+				buf[n] = ((u > 0) && (u < 0x80)) ? (char)u : '?';
+				break;
+			default: return -1;
+		}
+	}
+	buf[n] = 0;
+	*s = buf;
+	*len = n;
+	return 0;
+}
+
+static inline bool is_digit(char c) {
+	return (c >= '0') && (c <= '9');
+}
+
+/* JSON number, strtod alone would also take hex, inf, nan and leading zeros */
+static int get_number(const char ** pp, double * v) {
+	const char * p = *pp;
+	char * end;
+
+	if (*p == '-') ++p;
+	if (*p == '0') {
+		++p;
+	} else if (is_digit(*p)) {
+		while (is_digit(*p)) ++p;
+	} else {
+		return -1;
+	}
+	if (*p == '.') {
+		if (!is_digit(*++p)) return -1;
+		while (is_digit(*p)) ++p;
+	}
+	if ((*p == 'e') || (*p == 'E')) {
+		++p;
+		if ((*p == '+') || (*p == '-')) ++p;
+		if (!is_digit(*p)) return -1;
+		while (is_digit(*p)) ++p;
+	}
+	*v = strtod(*pp, &end);
+	if (end != p) return -1;
+	*pp = p;
+	return 0;
+}
+
+/* number that must fit in [min, max] before its cast, the first field out of range is reported at the end */
+static int get_ranged(const char ** pp, double min, double max, const char * err, struct txpk_state * st, double * v) {
+	if (get_number(pp, v) != 0) return -1;
+	if ((*v < min) || (*v > max)) {
+		if (st->range_err == NULL) st->range_err = err;
+		*v = min;
+	}
+	return 0;
+}
+
+static int get_literal(const char ** pp, const char * lit, int len) {
+	if (strncmp(*pp, lit, len) != 0) return -1;
+	*pp += len;
+	return 0;
+}
+
+static int skip_value(const char ** pp, int depth) {
+	const char * s;
+	int len;
+	double v;
+	char close;
+
+	switch (**pp) {
+		case '"':
+			return get_string(pp, &s, &len);
+		case 't':
+			return get_literal(pp, "true", 4);
+		case 'f':
+			return get_literal(pp, "false", 5);
+		case 'n':
+			return get_literal(pp, "null", 4);
+		case '{':
+		case '[':
+			if (depth >= TXPK_MAX_DEPTH) return -1;
+			close = (**pp == '{') ? '}' : ']';
+			++*pp;
+			skip_ws(pp);
+			if (**pp == close) {
+				++*pp;
+				return 0;
+			}
+			for (;;) {
+				if (close == '}') {
+					if (get_string(pp, &s, &len) != 0) return -1;
+					skip_ws(pp);
+					if (**pp != ':') return -1;
+					++*pp;
+					skip_ws(pp);
+				}
+				if (skip_value(pp, depth + 1) != 0) return -1;
+				skip_ws(pp);
+				if (**pp == ',') {
+					++*pp;
+					skip_ws(pp);
+				} else if (**pp == close) {
+					++*pp;
+					return 0;
+				} else {
+					return -1;
+				}
+			}
+		default:
+			return get_number(pp, &v);
+	}
+}
+
+/* true or false, any other value is skipped and read as false */
+static int get_bool(const char ** pp, bool * b) {
+	*b = false;
+	if (get_literal(pp, "true", 4) == 0) {
+		*b = true;
+		return 0;
+	}
+	return skip_value(pp, 1);
+}
+
+/* 1 to max_digits decimal digits */
+static int get_digits(const char ** pp, int max_digits, int * v) {
+	int n;
+
+	*v = 0;
+	for (n = 0; (n < max_digits) && (**pp >= '0') && (**pp <= '9'); ++n) {
+		*v = 10 * *v + (*(*pp)++ - '0');
+	}
+	return (n > 0) ? 0 : -1;
+}
+
+/* "2016-01-31T12:34:56.123456Z", trailing chars ignored */
+static bool parse_time(const char * p, struct timespec * utc) {
+	int y, mo, d, h, mi, sec;
+	int ns = 0, scale = 100000000;
+	long days;
+	int era, yoe, doy, doe;
+
+	if ((get_digits(&p, 4, &y) != 0) || (*p++ != '-')) return false;
+	if ((get_digits(&p, 2, &mo) != 0) || (*p++ != '-')) return false;
+	if ((get_digits(&p, 2, &d) != 0) || (*p++ != 'T')) return false;
+	if ((get_digits(&p, 2, &h) != 0) || (*p++ != ':')) return false;
+	if ((get_digits(&p, 2, &mi) != 0) || (*p++ != ':')) return false;
+	if (get_digits(&p, 2, &sec) != 0) return false;
+	if (*p == '.') {
+		for (++p; (*p >= '0') && (*p <= '9'); ++p) {
+			ns += scale * (*p - '0');
+			scale /= 10;
+		}
+	}
+	if ((mo < 1) || (mo > 12) || (d < 1) || (d > 31) || (h > 23) || (mi > 59) || (sec > 60)) return false;
+
+	/* days since 1970-01-01 in the proleptic Gregorian calendar, no time zone involved */
+	y -= (mo <= 2);
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (mo + ((mo > 2) ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	days = (long)era * 146097 + doe - 719468;
+
+	utc->tv_sec = (time_t)days * 86400 + h * 3600 + mi * 60 + sec;
+	utc->tv_nsec = ns;
+	return true;
+}
+
+/* "SF7BW125" */
+static const char * parse_lora_datr(const char * s, struct txpk_state * st) {
+	int sf, bw;
+
+	if ((s[0] != 'S') || (s[1] != 'F')) return "format error in \"txpk.datr\"";
+	s += 2;
+	if ((get_digits(&s, 2, &sf) != 0) || (s[0] != 'B') || (s[1] != 'W')) return "format error in \"txpk.datr\"";
+	s += 2;
+	if (get_digits(&s, 3, &bw) != 0) return "format error in \"txpk.datr\"";
+	switch (sf) {
+		case  7: st->sf = DR_LORA_SF7;  break;
+		case  8: st->sf = DR_LORA_SF8;  break;
+		case  9: st->sf = DR_LORA_SF9;  break;
+		case 10: st->sf = DR_LORA_SF10; break;
+		case 11: st->sf = DR_LORA_SF11; break;
+		case 12: st->sf = DR_LORA_SF12; break;
+		default: return "format error in \"txpk.datr\", invalid SF";
+	}
+	switch (bw) {
+		case 125: st->bw = BW_125KHZ; break;
+		case 250: st->bw = BW_250KHZ; break;
+		case 500: st->bw = BW_500KHZ; break;
+		default: return "format error in \"txpk.datr\", invalid BW";
+	}
+	return NULL;
+}
+
+static uint8_t parse_codr(const char * s, int len) {
+	if ((len != 3) || (s[1] != '/')) return 0;
+	switch (KEY(s[0], s[2], 0, 0)) {
+		case KEY('4', '5', 0, 0): return CR_LORA_4_5;
+		case KEY('4', '6', 0, 0): return CR_LORA_4_6;
+		case KEY('2', '3', 0, 0): return CR_LORA_4_6;
+		case KEY('4', '7', 0, 0): return CR_LORA_4_7;
+		case KEY('4', '8', 0, 0): return CR_LORA_4_8;
+		case KEY('1', '2', 0, 0): return CR_LORA_4_8;
+		default: return 0;
+	}
+}
+
+static int parse_txpk_object(const char ** pp, struct txpk * t, struct txpk_state * st) {
+	const char * key;
+	const char * s;
+	char buf[TXPK_STR_SIZE];
+	int klen, len;
+	double v;
+
+	if (**pp != '{') return -1;
+	++*pp;
+	skip_ws(pp);
+	if (**pp == '}') {
+		++*pp;
+		return 0;
+	}
+	for (;;) {
+		if (get_string(pp, &key, &klen) != 0) return -1;
+		skip_ws(pp);
+		if (**pp != ':') return -1;
+		++*pp;
+		skip_ws(pp);
+		switch ((klen == 4) ? KEY(key[0], key[1], key[2], key[3]) : 0) {
+			case KEY('i', 'm', 'm', 'e'):
+				if (get_bool(pp, &t->imme) != 0) return -1;
+				break;
+			case KEY('t', 'm', 's', 't'):
+				if (get_ranged(pp, 0.0, UINT32_MAX, "value out of range in \"txpk.tmst\"", st, &v) != 0) return -1;
+				t->pkt.count_us = (uint32_t)v;
+				t->has_tmst = true;
+				break;
+			case KEY('t', 'i', 'm', 'e'):
+				if (get_text(pp, &s, &len, buf) != 0) return -1;
+				st->time_ok = parse_time(s, &t->utc);
+				st->found |= F_TIME;
+				break;
+			case KEY('f', 'r', 'e', 'q'):
+				if (get_ranged(pp, 0.0, UINT32_MAX / 1.0e6, "value out of range in \"txpk.freq\"", st, &v) != 0) return -1;
+				t->pkt.freq_hz = (uint32_t)((double)(1.0e6) * v);
+				st->found |= F_FREQ;
+				break;
+			case KEY('r', 'f', 'c', 'h'):
+				if (get_ranged(pp, 0.0, UINT8_MAX, "value out of range in \"txpk.rfch\"", st, &v) != 0) return -1;
+				t->pkt.rf_chain = (uint8_t)v;
+				st->found |= F_RFCH;
+				break;
+			case KEY('p', 'o', 'w', 'e'):
+				if (get_ranged(pp, INT8_MIN, INT8_MAX, "value out of range in \"txpk.powe\"", st, &v) != 0) return -1;
+				t->pkt.rf_power = (int8_t)v;
+				break;
+			case KEY('m', 'o', 'd', 'u'):
+				if (get_text(pp, &s, &len, buf) != 0) return -1;
+				if ((len == 4) && (memcmp(s, "LORA", 4) == 0)) {
+					st->modulation = MOD_LORA;
+				} else if ((len == 3) && (memcmp(s, "FSK", 3) == 0)) {
+					st->modulation = MOD_FSK;
+				} else {
+					st->modulation = 0;
+				}
+				st->found |= F_MODU;
+				break;
+			case KEY('d', 'a', 't', 'r'):
+				/* string for LoRa, number for FSK */
+				if (**pp == '"') {
+					if (get_text(pp, &s, &len, buf) != 0) return -1;
+					st->datr_err = parse_lora_datr(s, st);
+					st->found |= F_DATR_STR;
+				} else {
+					if (get_ranged(pp, 0.0, UINT32_MAX, "value out of range in \"txpk.datr\"", st, &v) != 0) return -1;
+					st->fsk_dr = (uint32_t)v;
+					st->found |= F_DATR_NUM;
+				}
+				break;
+			case KEY('c', 'o', 'd', 'r'):
+				if (get_text(pp, &s, &len, buf) != 0) return -1;
+				st->coderate = parse_codr(s, len);
+				st->found |= F_CODR;
+				break;
+			case KEY('f', 'd', 'e', 'v'):
+				if (get_ranged(pp, 0.0, 1000.0 * UINT8_MAX, "value out of range in \"txpk.fdev\"", st, &v) != 0) return -1;
+				t->pkt.f_dev = (uint8_t)(v / 1000.0); /* JSON value in Hz, f_dev in kHz */
+				st->found |= F_FDEV;
+				break;
+			case KEY('i', 'p', 'o', 'l'):
+				if (get_bool(pp, &t->pkt.invert_pol) != 0) return -1;
+				break;
+			case KEY('p', 'r', 'e', 'a'):
+				if (get_ranged(pp, 0.0, UINT16_MAX, "value out of range in \"txpk.prea\"", st, &v) != 0) return -1;
+				t->pkt.preamble = (v >= 1.0) ? (uint16_t)v : 1; /* 0 is kept for an absent field */
+				break;
+			case KEY('s', 'i', 'z', 'e'):
+				if (get_ranged(pp, 0.0, UINT16_MAX, "value out of range in \"txpk.size\"", st, &v) != 0) return -1;
+				t->pkt.size = (uint16_t)v;
+				st->found |= F_SIZE;
+				break;
+			case KEY('d', 'a', 't', 'a'):
+				if (get_text(pp, &s, &len, buf) != 0) return -1;
+				t->data_size = b64_to_bin_simd(s, len, t->pkt.payload, sizeof t->pkt.payload);
+				st->found |= F_DATA;
+				break;
+			case KEY('n', 'c', 'r', 'c'):
+				if (get_bool(pp, &t->pkt.no_crc) != 0) return -1;
+				break;
+			default:
+				if (skip_value(pp, 1) != 0) return -1;
+				break;
+		}
+		skip_ws(pp);
+		if (**pp == ',') {
+			++*pp;
+			skip_ws(pp);
+		} else if (**pp == '}') {
+			++*pp;
+			return 0;
+		} else {
+			return -1;
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int txpk_parse(const char * json, struct txpk * t, const char ** err) {
+	struct txpk_state st;
+	const char * p = json;
+	const char * key;
+	int klen;
+
+	memset(t, 0, sizeof *t);
+	memset(&st, 0, sizeof st);
+	t->data_size = -1;
+	*err = "invalid JSON";
+
+	/* root object, only "txpk" is parsed */
+	skip_ws(&p);
+	if (*p != '{') return -1;
+	++p;
+	skip_ws(&p);
+	while (*p != '}') {
+		if (get_string(&p, &key, &klen) != 0) return -1;
+		skip_ws(&p);
+		if (*p != ':') return -1;
+		++p;
+		skip_ws(&p);
+		if ((klen == 4) && (KEY(key[0], key[1], key[2], key[3]) == KEY('t', 'x', 'p', 'k')) && (*p == '{')) {
+			if (parse_txpk_object(&p, t, &st) != 0) return -1;
+			st.found |= F_TXPK;
+		} else {
+			if (skip_value(&p, 1) != 0) return -1;
+		}
+		skip_ws(&p);
+		if (*p == ',') {
+			++p;
+			skip_ws(&p);
+		} else if (*p != '}') {
+			return -1;
+		}
+	}
+
+	/* mandatory fields */
+	if (!(st.found & F_TXPK)) {
+		*err = "no \"txpk\" object in JSON";
+		return -1;
+	}
+	if (st.range_err != NULL) {
+		*err = st.range_err;
+		return -1;
+	}
+	if ((t->imme == false) && (t->has_tmst == false)) {
+		if (!(st.found & F_TIME)) {
+			*err = "no mandatory \"txpk.tmst\" or \"txpk.time\" objects in JSON";
+			return -1;
+		}
+		if (st.time_ok == false) {
+			*err = "\"txpk.time\" must follow ISO 8601 format";
+			return -1;
+		}
+	}
+	if (!(st.found & F_FREQ)) {
+		*err = "no mandatory \"txpk.freq\" object in JSON";
+		return -1;
+	}
+	if (!(st.found & F_RFCH)) {
+		*err = "no mandatory \"txpk.rfch\" object in JSON";
+		return -1;
+	}
+	if (!(st.found & F_MODU)) {
+		*err = "no mandatory \"txpk.modu\" object in JSON";
+		return -1;
+	}
+	t->pkt.modulation = st.modulation;
+	if (st.modulation == MOD_LORA) {
+		if (!(st.found & F_DATR_STR)) {
+			*err = "no mandatory \"txpk.datr\" object in JSON";
+			return -1;
+		}
+		if (st.datr_err != NULL) {
+			*err = st.datr_err;
+			return -1;
+		}
+		t->pkt.datarate = st.sf;
+		t->pkt.bandwidth = st.bw;
+		if (!(st.found & F_CODR)) {
+			*err = "no mandatory \"txpk.codr\" object in JSON";
+			return -1;
+		}
+		if (st.coderate == 0) {
+			*err = "format error in \"txpk.codr\"";
+			return -1;
+		}
+		t->pkt.coderate = st.coderate;
+	} else if (st.modulation == MOD_FSK) {
+		if (!(st.found & F_DATR_NUM)) {
+			*err = "no mandatory \"txpk.datr\" object in JSON";
+			return -1;
+		}
+		t->pkt.datarate = st.fsk_dr;
+		if (!(st.found & F_FDEV)) {
+			*err = "no mandatory \"txpk.fdev\" object in JSON";
+			return -1;
+		}
+	} else {
+		*err = "invalid modulation in \"txpk.modu\"";
+		return -1;
+	}
+	if (!(st.found & F_SIZE)) {
+		*err = "no mandatory \"txpk.size\" object in JSON";
+		return -1;
+	}
+	if (!(st.found & F_DATA)) {
+		*err = "no mandatory \"txpk.data\" object in JSON";
+		return -1;
+	}
+	*err = NULL;
+	return 0;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
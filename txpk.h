@@ -0,0 +1,48 @@
+/*
+Description:
+	Single-pass parser of the txpk object of a PULL_RESP.
+	Fields are decoded straight into a struct lgw_pkt_tx_s, the payload is
+	base64-decoded from the datagram into the packet, nothing is allocated.
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+#ifndef _TXPK_H
+#define _TXPK_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <time.h>		/* struct timespec */
+
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct txpk {
+	struct lgw_pkt_tx_s pkt;	/* count_us only set from "tmst", preamble 0 if "prea" is absent */
+	bool imme;					/* "imme" is true */
+	bool has_tmst;				/* "tmst" present, pkt.count_us is set */
+	struct timespec utc;		/* "time", only set if neither "imme" nor "tmst" */
+	int data_size;				/* number of bytes decoded from "data", -1 if not base64 */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Parse a PULL_RESP JSON payload and check the mandatory txpk fields
+@param json null-terminated JSON text, typ. the datagram after its 4-byte header
+@param t pointer to the result, overwritten
+@param err set to a description of the problem when the parsing fails
+@return 0 if the txpk object is complete and valid, -1 otherwise
+*/
+int txpk_parse(const char * json, struct txpk * t, const char ** err);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
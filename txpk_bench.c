@@ -0,0 +1,263 @@
+/*
+Description:
+	txpk-bench: compare txpk_parse with the parson-based parsing it replaced.
+	Typical PULL_RESP payloads (LoRa on timestamp, LoRa on UTC time, FSK
+	immediate) are parsed by both, the results are checked to be the same,
+	then each parser is timed over many iterations. The parson path builds
+	the DOM, looks the keys up, runs sscanf on the strings and frees the
+	tree as thread_down used to; its heap allocations are counted through
+	the parson allocation hooks.
+
+	Usage: txpk-bench [iterations]
+
+License: Revised BSD License, see LICENSE.TXT file include in the project
+*/
+
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+/* fix an issue between POSIX and C99 */
+#if __STDC_VERSION__ >= 199901L
+	#define _XOPEN_SOURCE 600
+#else
+	#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdint.h>		/* C99 types */
+#include <stdbool.h>	/* bool type */
+#include <stdio.h>		/* printf, sscanf */
+#include <stdlib.h>		/* atoi, malloc, free */
+#include <string.h>		/* memset, memcmp, strcmp, strlen */
+#include <time.h>		/* clock_gettime, mktime */
+#include <math.h>		/* modf */
+
+#include "parson.h"
+#include "loragw_hal.h"
+#include "base64_simd.h"
+#include "txpk.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define MSG(args...)	printf(args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define BENCH_ITERATIONS	1000000
+
+static const char * bench_json[] = {
+	"{\"txpk\":{\"imme\":false,\"tmst\":3512348611,\"freq\":869.525,\"rfch\":0,\"powe\":14,\"modu\":\"LORA\",\"datr\":\"SF9BW125\",\"codr\":\"4/5\",\"ipol\":true,\"size\":32,\"data\":\"YHBhYUoAAgABAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=\",\"ncrc\":true}}",
+	"{\"txpk\":{\"time\":\"2024-05-03T10:12:45.123456Z\",\"freq\":868.1,\"rfch\":0,\"powe\":14,\"modu\":\"LORA\",\"datr\":\"SF12BW125\",\"codr\":\"4/5\",\"ipol\":true,\"prea\":8,\"size\":12,\"data\":\"YBQCBJIAAwAB8sHG\"}}",
+	"{\"txpk\":{\"imme\":true,\"freq\":868.8,\"rfch\":0,\"powe\":14,\"modu\":\"FSK\",\"datr\":50000,\"fdev\":25000,\"prea\":5,\"size\":16,\"data\":\"AQIDBAUGBwgJCgsMDQ4PEA==\"}}"
+};
+
+#define BENCH_NB_JSON	(int)(sizeof bench_json / sizeof bench_json[0])
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static uint32_t bench_nb_malloc = 0;
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static void * bench_malloc(size_t size) {
+	++bench_nb_malloc;
+	return malloc(size);
+}
+
+static uint64_t bench_ns(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* parsing of thread_down before txpk_parse, the GPS conversion of "time" left out */
+static int parse_parson(const char * json, struct lgw_pkt_tx_s * pkt, struct timespec * utc) {
+	JSON_Value * root_val;
+	JSON_Object * txpk_obj;
+	JSON_Value * val;
+	const char * str;
+	short x0, x1, x2, x3, x4;
+	double x5, x6;
+	struct tm utc_vector;
+	int i;
+
+	memset(pkt, 0, sizeof *pkt);
+	memset(utc, 0, sizeof *utc);
+	root_val = json_parse_string_with_comments(json);
+	if (root_val == NULL) return -1;
+	txpk_obj = json_object_get_object(json_value_get_object(root_val), "txpk");
+	if (txpk_obj == NULL) goto fail;
+
+	if (json_object_get_boolean(txpk_obj, "imme") == 1) {
+		pkt->tx_mode = IMMEDIATE;
+	} else {
+		pkt->tx_mode = TIMESTAMPED;
+		val = json_object_get_value(txpk_obj, "tmst");
+		if (val != NULL) {
+			pkt->count_us = (uint32_t)json_value_get_number(val);
+		} else {
+			str = json_object_get_string(txpk_obj, "time");
+			if (str == NULL) goto fail;
+			if (sscanf(str, "%4hd-%2hd-%2hdT%2hd:%2hd:%9lf", &x0, &x1, &x2, &x3, &x4, &x5) != 6) goto fail;
+			x5 = modf(x5, &x6);
+			memset(&utc_vector, 0, sizeof utc_vector);
+			utc_vector.tm_year = x0 - 1900;
+			utc_vector.tm_mon = x1 - 1;
+			utc_vector.tm_mday = x2;
+			utc_vector.tm_hour = x3;
+			utc_vector.tm_min = x4;
+			utc_vector.tm_sec = (int)x6;
+			utc->tv_sec = mktime(&utc_vector) - timezone;
+			utc->tv_nsec = (long)(1e9 * x5);
+		}
+	}
+	val = json_object_get_value(txpk_obj, "ncrc");
+	if (val != NULL) pkt->no_crc = (bool)json_value_get_boolean(val);
+	val = json_object_get_value(txpk_obj, "freq");
+	if (val == NULL) goto fail;
+	pkt->freq_hz = (uint32_t)((double)(1.0e6) * json_value_get_number(val));
+	val = json_object_get_value(txpk_obj, "rfch");
+	if (val == NULL) goto fail;
+	pkt->rf_chain = (uint8_t)json_value_get_number(val);
+	val = json_object_get_value(txpk_obj, "powe");
+	if (val != NULL) pkt->rf_power = (int8_t)json_value_get_number(val);
+	str = json_object_get_string(txpk_obj, "modu");
+	if (str == NULL) goto fail;
+	if (strcmp(str, "LORA") == 0) {
+		pkt->modulation = MOD_LORA;
+		str = json_object_get_string(txpk_obj, "datr");
+		if ((str == NULL) || (sscanf(str, "SF%2hdBW%3hd", &x0, &x1) != 2)) goto fail;
+		switch (x0) {
+			case  7: pkt->datarate = DR_LORA_SF7;  break;
+			case  8: pkt->datarate = DR_LORA_SF8;  break;
+			case  9: pkt->datarate = DR_LORA_SF9;  break;
+			case 10: pkt->datarate = DR_LORA_SF10; break;
+			case 11: pkt->datarate = DR_LORA_SF11; break;
+			case 12: pkt->datarate = DR_LORA_SF12; break;
+			default: goto fail;
+		}
+		switch (x1) {
+			case 125: pkt->bandwidth = BW_125KHZ; break;
+			case 250: pkt->bandwidth = BW_250KHZ; break;
+			case 500: pkt->bandwidth = BW_500KHZ; break;
+			default: goto fail;
+		}
+		str = json_object_get_string(txpk_obj, "codr");
+		if (str == NULL) goto fail;
+		if      (strcmp(str, "4/5") == 0) pkt->coderate = CR_LORA_4_5;
+		else if (strcmp(str, "4/6") == 0) pkt->coderate = CR_LORA_4_6;
+		else if (strcmp(str, "2/3") == 0) pkt->coderate = CR_LORA_4_6;
+		else if (strcmp(str, "4/7") == 0) pkt->coderate = CR_LORA_4_7;
+		else if (strcmp(str, "4/8") == 0) pkt->coderate = CR_LORA_4_8;
+		else if (strcmp(str, "1/2") == 0) pkt->coderate = CR_LORA_4_8;
+		else goto fail;
+		val = json_object_get_value(txpk_obj, "ipol");
+		if (val != NULL) pkt->invert_pol = (bool)json_value_get_boolean(val);
+	} else if (strcmp(str, "FSK") == 0) {
+		pkt->modulation = MOD_FSK;
+		val = json_object_get_value(txpk_obj, "datr");
+		if (val == NULL) goto fail;
+		pkt->datarate = (uint32_t)(json_value_get_number(val));
+		val = json_object_get_value(txpk_obj, "fdev");
+		if (val == NULL) goto fail;
+		pkt->f_dev = (uint8_t)(json_value_get_number(val) / 1000.0);
+	} else {
+		goto fail;
+	}
+	val = json_object_get_value(txpk_obj, "prea");
+	if (val != NULL) pkt->preamble = (uint16_t)json_value_get_number(val);
+	val = json_object_get_value(txpk_obj, "size");
+	if (val == NULL) goto fail;
+	pkt->size = (uint16_t)json_value_get_number(val);
+	str = json_object_get_string(txpk_obj, "data");
+	if (str == NULL) goto fail;
+	i = b64_to_bin_simd(str, strlen(str), pkt->payload, sizeof pkt->payload);
+	json_value_free(root_val);
+	return (i == pkt->size) ? 0 : -1;
+
+fail:
+	json_value_free(root_val);
+	return -1;
+}
+
+/* parsing of thread_down with txpk_parse */
+static int parse_txpk(const char * json, struct lgw_pkt_tx_s * pkt, struct timespec * utc) {
+	struct txpk t;
+	const char * err;
+
+	if (txpk_parse(json, &t, &err) != 0) return -1;
+	t.pkt.tx_mode = t.imme ? IMMEDIATE : TIMESTAMPED;
+	*pkt = t.pkt;
+	*utc = t.utc;
+	return (t.data_size == t.pkt.size) ? 0 : -1;
+}
+
+/* both parsers must agree before they are timed */
+static bool bench_same(const char * json) {
+	struct lgw_pkt_tx_s a, b;
+	struct timespec ua, ub;
+
+	if ((parse_parson(json, &a, &ua) != 0) || (parse_txpk(json, &b, &ub) != 0)) return false;
+	return (a.tx_mode == b.tx_mode) && (a.count_us == b.count_us) && (ua.tv_sec == ub.tv_sec)
+		&& (labs(ua.tv_nsec - ub.tv_nsec) < 1000) && (a.freq_hz == b.freq_hz) && (a.rf_chain == b.rf_chain)
+		&& (a.rf_power == b.rf_power) && (a.modulation == b.modulation) && (a.datarate == b.datarate)
+		&& (a.bandwidth == b.bandwidth) && (a.coderate == b.coderate) && (a.invert_pol == b.invert_pol)
+		&& (a.f_dev == b.f_dev) && (a.preamble == b.preamble) && (a.no_crc == b.no_crc)
+		&& (a.size == b.size) && (memcmp(a.payload, b.payload, a.size) == 0);
+}
+
+/* mean time of a parse in ns */
+static double bench_time(int (*parse)(const char *, struct lgw_pkt_tx_s *, struct timespec *), const char * json, int iterations) {
+	struct lgw_pkt_tx_s pkt;
+	struct timespec utc;
+	uint64_t start;
+	int i;
+
+	start = bench_ns();
+	for (i = 0; i < iterations; ++i) {
+		parse(json, &pkt, &utc);
+	}
+	return (double)(bench_ns() - start) / iterations;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char ** argv) {
+	int iterations = BENCH_ITERATIONS;
+	double t_parson, t_txpk;
+	uint32_t nb_malloc;
+	int k;
+
+	if ((argc > 2) || ((argc > 1) && ((iterations = atoi(argv[1])) <= 0))) {
+		MSG("Usage: txpk-bench [iterations]\n");
+		return EXIT_FAILURE;
+	}
+	tzset();
+	b64_simd_init();
+	json_set_allocation_functions(bench_malloc, free);
+
+	MSG("##### txpk-bench: %i iterations per payload #####\n", iterations);
+	for (k = 0; k < BENCH_NB_JSON; ++k) {
+		if (!bench_same(bench_json[k])) {
+			MSG("ERROR: parsers disagree on %s\n", bench_json[k]);
+			return EXIT_FAILURE;
+		}
+		bench_nb_malloc = 0;
+		t_parson = bench_time(parse_parson, bench_json[k], iterations);
+		nb_malloc = bench_nb_malloc;
+		bench_nb_malloc = 0;
+		t_txpk = bench_time(parse_txpk, bench_json[k], iterations);
+		MSG("### %s\n", bench_json[k]);
+		MSG("# parson: %.0f ns, %.1f allocations per parse\n", t_parson, (double)nb_malloc / iterations);
+		MSG("# txpk_parse: %.0f ns, %.1f allocations per parse, %.1fx faster\n", t_txpk, (double)bench_nb_malloc / iterations, t_parson / t_txpk);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* --- EOF ------------------------------------------------------------------ */